@@ -712,12 +712,53 @@ INLINE void FileHeader::restorePointerOffsets(void* pBufferArea)
 }
 //--------------------------------
 // 
+/// what the buffer area of a file takes once loaded, as far as the file tells : the size of
+/// an uncompressed file or the one of the gzip trailer (modulo 4Gb), less the header area.
+/// Only a first guess for load() : the stream decides
+// 
+//--------------------------------
+INLINE static size_t bufferAreaSizeHint(const char * fname, unsigned int nodeByteSize)
+{
+    FILE *file = fopen(fname, "rb");
+    if(!file)
+        return 0;
+    unsigned char magic[2] = { 0, 0 };
+    fread(magic, 1, 2, file);
+#ifdef _WIN32
+    _fseeki64(file, 0, SEEK_END);
+    unsigned long long sz = (unsigned long long)_ftelli64(file);
+#else
+    fseeko(file, 0, SEEK_END);
+    unsigned long long sz = (unsigned long long)ftello(file);
+#endif
+    // http://www.onicos.com/staff/iz/formats/gzip.html header must have 0x1f 0x8b
+    if((magic[0] == 0x1f) && (magic[1] == 0x8b) && (sz >= 4))
+    {
+        unsigned char isize[4] = { 0, 0, 0, 0 };
+#ifdef _WIN32
+        _fseeki64(file, (__int64)sz - 4, SEEK_SET);
+#else
+        fseeko(file, (off_t)sz - 4, SEEK_SET);
+#endif
+        fread(isize, 1, 4, file);
+        sz = isize[0] | (isize[1] << 8) | (isize[2] << 16) | ((unsigned long long)isize[3] << 24);
+    }
+    fclose(file);
+    return sz > nodeByteSize ? (size_t)(sz - nodeByteSize) : 0;
+}
+//--------------------------------
+// 
 /// LOAD function
 /// 
 /// Returns the baked structure of all the data you need to work
+///
+/// The buffer area can be any size : it is read until the end of the stream. The format
+/// itself addresses the file with 32 bits offsets (RelocationTable::Offsets,
+/// Slot::vtxBufferSizeBytes, PrimGroup::indexArrayByteSize) : what the pointers refer to
+/// must start within the first 4Gb of the file
 // 
 //--------------------------------
-INLINE static FileHeader * load(const char * fname, void ** pBufferMemory=NULL, unsigned int* bufferMemorySz=NULL)
+INLINE static FileHeader * load(const char * fname, void ** pBufferMemory=NULL, size_t* bufferMemorySz=NULL)
 {
     GFILE fd = NULL;
     if(!fname)
@@ -728,25 +769,6 @@ INLINE static FileHeader * load(const char * fname, void ** pBufferMemory=NULL,
       EPRINTF((TEXT("Error : couldn't load ") FSTR TEXT("\n"), fname));
         return NULL;
     }
-	unsigned LONG realsize = 0;
-#ifdef NOGZLIB
-    fseek(fd, 0, SEEK_END);
-	realsize = ftell(fd);
-    fseek(fd, 0, SEEK_SET);
-#else
-	FILE *file = fopen(fname,"rb");
-    // http://www.onicos.com/staff/iz/formats/gzip.html header must have 0x1f 0x8b
-    unsigned short header;
-    fread(&header, 2, 1, file);
-    fseek(file, 0, SEEK_END);
-	realsize = ftell(file);
-    if(header == 0x8b1f) // fetch the real size at the end
-    {
-        fseek(file, realsize-4, SEEK_SET);
-	    fread(&realsize, 4, 1, file);
-    }
-	fclose(file);
-#endif
     // load the Node, first
     int n = 0;
     unsigned int offs = sizeof(Node);
@@ -757,6 +779,7 @@ INLINE static FileHeader * load(const char * fname, void ** pBufferMemory=NULL,
       PRINTF((TEXT("Error>> Wrong version in Mesh description\n")));
       PRINTF((TEXT("needed %x and got %x\n"), RAWMESHVERSION, ((FileHeader *)memory)->version));
       free(memory);
+      GCLOSE(fd);
       return NULL;
     }
     // This represents the size of the structures defining the Meshes
@@ -764,14 +787,62 @@ INLINE static FileHeader * load(const char * fname, void ** pBufferMemory=NULL,
     memory = (char*)realloc(memory, modelStructSize);
     n= GREAD(fd, memory + offs, modelStructSize - offs);
     // Now anything beyond this is Buffer Memory : vertex tables etc.
-    char *memory2 = (char*)malloc(realsize - modelStructSize);
-    n= GREAD(fd, memory2, realsize - modelStructSize);
+    // The final size isn't known for sure (the gzip trailer only has it modulo 4Gb) :
+    // start from what the file tells and inflate until the end of the stream, growing
+    // the buffer geometrically if there is more
+    size_t memory2Sz = 0;
+    size_t memory2Capacity = bufferAreaSizeHint(fname, modelStructSize);
+    if(memory2Capacity == 0)
+        memory2Capacity = 1<<20;
+    char *memory2 = (char*)malloc(memory2Capacity);
+    while(memory2)
+    {
+        if(memory2Sz == memory2Capacity)
+        {
+            // full : only grow if the stream has more
+            char probe[4096];
+            n= GREAD(fd, probe, sizeof(probe));
+            if(n <= 0)
+                break;
+            memory2Capacity *= 2;
+            if(memory2Capacity < memory2Sz + n)
+                memory2Capacity = memory2Sz + n;
+            char *p = (char*)realloc(memory2, memory2Capacity);
+            if(!p)
+            {
+                free(memory2);
+                memory2 = NULL;
+                break;
+            }
+            memory2 = p;
+            memcpy(memory2 + memory2Sz, probe, n);
+            memory2Sz += n;
+            continue;
+        }
+        // GREAD takes an unsigned int : read at most 1Gb at once
+        size_t toRead = memory2Capacity - memory2Sz;
+        if(toRead > (1<<30))
+            toRead = 1<<30;
+        n= GREAD(fd, memory2 + memory2Sz, toRead);
+        if(n <= 0)
+            break;
+        memory2Sz += n;
+    }
+    if(fd)
+        GCLOSE(fd);
+    if(!memory2)
+    {
+        EPRINTF((TEXT("Error : not enough memory to load ") FSTR TEXT("\n"), fname));
+        free(memory);
+        return NULL;
+    }
+    // give back what the last growth didn't use
+    if(memory2Sz > 0)
+        memory2 = (char*)realloc(memory2, memory2Sz);
     if(bufferMemorySz)
-        *bufferMemorySz = n;
+        *bufferMemorySz = memory2Sz;
     if(pBufferMemory)
         *pBufferMemory = memory2;
-    if(fd)
-        GCLOSE(fd);
     ((FileHeader *)memory)->resolvePointers(memory2);
     //PRINTF((TEXT("Loaded ") FSTR TEXT(" (mesh version %x)\n"), fname, ((FileHeader *)memory)->version));
     return (FileHeader *)memory;
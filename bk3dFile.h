@@ -0,0 +1,1039 @@
+#pragma once
+/*-----------------------------------------------------------------------
+    Copyright (c) 2013, Tristan Lorach. All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+     * Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+     * Neither the name of its contributors may be used to endorse
+       or promote products derived from this software without specific
+       prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+    EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+    PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+    CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+    EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+    PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+    PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+    OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+    feedback to lorachnroll@gmail.com (Tristan Lorach)
+*/ //--------------------------------------------------------------------
+/**
+ ** File-level helpers on top of bk3dBase.h : ways to get a bk3d file
+ ** in memory other than the basic bk3d::load()
+ ** - memory mapping of uncompressed files (no copy of the buffer area)
+ ** - chunked container (.bk3dc) : independently compressed blocks inflated
+ **   in parallel straight into the header and buffer areas
+ ** - prelinked image (.bk3dr) : pointers already resolved for a preferred
+ **   address, so that mapping it there needs no relocation pass
+ ** - header area only : the buffer area is left in the stream for the caller
+ ** - content hash of a file, to key caches of processed data
+ ** - file image already in memory (stored or gzip), e.g. read once to be hashed
+ ** - pack archive (.bk3dp) : many models in one file, found by name in a
+ **   table of contents read once (PackFile) and either mapped or loaded with
+ **   a single seek
+ **/
+#ifndef __BK3DFILE__
+#define __BK3DFILE__
+#include "bk3dBase.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+#ifndef NOGZLIB
+#   include <thread>
+#   include <atomic>
+#endif
+#ifdef _WIN32
+#   ifndef NOMINMAX
+#       define NOMINMAX
+#   endif
+#   include <windows.h>
+#   include <sys/types.h>
+#   include <sys/stat.h>
+#else
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <fcntl.h>
+#   include <unistd.h>
+#endif
+
+namespace bk3d
+{
+//
+// Chunked container : the uncompressed bk3d file (header area followed by the buffer area)
+// is cut in blocks of at most chunkSize bytes, each one compressed on its own with zlib.
+// Blocks never straddle the header/buffer boundary, so that each of them can be inflated
+// straight to its final location.
+//
+// layout : ChunkedFileHeader | ChunkEntry[numChunks] | compressed blocks...
+//
+#define CHUNKEDFILE_MAGIC   0x43334b42 // 'BK3C'
+#define CHUNKEDFILE_VERSION 0x100
+#define CHUNKEDFILE_CHUNKSZ (1<<20)
+
+struct ChunkedFileHeader
+{
+    unsigned int        magic;          ///< CHUNKEDFILE_MAGIC
+    unsigned int        version;        ///< CHUNKEDFILE_VERSION
+    unsigned int        chunkSize;      ///< max uncompressed size of a block
+    unsigned int        numChunks;      ///< amount of ChunkEntry following this header
+    unsigned int        nodeByteSize;   ///< size of the header area (FileHeader::nodeByteSize)
+    unsigned int        pad;
+    unsigned long long  rawSize;        ///< size of the uncompressed bk3d file
+};
+struct ChunkEntry
+{
+    unsigned long long  fileOffset;     ///< where the compressed block is in the container
+    unsigned int        compressedSize;
+    unsigned int        rawSize;        ///< raw offset of a block is the sum of the previous rawSizes
+};
+
+//
+// Prelinked image : a RelocatedFileHeader padded to RELOCATEDFILE_HEADERSZ, followed by the
+// bk3d file as-is (header area then buffer area) but with all its pointers already resolved
+// as if the image was at preferredBase. When mapFile() gets this address, nothing gets
+// written : pages are only faulted-in when touched. Otherwise pointers are rebased.
+//
+// RELOCATEDFILE_HEADERSZ is the allocation granularity of Windows, so that the FileHeader
+// is at the same offset of the view whatever the OS
+//
+#define RELOCATEDFILE_MAGIC   0x52334b42 // 'BK3R'
+#define RELOCATEDFILE_VERSION 0x100
+#define RELOCATEDFILE_HEADERSZ (64*1024)
+
+struct RelocatedFileHeader
+{
+    unsigned int        magic;          ///< RELOCATEDFILE_MAGIC
+    unsigned int        version;        ///< RELOCATEDFILE_VERSION
+    unsigned long long  preferredBase;  ///< address of the mapping the pointers were resolved for
+};
+
+//------------------------------------------------------------------------------------------
+//
+/// moves all the pointers of a resolved FileHeader : they currently assume the FileHeader
+/// to be at fromHeaderAddr, with the buffer area right after the header area. After this
+/// call, they assume toHeaderAddr for the header area and toBufferAddr for the buffer area
+/// (0 : right after the header area). pBufferArea is where the buffer area is now, to reach
+/// the pointers it holds
+//
+//------------------------------------------------------------------------------------------
+INLINE static void rebasePointers(FileHeader* pHeader, void* pBufferArea, unsigned long long fromHeaderAddr, unsigned long long toHeaderAddr, unsigned long long toBufferAddr=0)
+{
+    unsigned long long delta = toHeaderAddr - fromHeaderAddr;
+    unsigned long long bufferDelta = toBufferAddr ? toBufferAddr - (fromHeaderAddr + pHeader->nodeByteSize) : delta;
+    // pointers may not be valid where we are now : find the table from the offsets
+    RelocationTable* pTable = (RelocationTable*)((char*)pHeader + ((unsigned long long)pHeader->pRelocationTable - fromHeaderAddr));
+    RelocationTable::Offsets* pOffsets = (RelocationTable::Offsets*)((char*)pHeader + ((unsigned long long)pTable->pRelocationOffsets - fromHeaderAddr));
+    for(int i=0; i < pTable->numRelocationOffsets; i++)
+    {
+        char* ptr = (char*)pHeader;
+        unsigned LONG offs = pOffsets[i].ptrOffset;
+        if(offs == 0)
+            continue;
+        if(offs >= pHeader->nodeByteSize)
+            ptr = (char*)pBufferArea + offs - pHeader->nodeByteSize;
+        else
+            ptr += offs;
+        unsigned long long *ptr2 = (unsigned long long *)ptr;
+        if(*ptr2)
+            *ptr2 += pOffsets[i].offset >= pHeader->nodeByteSize ? bufferDelta : delta;
+    }
+    pTable->pRelocationOffsets = (RelocationTable::Offsets*)((unsigned long long)pTable->pRelocationOffsets + delta);
+    pHeader->pRelocationTable = (RelocationTable*)((unsigned long long)pHeader->pRelocationTable + delta);
+}
+
+///
+/// \brief handles of a file mapped in memory with mapFile()
+///
+/// The mapping is private (copy-on-write) : resolving the pointers only
+/// dirties the pages of the header area. Vertex and index data are used in
+/// place and only paged-in when touched.
+///
+struct FileMapping
+{
+    void*           base;   ///< address of the mapping : the FileHeader is at the very beginning (or after the RelocatedFileHeader)
+    size_t          size;   ///< size in bytes of the whole file
+    bool            rebased;///< prelinked image that couldn't be mapped at its preferred address
+#ifdef _WIN32
+    HANDLE          hFile;
+    HANDLE          hMapping;
+#else
+    int             fd;
+#endif
+    FileMapping() { base = NULL; size = 0; rebased = false;
+#ifdef _WIN32
+        hFile = INVALID_HANDLE_VALUE; hMapping = NULL;
+#else
+        fd = -1;
+#endif
+    }
+};
+
+//------------------------------------------------------------------------------------------
+//
+/// releases what mapFile() created. Any pointer coming from the FileHeader becomes invalid
+//
+//------------------------------------------------------------------------------------------
+INLINE static void unmapFile(FileMapping* pMapping)
+{
+    if(!pMapping)
+        return;
+#ifdef _WIN32
+    if(pMapping->base)
+        UnmapViewOfFile(pMapping->base);
+    if(pMapping->hMapping)
+        CloseHandle(pMapping->hMapping);
+    if(pMapping->hFile != INVALID_HANDLE_VALUE)
+        CloseHandle(pMapping->hFile);
+    pMapping->hMapping = NULL;
+    pMapping->hFile = INVALID_HANDLE_VALUE;
+#else
+    if(pMapping->base)
+        munmap(pMapping->base, pMapping->size);
+    if(pMapping->fd >= 0)
+        close(pMapping->fd);
+    pMapping->fd = -1;
+#endif
+    pMapping->base = NULL;
+    pMapping->size = 0;
+    pMapping->rebased = false;
+}
+
+//------------------------------------------------------------------------------------------
+//
+/// maps size bytes of a file from offset (0 : up to the end of the file), privately
+/// (copy-on-write) : the writes of resolvePointers() never reach the file. offset must be a
+/// multiple of the allocation granularity (64Kb on Windows). preferredBase is only a hint
+//
+//------------------------------------------------------------------------------------------
+INLINE static bool mapFileView(const char * fname, unsigned long long offset, size_t size, void* preferredBase, FileMapping* pMapping)
+{
+#ifdef _WIN32
+    pMapping->hFile = CreateFileA(fname, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+    if(pMapping->hFile == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER sz;
+    GetFileSizeEx(pMapping->hFile, &sz);
+    pMapping->size = size ? size : (size_t)(sz.QuadPart - offset);
+    // PAGE_WRITECOPY + FILE_MAP_COPY : copy-on-write
+    pMapping->hMapping = CreateFileMappingA(pMapping->hFile, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+    if(pMapping->hMapping && pMapping->size)
+    {
+        pMapping->base = MapViewOfFileEx(pMapping->hMapping, FILE_MAP_COPY, (DWORD)(offset >> 32), (DWORD)offset, pMapping->size, preferredBase);
+        if((pMapping->base == NULL) && preferredBase)
+            pMapping->base = MapViewOfFileEx(pMapping->hMapping, FILE_MAP_COPY, (DWORD)(offset >> 32), (DWORD)offset, pMapping->size, NULL);
+    }
+#else
+    pMapping->fd = open(fname, O_RDONLY);
+    if(pMapping->fd < 0)
+        return false;
+    struct stat st;
+    if((fstat(pMapping->fd, &st) == 0) && ((unsigned long long)st.st_size > offset))
+        pMapping->size = size ? size : (size_t)(st.st_size - offset);
+    // MAP_PRIVATE : copy-on-write
+    if(pMapping->size > 0)
+    {
+        pMapping->base = mmap(preferredBase, pMapping->size, PROT_READ|PROT_WRITE, MAP_PRIVATE, pMapping->fd, (off_t)offset);
+        if(pMapping->base == MAP_FAILED)
+            pMapping->base = NULL;
+    }
+#endif
+    if(pMapping->base == NULL)
+    {
+        EPRINTF((TEXT("Error : couldn't map ") FSTR TEXT("\n"), fname));
+        unmapFile(pMapping);
+        return false;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------------------
+//
+/// tells what an uncompressed bk3d image starts with : *pRh is a RelocatedFileHeader of
+/// a prelinked image if the function returns 1, 0 for a plain bk3d file and -1 for things
+/// that can't be mapped (gzip, chunked container)
+//
+//------------------------------------------------------------------------------------------
+INLINE static int sniffImage(FILE *file, RelocatedFileHeader *pRh)
+{
+    memset(pRh, 0, sizeof(RelocatedFileHeader));
+    size_t n = fread(pRh, 1, sizeof(RelocatedFileHeader), file);
+    // gzip header must have 0x1f 0x8b : nothing to map in this case. Same for chunked containers
+    unsigned char *magic = (unsigned char *)pRh;
+    if((n < 4) || ((magic[0] == 0x1f) && (magic[1] == 0x8b)) || (pRh->magic == CHUNKEDFILE_MAGIC))
+        return -1;
+    return ((n == sizeof(RelocatedFileHeader)) && (pRh->magic == RELOCATEDFILE_MAGIC) && (pRh->version == RELOCATEDFILE_VERSION)) ? 1 : 0;
+}
+
+//------------------------------------------------------------------------------------------
+//
+/// checks the bk3d image of a mapping and resolves (or rebases) its pointers
+//
+//------------------------------------------------------------------------------------------
+INLINE static FileHeader * resolveMapping(FileMapping* pMapping, const RelocatedFileHeader *pRh, void ** pBufferMemory, size_t* bufferMemorySz)
+{
+    bool prelinked = pRh != NULL;
+    size_t headerOffset = prelinked ? RELOCATEDFILE_HEADERSZ : 0;
+    FileHeader *pHeader = (FileHeader *)((char*)pMapping->base + headerOffset);
+    if((pMapping->size < headerOffset + sizeof(FileHeader))
+     || (pHeader->nodeType != NODE_HEADER) || (pHeader->version != RAWMESHVERSION) || (headerOffset + pHeader->nodeByteSize > pMapping->size))
+    {
+        PRINTF((TEXT("Error>> Wrong version in Mesh description\n")));
+        unmapFile(pMapping);
+        return NULL;
+    }
+    // Anything beyond the header is Buffer Memory : vertex tables etc. Used in place
+    char *memory2 = (char*)pHeader + pHeader->nodeByteSize;
+    if(bufferMemorySz)
+        *bufferMemorySz = pMapping->size - headerOffset - pHeader->nodeByteSize;
+    if(pBufferMemory)
+        *pBufferMemory = memory2;
+    if(!prelinked)
+        pHeader->resolvePointers(memory2);
+    else if(pMapping->base != (void*)pRh->preferredBase)
+    {
+        pMapping->rebased = true;
+        rebasePointers(pHeader, memory2, pRh->preferredBase + headerOffset, (unsigned long long)pHeader);
+    }
+    return pHeader;
+}
+
+//------------------------------------------------------------------------------------------
+//
+/// maps an \b uncompressed bk3d file in memory and resolves the pointers in place.
+/// Prelinked images (see RelocatedFileHeader) are mapped at their preferred address when
+/// possible : no pointer gets resolved in this case.
+///
+/// Returns NULL if the file is compressed (gzip) or invalid : the caller can then fall back
+/// to bk3d::load(). The FileHeader must \b not be freed : use unmapFile() instead
+//
+//------------------------------------------------------------------------------------------
+INLINE static FileHeader * mapFile(const char * fname, FileMapping* pMapping, void ** pBufferMemory=NULL, size_t* bufferMemorySz=NULL)
+{
+    if(!fname || !pMapping)
+        return NULL;
+    FILE *file = fopen(fname, "rb");
+    if(!file)
+        return NULL;
+    RelocatedFileHeader rh;
+    int kind = sniffImage(file, &rh);
+    fclose(file);
+    if(kind < 0)
+        return NULL;
+    if(!mapFileView(fname, 0, 0, kind ? (void*)rh.preferredBase : NULL, pMapping))
+        return NULL;
+    return resolveMapping(pMapping, kind ? &rh : NULL, pBufferMemory, bufferMemorySz);
+}
+
+//
+// Pack archive (.bk3dp) : many bk3d files in one, each found by its name in the table of
+// contents. Files of the same content are stored once. Each image starts on a multiple of
+// PACKFILE_ALIGNMENT, so that it can be mapped on its own (see mapFromPack())
+//
+// layout : PackFileHeader | PackEntry[numEntries] | images...
+//
+// images are either stored as-is (plain or prelinked bk3d file, mappable) or compressed as
+// a whole with zlib when PACKENTRY_COMPRESSED is set
+//
+#define PACKFILE_MAGIC      0x41334b42 // 'BK3A'
+#define PACKFILE_VERSION    0x100
+#define PACKFILE_ALIGNMENT  (64*1024)
+#define PACKFILE_NAMESZ     104
+#define PACKENTRY_COMPRESSED 1
+
+struct PackFileHeader
+{
+    unsigned int        magic;
+    unsigned int        version;
+    unsigned int        numEntries;
+    unsigned int        pad;
+};
+struct PackEntry
+{
+    char                name[PACKFILE_NAMESZ];  ///< file name, without its folders
+    unsigned long long  fileOffset;             ///< where the image starts in the pack
+    unsigned long long  size;                   ///< size of the image, as stored
+    unsigned long long  rawSize;                ///< size of the bk3d file (header and buffer areas)
+    unsigned int        flags;
+    unsigned int        pad;
+};
+
+// packs can be bigger than what a long can address
+INLINE static int seekFile(FILE *file, unsigned long long offset)
+{
+#ifdef _WIN32
+    return _fseeki64(file, (__int64)offset, SEEK_SET);
+#else
+    return fseeko(file, (off_t)offset, SEEK_SET);
+#endif
+}
+// size of an open file; where the file was read from is kept
+INLINE static unsigned long long fileSize(FILE *file)
+{
+#ifdef _WIN32
+    __int64 pos = _ftelli64(file);
+    _fseeki64(file, 0, SEEK_END);
+    __int64 sz = _ftelli64(file);
+    _fseeki64(file, pos, SEEK_SET);
+#else
+    off_t pos = ftello(file);
+    fseeko(file, 0, SEEK_END);
+    off_t sz = ftello(file);
+    fseeko(file, pos, SEEK_SET);
+#endif
+    return sz > 0 ? (unsigned long long)sz : 0;
+}
+// size and modification time of a file, without opening it. Returns false if there is no such file
+INLINE static bool fileStamp(const char *fname, unsigned long long *pSize, unsigned long long *pTime)
+{
+#ifdef _WIN32
+    struct _stat64 st;
+    if(!fname || (_stat64(fname, &st) != 0))
+        return false;
+#else
+    struct stat st;
+    if(!fname || (stat(fname, &st) != 0))
+        return false;
+#endif
+    *pSize = (unsigned long long)st.st_size;
+    *pTime = (unsigned long long)st.st_mtime;
+    return true;
+}
+
+///
+/// \brief table of contents of a pack archive, read once by openPack() for all the
+/// models taken from it
+///
+struct PackFile
+{
+    std::string             name;   ///< file name of the pack
+    std::vector<PackEntry>  toc;
+};
+
+//------------------------------------------------------------------------------------------
+//
+/// reads the table of contents of a pack archive in one go. Returns false if packName
+/// isn't a pack
+//
+//------------------------------------------------------------------------------------------
+INLINE static bool openPack(const char * packName, PackFile* pPack)
+{
+    if(!packName || !pPack)
+        return false;
+    pPack->name = packName;
+    pPack->toc.clear();
+    FILE *file = fopen(packName, "rb");
+    if(!file)
+        return false;
+    PackFileHeader ph;
+    bool ok = (fread(&ph, sizeof(PackFileHeader), 1, file) == 1) && (ph.magic == PACKFILE_MAGIC) && (ph.version == PACKFILE_VERSION);
+    if(ok && ph.numEntries)
+    {
+        pPack->toc.resize(ph.numEntries);
+        ok = fread(&pPack->toc[0], sizeof(PackEntry), ph.numEntries, file) == ph.numEntries;
+    }
+    fclose(file);
+    if(!ok)
+        pPack->toc.clear();
+    return ok;
+}
+
+//------------------------------------------------------------------------------------------
+//
+/// looks for a model of a pack archive by name : the folders of modelName are ignored.
+/// Returns false if the pack doesn't hold the model
+//
+//------------------------------------------------------------------------------------------
+INLINE static bool findInPack(const PackFile* pPack, const char * modelName, PackEntry* pEntry)
+{
+    if(!pPack || !modelName)
+        return false;
+    const char *baseName = modelName;
+    for(const char *c = modelName; *c; c++)
+        if((*c == '/') || (*c == '\\'))
+            baseName = c + 1;
+    for(size_t i=0; i<pPack->toc.size(); i++)
+        if(strncmp(pPack->toc[i].name, baseName, PACKFILE_NAMESZ) == 0)
+        {
+            *pEntry = pPack->toc[i];
+            return true;
+        }
+    return false;
+}
+
+//------------------------------------------------------------------------------------------
+//
+/// maps a model of a pack archive (see mapFile()). Returns NULL if the model isn't in the
+/// pack or if it is compressed : use loadFromPack() in this case
+//
+//------------------------------------------------------------------------------------------
+INLINE static FileHeader * mapFromPack(const PackFile* pPack, const char * modelName, FileMapping* pMapping, void ** pBufferMemory=NULL, size_t* bufferMemorySz=NULL)
+{
+    PackEntry e;
+    if(!pMapping || !findInPack(pPack, modelName, &e) || (e.flags & PACKENTRY_COMPRESSED))
+        return NULL;
+    FILE *file = fopen(pPack->name.c_str(), "rb");
+    if(!file)
+        return NULL;
+    RelocatedFileHeader rh;
+    int kind = (seekFile(file, e.fileOffset) == 0) ? sniffImage(file, &rh) : -1;
+    fclose(file);
+    if(kind < 0)
+        return NULL;
+    if(!mapFileView(pPack->name.c_str(), e.fileOffset, (size_t)e.size, kind ? (void*)rh.preferredBase : NULL, pMapping))
+        return NULL;
+    return resolveMapping(pMapping, kind ? &rh : NULL, pBufferMemory, bufferMemorySz);
+}
+
+//------------------------------------------------------------------------------------------
+//
+/// base address given to the buffer area by loadHeader(). Pointers to vertex and index data
+/// are then DETACHEDBUFFERAREA + offset in the buffer area : never NULL but \b not to be
+/// dereferenced
+//
+//------------------------------------------------------------------------------------------
+#define DETACHEDBUFFERAREA ((char*)0x1000)
+
+//------------------------------------------------------------------------------------------
+//
+/// loads the header area of a bk3d file and leaves *pFd open at the beginning of the buffer
+/// area, so that the caller can stream vertex and index data where it needs them. The caller
+/// must GCLOSE(*pFd) and free() the FileHeader
+//
+//------------------------------------------------------------------------------------------
+INLINE static FileHeader * loadHeader(const char * fname, GFILE *pFd)
+{
+    if(!fname || !pFd)
+        return NULL;
+    GFILE fd = GOPEN(fname, "rb");
+    if(!fd)
+        return NULL;
+    FileHeader header;
+    if((GREAD(fd, &header, sizeof(Node)) != sizeof(Node)) || (header.version != RAWMESHVERSION) || (header.nodeByteSize < sizeof(FileHeader)))
+    {
+        GCLOSE(fd);
+        return NULL;
+    }
+    char * memory = (char*)malloc(header.nodeByteSize);
+    memcpy(memory, &header, sizeof(Node));
+    if(GREAD(fd, memory + sizeof(Node), header.nodeByteSize - sizeof(Node)) != (int)(header.nodeByteSize - sizeof(Node)))
+    {
+        free(memory);
+        GCLOSE(fd);
+        return NULL;
+    }
+    // same as resolvePointers(), except for pointers located in the buffer area : it isn't there
+    FileHeader *pHeader = (FileHeader *)memory;
+    RESOLVEPTR(pHeader, pHeader->pRelocationTable, RelocationTable);
+    RESOLVEPTR(pHeader, pHeader->pRelocationTable->pRelocationOffsets, RelocationTable::Offsets);
+    for(int i=0; i < pHeader->pRelocationTable->numRelocationOffsets; i++)
+    {
+        unsigned LONG offs = pHeader->pRelocationTable->pRelocationOffsets[i].ptrOffset;
+        if((offs == 0) || (offs >= pHeader->nodeByteSize))
+            continue;
+        unsigned long long *ptr2 = (unsigned long long *)(memory + offs);
+        if(*ptr2)
+        {
+            unsigned long long o = pHeader->pRelocationTable->pRelocationOffsets[i].offset;
+            if(o >= pHeader->nodeByteSize)
+                *ptr2 = (unsigned long long)(DETACHEDBUFFERAREA + o - pHeader->nodeByteSize);
+            else
+                *ptr2 = (unsigned long long)(memory + o);
+        }
+    }
+    *pFd = fd;
+    return (FileHeader *)memory;
+}
+
+// one block of at most 1Mb of hashFile() : the tail is zero-padded and the size goes in the hash
+INLINE static unsigned long long hashBlock(unsigned long long h, const char * p, size_t n)
+{
+    for(size_t i=0; i<n; i += 8)
+    {
+        unsigned long long w = 0;
+        memcpy(&w, p + i, n - i < 8 ? n - i : 8);
+        h = (h ^ w) * 0x100000001b3ULL;
+        h ^= h >> 29;
+    }
+    return h ^ n;
+}
+
+//------------------------------------------------------------------------------------------
+//
+/// 64 bits hash of the content of a file (as stored : compressed or not). Not cryptographic :
+/// good enough to find a cache entry back. Returns 0 if the file can't be read
+//
+//------------------------------------------------------------------------------------------
+INLINE static unsigned long long hashFile(const char * fname, unsigned long long seed=0)
+{
+    FILE *file = fname ? fopen(fname, "rb") : NULL;
+    if(!file)
+        return 0;
+    unsigned long long h = 0xcbf29ce484222325ULL ^ seed;
+    std::vector<char> block(1<<20);
+    size_t n;
+    while((n = fread(&block[0], 1, block.size(), file)) > 0)
+        h = hashBlock(h, &block[0], n);
+    fclose(file);
+    return h ? h : 1;
+}
+
+//------------------------------------------------------------------------------------------
+//
+/// same as hashFile() on the content of a file already in memory
+//
+//------------------------------------------------------------------------------------------
+INLINE static unsigned long long hashBytes(const void * data, size_t size, unsigned long long seed=0)
+{
+    unsigned long long h = 0xcbf29ce484222325ULL ^ seed;
+    for(size_t o=0; o<size; o += 1<<20)
+        h = hashBlock(h, (const char*)data + o, size - o < (1<<20) ? size - o : (1<<20));
+    return h ? h : 1;
+}
+
+//------------------------------------------------------------------------------------------
+//
+/// meshes in the order they get drawn, packed in buffers of capacity bytes. A mesh bigger
+/// than that gets a buffer for itself. bins[i] : buffer of mesh i. Returns the buffer count
+//
+//------------------------------------------------------------------------------------------
+INLINE static int packInOrder(const std::vector<unsigned long long> &sizes, unsigned long long capacity, std::vector<int> &bins)
+{
+    int b = 0;
+    unsigned long long cur = 0;
+    bins.resize(sizes.size());
+    for(size_t i=0; i<sizes.size(); i++)
+    {
+        if((cur > 0) && (cur + sizes[i] > capacity))
+        {
+            b++;
+            cur = 0;
+        }
+        bins[i] = b;
+        cur += sizes[i];
+    }
+    return b + 1;
+}
+
+//------------------------------------------------------------------------------------------
+//
+/// Layout planner: which buffer object each mesh goes in, for a hard budget of bytes per
+/// buffer. Meshes drawn one after the other stay together: buffers take ranges of meshes
+/// in their order. Packing as much as possible in each buffer gives the fewest of them;
+/// then the smallest capacity giving as many buffers evens their sizes out, rather than
+/// leaving a small one at the end. Vertex and index buffers get planned separately.
+/// Shared by the sample and bk3d_repack, so that both lay the buffers out the same way
+//
+//------------------------------------------------------------------------------------------
+INLINE static int planBuffers(const std::vector<unsigned long long> &sizes, unsigned long long budget, std::vector<int> &bins)
+{
+    int numBins = packInOrder(sizes, budget, bins);
+    unsigned long long lo = 0, hi = budget;
+    for(size_t i=0; i<sizes.size(); i++)
+        lo = std::max(lo, std::min(sizes[i], budget));
+    // smallest capacity in [lo, hi] with numBins buffers, to 256 bytes
+    while(hi - lo > 256)
+    {
+        unsigned long long mid = lo + (hi - lo) / 2;
+        if(packInOrder(sizes, mid, bins) <= numBins)
+            hi = mid;
+        else
+            lo = mid;
+    }
+    return packInOrder(sizes, hi, bins);
+}
+
+#ifndef NOGZLIB
+//------------------------------------------------------------------------------------------
+//
+/// sequential reads of a file image, either in memory or the next size bytes of an open
+/// file. windowBits is the one of inflateInit2() : 0 for stored data, 16+MAX_WBITS for gzip,
+/// MAX_WBITS for zlib. Deflated data of a file goes through a 1Mb buffer
+//
+//------------------------------------------------------------------------------------------
+struct ImageStream
+{
+    FILE*               file;       ///< NULL : the image is in memory, at src
+    const char*         src;
+    unsigned long long  srcLeft;    ///< what is left of the image, as stored
+    std::vector<char>   inBuf;
+    bool                deflated;
+    bool                failed;     ///< corrupted data or read error : nothing more gets read
+    z_stream            zs;
+    ImageStream(const void* data, size_t size, int windowBits)
+    {
+        file = NULL; src = (const char*)data; srcLeft = size;
+        init(windowBits);
+    }
+    ImageStream(FILE* f, unsigned long long size, int windowBits)
+    {
+        file = f; src = NULL; srcLeft = size;
+        init(windowBits);
+        if(deflated)
+            inBuf.resize(1<<20);
+    }
+    void init(int windowBits)
+    {
+        deflated = windowBits != 0;
+        memset(&zs, 0, sizeof(z_stream));
+        failed = deflated && (inflateInit2(&zs, windowBits) != Z_OK);
+    }
+    ~ImageStream() { if(deflated) inflateEnd(&zs); }
+    // returns how many bytes went to pDst : less than size at the end of the data
+    size_t read(void* pDst, size_t size)
+    {
+        if(failed)
+            return 0;
+        if(!deflated)
+        {
+            size_t n = size < srcLeft ? size : (size_t)srcLeft;
+            if(file)
+                n = fread(pDst, 1, n, file);
+            else
+                memcpy(pDst, src, n);
+            src += file ? 0 : n;
+            srcLeft -= n;
+            return n;
+        }
+        size_t done = 0;
+        while(done < size)
+        {
+            // avail_in and avail_out are 32 bits : at most 1Gb at once
+            if(zs.avail_in == 0)
+            {
+                if(srcLeft == 0)
+                    break;
+                size_t n = srcLeft < (1<<30) ? (size_t)srcLeft : (1<<30);
+                if(file)
+                {
+                    n = fread(&inBuf[0], 1, n < inBuf.size() ? n : inBuf.size(), file);
+                    if(n == 0)
+                    {
+                        failed = true;
+                        break;
+                    }
+                    zs.next_in = (Bytef*)&inBuf[0];
+                }
+                else
+                {
+                    zs.next_in = (Bytef*)src;
+                    src += n;
+                }
+                zs.avail_in = (uInt)n;
+                srcLeft -= n;
+            }
+            size_t n = size - done < (1<<30) ? size - done : (1<<30);
+            zs.next_out = (Bytef*)pDst + done;
+            zs.avail_out = (uInt)n;
+            int r = inflate(&zs, Z_NO_FLUSH);
+            done += n - zs.avail_out;
+            if(r == Z_STREAM_END)
+                break;
+            if((r != Z_OK) && (r != Z_BUF_ERROR))
+            {
+                failed = true;
+                break;
+            }
+        }
+        return done;
+    }
+};
+
+//------------------------------------------------------------------------------------------
+//
+/// loads a bk3d file from its image in memory, stored or gzip, e.g. when it was read already
+/// to be hashed. Memory is allocated the same way as bk3d::load() does; data isn't needed
+/// anymore once this returns. Returns NULL if the image isn't a plain bk3d file (chunked
+/// containers and prelinked images have their own loaders) or is corrupted
+//
+//------------------------------------------------------------------------------------------
+INLINE static FileHeader * loadFromMemory(const void * data, size_t size, void ** pBufferMemory=NULL, size_t* bufferMemorySz=NULL)
+{
+    if(!data || (size < sizeof(Node)))
+        return NULL;
+    const unsigned char *bytes = (const unsigned char*)data;
+    bool gzip = (bytes[0] == 0x1f) && (bytes[1] == 0x8b);
+    ImageStream ms(data, size, gzip ? 16 + MAX_WBITS : 0);
+    FileHeader header;
+    if((ms.read(&header, sizeof(Node)) != sizeof(Node)) || (header.version != RAWMESHVERSION) || (header.nodeByteSize < sizeof(FileHeader)))
+        return NULL;
+    char * memory = (char*)malloc(header.nodeByteSize);
+    if(!memory)
+        return NULL;
+    memcpy(memory, &header, sizeof(Node));
+    if(ms.read(memory + sizeof(Node), header.nodeByteSize - sizeof(Node)) != header.nodeByteSize - sizeof(Node))
+    {
+        free(memory);
+        return NULL;
+    }
+    // same as load() : what the image tells first (the gzip trailer only has it modulo 4Gb),
+    // growing the buffer geometrically if there is more
+    size_t memory2Sz = 0;
+    size_t memory2Capacity = size - header.nodeByteSize;
+    if(gzip)
+    {
+        unsigned long long isize = bytes[size-4] | (bytes[size-3] << 8) | (bytes[size-2] << 16) | ((unsigned long long)bytes[size-1] << 24);
+        memory2Capacity = isize > header.nodeByteSize ? (size_t)(isize - header.nodeByteSize) : 0;
+    }
+    if(memory2Capacity == 0)
+        memory2Capacity = 1<<20;
+    char *memory2 = (char*)malloc(memory2Capacity);
+    while(memory2)
+    {
+        if(memory2Sz == memory2Capacity)
+        {
+            // full : only grow if the stream has more
+            char probe[4096];
+            size_t n = ms.read(probe, sizeof(probe));
+            if(n == 0)
+                break;
+            memory2Capacity *= 2;
+            char *p = (char*)realloc(memory2, memory2Capacity);
+            if(!p)
+            {
+                free(memory2);
+                memory2 = NULL;
+                break;
+            }
+            memory2 = p;
+            memcpy(memory2 + memory2Sz, probe, n);
+            memory2Sz += n;
+            continue;
+        }
+        size_t n = ms.read(memory2 + memory2Sz, memory2Capacity - memory2Sz);
+        if(n == 0)
+            break;
+        memory2Sz += n;
+    }
+    if(!memory2 || ms.failed)
+    {
+        EPRINTF((TEXT("Error : couldn't load a bk3d file from memory\n")));
+        free(memory2);
+        free(memory);
+        return NULL;
+    }
+    // give back what the last growth didn't use
+    if(memory2Sz > 0)
+        memory2 = (char*)realloc(memory2, memory2Sz);
+    if(bufferMemorySz)
+        *bufferMemorySz = memory2Sz;
+    if(pBufferMemory)
+        *pBufferMemory = memory2;
+    ((FileHeader *)memory)->resolvePointers(memory2);
+    return (FileHeader *)memory;
+}
+
+//------------------------------------------------------------------------------------------
+//
+/// loads a chunked container (see ChunkedFileHeader). The blocks are inflated by numThreads
+/// workers (0 : as many as the hardware can run) directly into the header and buffer areas.
+///
+/// Returns NULL if the file isn't a chunked container : the caller can then fall back to
+/// bk3d::load(). Memory is allocated the same way as bk3d::load() does
+//
+//------------------------------------------------------------------------------------------
+INLINE static FileHeader * loadChunked(const char * fname, void ** pBufferMemory=NULL, size_t* bufferMemorySz=NULL, int numThreads=0)
+{
+    if(!fname)
+        return NULL;
+    FILE *file = fopen(fname, "rb");
+    if(!file)
+        return NULL;
+    ChunkedFileHeader ch;
+    if((fread(&ch, sizeof(ChunkedFileHeader), 1, file) != 1) || (ch.magic != CHUNKEDFILE_MAGIC))
+    {
+        fclose(file);
+        return NULL;
+    }
+    if((ch.version != CHUNKEDFILE_VERSION) || (ch.nodeByteSize < sizeof(FileHeader)) || (ch.nodeByteSize > ch.rawSize))
+    {
+        PRINTF((TEXT("Error>> Wrong version in chunked container ") FSTR TEXT("\n"), fname));
+        fclose(file);
+        return NULL;
+    }
+    unsigned long long fileSz = fileSize(file);
+    unsigned long long dataStart = sizeof(ChunkedFileHeader) + (unsigned long long)ch.numChunks * sizeof(ChunkEntry);
+    if(dataStart > fileSz)
+        ch.numChunks = 0;
+    std::vector<ChunkEntry> chunks(ch.numChunks);
+    std::vector<unsigned long long> rawOffsets(ch.numChunks);
+    unsigned long long rawOffset = 0;
+    unsigned long long compressedEnd = dataStart;
+    bool valid = ch.numChunks > 0;
+    if(valid && (fread(&chunks[0], sizeof(ChunkEntry), ch.numChunks, file) != ch.numChunks))
+        valid = false;
+    //
+    // nothing in the table is trusted : each block must be in the file, after the table,
+    // and inflate within the area (header or buffer) it starts in
+    //
+    for(unsigned int i=0; valid && (i<ch.numChunks); i++)
+    {
+        const ChunkEntry &c = chunks[i];
+        unsigned long long areaEnd = rawOffset < ch.nodeByteSize ? ch.nodeByteSize : ch.rawSize;
+        if((c.fileOffset < dataStart) || (c.fileOffset > fileSz) || (c.compressedSize > fileSz - c.fileOffset)
+         || (rawOffset + c.rawSize > areaEnd))
+            valid = false;
+        rawOffsets[i] = rawOffset;
+        rawOffset += c.rawSize;
+        if(c.fileOffset + c.compressedSize > compressedEnd)
+            compressedEnd = c.fileOffset + c.compressedSize;
+    }
+    if(!valid || (rawOffset != ch.rawSize))
+    {
+        EPRINTF((TEXT("Error : corrupted chunk index in ") FSTR TEXT("\n"), fname));
+        fclose(file);
+        return NULL;
+    }
+    // one read for all the compressed blocks : the disk stays sequential, only inflate is parallel
+    std::vector<unsigned char> compressed((size_t)(compressedEnd - dataStart));
+    size_t n = compressed.size() ? fread(&compressed[0], 1, compressed.size(), file) : 0;
+    fclose(file);
+    if(n != compressed.size())
+    {
+        EPRINTF((TEXT("Error : couldn't read ") FSTR TEXT("\n"), fname));
+        return NULL;
+    }
+    char * memory = (char*)malloc(ch.nodeByteSize);
+    char * memory2 = (char*)malloc((size_t)(ch.rawSize - ch.nodeByteSize));
+    if(!memory || (!memory2 && (ch.rawSize > ch.nodeByteSize)))
+    {
+        EPRINTF((TEXT("Error : not enough memory to load ") FSTR TEXT("\n"), fname));
+        free(memory);
+        free(memory2);
+        return NULL;
+    }
+    //
+    // workers pick the next block until none is left
+    //
+    std::atomic<unsigned int> nextChunk(0);
+    std::atomic<bool> failed(false);
+    auto inflateChunks = [&]()
+    {
+        unsigned int i;
+        while((i = nextChunk++) < ch.numChunks)
+        {
+            const ChunkEntry &c = chunks[i];
+            char* dst = rawOffsets[i] < ch.nodeByteSize
+                ? memory + rawOffsets[i]
+                : memory2 + (rawOffsets[i] - ch.nodeByteSize);
+            uLongf dstSz = c.rawSize;
+            if((uncompress((Bytef*)dst, &dstSz, &compressed[(size_t)(c.fileOffset - dataStart)], c.compressedSize) != Z_OK)
+             || (dstSz != c.rawSize))
+                failed = true;
+        }
+    };
+    if(numThreads <= 0)
+        numThreads = (int)std::thread::hardware_concurrency();
+    if(numThreads > (int)ch.numChunks)
+        numThreads = (int)ch.numChunks;
+    std::vector<std::thread> workers;
+    for(int t=1; t<numThreads; t++)
+        workers.push_back(std::thread(inflateChunks));
+    inflateChunks(); // the calling thread works, too
+    for(size_t t=0; t<workers.size(); t++)
+        workers[t].join();
+    if(failed || (((FileHeader *)memory)->version != RAWMESHVERSION))
+    {
+        EPRINTF((TEXT("Error : couldn't inflate ") FSTR TEXT("\n"), fname));
+        free(memory);
+        free(memory2);
+        return NULL;
+    }
+    if(bufferMemorySz)
+        *bufferMemorySz = (size_t)(ch.rawSize - ch.nodeByteSize);
+    if(pBufferMemory)
+        *pBufferMemory = memory2;
+    ((FileHeader *)memory)->resolvePointers(memory2);
+    return (FileHeader *)memory;
+}
+
+//------------------------------------------------------------------------------------------
+//
+/// loads a model of a pack archive with a single seek in the pack. Memory is allocated the
+/// same way as bk3d::load() does : the buffer area (*pBufferMemory) is freed on its own, so
+/// that it can go as soon as it isn't needed. Prelinked images get rebased where they were
+/// loaded. Returns NULL if the model isn't in the pack
+//
+//------------------------------------------------------------------------------------------
+INLINE static FileHeader * loadFromPack(const PackFile* pPack, const char * modelName, void ** pBufferMemory=NULL, size_t* bufferMemorySz=NULL)
+{
+    PackEntry e;
+    if(!findInPack(pPack, modelName, &e))
+        return NULL;
+    const char *packName = pPack->name.c_str();
+    FILE *file = fopen(packName, "rb");
+    if(!file)
+        return NULL;
+    // read (or inflated) straight into the header area, then into the buffer area : the
+    // image is never in memory as a whole
+    bool ok = seekFile(file, e.fileOffset) == 0;
+    ImageStream is(file, e.size, (e.flags & PACKENTRY_COMPRESSED) ? MAX_WBITS : 0);
+    RelocatedFileHeader rh;
+    FileHeader header;
+    ok = ok && (e.rawSize >= sizeof(Node)) && (is.read(&rh, sizeof(rh)) == sizeof(rh));
+    bool prelinked = ok && (e.rawSize >= RELOCATEDFILE_HEADERSZ + sizeof(Node))
+                  && (rh.magic == RELOCATEDFILE_MAGIC) && (rh.version == RELOCATEDFILE_VERSION);
+    size_t imageSz = (size_t)e.rawSize;
+    if(prelinked)
+    {
+        // the FileHeader follows the padding of the RelocatedFileHeader
+        std::vector<char> padding(RELOCATEDFILE_HEADERSZ - sizeof(rh));
+        ok = is.read(&padding[0], padding.size()) == padding.size();
+        ok = ok && (is.read(&header, sizeof(Node)) == sizeof(Node));
+        imageSz -= RELOCATEDFILE_HEADERSZ;
+    }
+    else if(ok)
+    {
+        // Node isn't trivially copyable: filled as bytes, like fread() does
+        memcpy((void*)&header, &rh, sizeof(rh));
+        ok = is.read((char*)&header + sizeof(rh), sizeof(Node) - sizeof(rh)) == sizeof(Node) - sizeof(rh);
+    }
+    ok = ok && (header.version == RAWMESHVERSION) && (header.nodeByteSize >= sizeof(FileHeader)) && (header.nodeByteSize <= imageSz);
+    char * memory = ok ? (char*)malloc(header.nodeByteSize) : NULL;
+    char * memory2 = NULL;
+    if(memory)
+    {
+        memcpy(memory, &header, sizeof(Node));
+        ok = is.read(memory + sizeof(Node), header.nodeByteSize - sizeof(Node)) == header.nodeByteSize - sizeof(Node);
+        // the buffer area gets its own allocation : it is freed on its own
+        memory2 = ok ? (char*)malloc(imageSz - header.nodeByteSize) : NULL;
+        if(ok && !memory2 && (imageSz > header.nodeByteSize))
+            EPRINTF((TEXT("Error : not enough memory to load ") FSTR TEXT(" from ") FSTR TEXT("\n"), modelName, packName));
+        ok = ok && (memory2 || (imageSz == header.nodeByteSize));
+        ok = ok && (is.read(memory2, imageSz - header.nodeByteSize) == imageSz - header.nodeByteSize);
+    }
+    fclose(file);
+    if(!ok || !memory)
+    {
+        EPRINTF((TEXT("Error : couldn't load ") FSTR TEXT(" from ") FSTR TEXT("\n"), modelName, packName));
+        free(memory2);
+        free(memory);
+        return NULL;
+    }
+    FileHeader *pH = (FileHeader *)memory;
+    if(bufferMemorySz)
+        *bufferMemorySz = imageSz - pH->nodeByteSize;
+    if(pBufferMemory)
+        *pBufferMemory = memory2;
+    // pointers of a prelinked image assume the buffer area right after the header area
+    if(prelinked)
+        rebasePointers(pH, memory2, rh.preferredBase + RELOCATEDFILE_HEADERSZ, (unsigned long long)pH, (unsigned long long)memory2);
+    else
+        pH->resolvePointers(memory2);
+    return pH;
+}
+#endif //NOGZLIB
+
+} //namespace bk3d
+
+#endif //__BK3DFILE__
@@ -36,6 +36,8 @@ namespace emucmdlist
           GLuint stride;
           GLuint size;
           GLuint offset;
+          GLint  type;
+          GLint  normalized;
       };
       GLenum mode; // always used
       GLuint primRestartIndex;
@@ -92,6 +94,12 @@ namespace emucmdlist
       s.attrs[0].enabledVertexAttrib = res ? true:false;
       glGetVertexAttribiv(1, GL_VERTEX_ATTRIB_ARRAY_ENABLED, &res);
       s.attrs[1].enabledVertexAttrib = res ? true:false;
+      // formats set with glVertexAttribFormat (quantized vertices aren't floats)
+      for(int i=0; i<2; i++)
+      {
+          glGetVertexAttribiv(i, GL_VERTEX_ATTRIB_ARRAY_TYPE, &s.attrs[i].type);
+          glGetVertexAttribiv(i, GL_VERTEX_ATTRIB_ARRAY_NORMALIZED, &s.attrs[i].normalized);
+      }
       // ...
   }
   // additional arguments for states that I couldn't grab through OpenGL API :-(
@@ -125,7 +133,7 @@ namespace emucmdlist
                 glDisableVertexAttribArray(i);
             if(s.attrs[i].size) {
                 glBindVertexBuffer(i, 0, 0, s.attrs[i].stride);
-                glVertexAttribFormat(i,s.attrs[i].size, GL_FLOAT, GL_FALSE, s.attrs[i].offset);
+                glVertexAttribFormat(i,s.attrs[i].size, s.attrs[i].type, s.attrs[i].normalized ? GL_TRUE : GL_FALSE, s.attrs[i].offset);
             }
         }
     }
@@ -169,7 +177,7 @@ namespace emucmdlist
       case GL_DRAW_ELEMENTS_COMMAND_NV:
         {
           const DrawElementsCommandNV* cmd = (const DrawElementsCommandNV*)data;
-          glDrawElementsBaseVertex(mode, cmd->count, type, (const GLvoid*)(cmd->firstIndex * sizeof(GLuint)), cmd->baseVertex);
+          glDrawElementsBaseVertex(mode, cmd->count, type, (const GLvoid*)(cmd->firstIndex * (type == GL_UNSIGNED_INT ? sizeof(GLuint) : sizeof(GLushort))), cmd->baseVertex);
         }
         break;
       case GL_DRAW_ARRAYS_COMMAND_NV:
@@ -181,7 +189,7 @@ namespace emucmdlist
       case GL_DRAW_ELEMENTS_STRIP_COMMAND_NV:
         {
           const DrawElementsCommandNV* cmd = (const DrawElementsCommandNV*)data;
-          glDrawElementsBaseVertex(modeStrip, cmd->count, type, (const GLvoid*)(cmd->firstIndex * sizeof(GLuint)), cmd->baseVertex);
+          glDrawElementsBaseVertex(modeStrip, cmd->count, type, (const GLvoid*)(cmd->firstIndex * (type == GL_UNSIGNED_INT ? sizeof(GLuint) : sizeof(GLushort))), cmd->baseVertex);
         }
         break;
       case GL_DRAW_ARRAYS_STRIP_COMMAND_NV:
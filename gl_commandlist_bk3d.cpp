@@ -35,18 +35,53 @@
 #define WINDOWINERTIACAMERA_EXTERN
 #define EMUCMDLIST_EXTERN
 #include "gl_commandlist_bk3d_models.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <algorithm>
+#include <float.h>
 
 //------------------------------------------------------------------------------
 // Globals
 //------------------------------------------------------------------------------
-int         g_MaxBOSz = 200000;
+int         g_MaxBOSz = 200000;  // budget of a VBO, in Mb (see bk3d::planBuffers)
+int         g_MaxEBOSz = 200000; // budget of an EBO, in Mb
 int         g_TokenBufferGrouping    = 0;
+bool        g_bUseFileMapping        = true;
+int         g_LoadThreads            = 0; // 0: as many as the hardware can run
+bool        g_bAsyncLoading          = true;
+float       g_LoadBudgetMs           = 8.0f; // upload time given to the loaded models, per frame
+bool        g_bStreamUpload          = true; // inflate .bk3d.gz straight into a staging ring (see inflateBufferArea, beginStreamUpload)
+std::string g_CacheDir;                          // folder of the processed-model cache. Empty: no cache
+int         g_StreamingBudgetMb      = 0;    // out-of-core: GPU memory given to the meshes of a model. 0: all resident
+int         g_StreamingUploadMb      = 32;   // out-of-core: max amount of mesh data uploaded per frame
+std::string g_PackFile;                          // pack archive (.bk3dp) models are taken from. Empty: separate files
+bool        g_bCompactIndices        = false; // 32 bits indices narrowed to 16 bits when the range of the primitive group allows
+bool        g_bMergePrimGroups       = false; // strips/fans/loops to lists, groups of a mesh with the same state merged
+bool        g_bInstancing            = false;// meshes with the same geometry stored once and drawn as instances
+int         g_QuantizeVertices       = VTXQUANT_NONE; // compact vertex format (see quantizeVertices)
+bool        g_bFlattenStatic         = false; // static meshes merged in the model space (see flattenStatic)
+int         g_GeometryHeapMb         = 0;     // >0: buffer objects are ranges of a heap shared by the models (see allocateBO)
+bool        g_bHeapCompaction        = true;  // the geometry heap gets compacted rather than grown when fragmented
+bool        g_bReleaseGeometry       = false; // vertex and index data freed once in the buffer objects (see releaseGeometry)
+bool        g_bDepthStream           = false; // position-only stream of the meshes and depth-only commands (see extractPositions)
+bool        g_bDepthPrepass          = false; // draw the depth-only commands first, then the meshes where depth is equal
+int         g_RecordThreads          = 0;    // threads recording the token buffers. 0: as many as the hardware can run
+bool        g_bOptimizeTokens        = true; // peephole pass on the recorded tokens (see optimizeTokens)
+std::string g_SortKey("tsfmx");                   // fields of the sort key of the draws, most significant first (see drawKey)
 
 //-----------------------------------------------------------------------------
 // Shaders
 //-----------------------------------------------------------------------------
+// #version and the defines of the variant get prepended (see meshVertexShader):
+// - INSTANCED: the table of transforms starts at the first instance of the draw
+// - OCT_NORMALS: normals are octahedral-encoded (see quantizeVertices). The
+//   positions are normalized in the bounding box, that the object matrix maps back
+// - POSITION_ONLY: depth passes, from the position streams (see extractPositions)
+// gl_Position is invariant: depth passes and the shading must give the same depth
 static const char *s_glslv_mesh = 
-"#version 430\n"
 "#extension GL_ARB_separate_shader_objects : enable\n"
 "#extension GL_NV_command_list : enable\n"
 "layout(std140,commandBindableNV,binding=" TOSTR(UBO_MATRIX) ") uniform matrixBuffer {\n"
@@ -54,17 +89,41 @@ static const char *s_glslv_mesh =
 "   uniform mat4 mVP;\n"
 "} matrix;\n"
 "layout(std140,commandBindableNV,binding=" TOSTR(UBO_MATRIXOBJ) ") uniform matrixObjBuffer {\n"
+"#ifdef INSTANCED\n"
+"   uniform mat4 mO[" TOSTR(INSTANCES_PER_DRAW) "];\n"
+"#else\n"
 "   uniform mat4 mO;\n"
+"#endif\n"
 "} object;\n"
+"#ifdef INSTANCED\n"
+"#define OBJECT object.mO[gl_InstanceID]\n"
+"#else\n"
+"#define OBJECT object.mO\n"
+"#endif\n"
 "layout(location=0) in  vec3 P;\n"
+"#ifndef POSITION_ONLY\n"
+"#ifdef OCT_NORMALS\n"
+"layout(location=1) in  vec2 N;\n"
+"vec3 normal() {\n"
+"   vec3 n = vec3(N, 1.0 - abs(N.x) - abs(N.y));\n"
+"   if(n.z < 0.0)\n"
+"       n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);\n"
+"   return normalize(n);\n"
+"}\n"
+"#else\n"
 "layout(location=1) in  vec3 N;\n"
+"vec3 normal() { return N; }\n"
+"#endif\n"
 "layout(location=1) out vec3 outN;\n"
+"#endif\n"
 "out gl_PerVertex {\n"
-"    vec4  gl_Position;\n"
+"    invariant vec4  gl_Position;\n"
 "};\n"
 "void main() {\n"
-"   outN = N;\n"
-"   gl_Position = matrix.mVP * (matrix.mW * (object.mO * vec4(P, 1.0)));\n"
+"#ifndef POSITION_ONLY\n"
+"   outN = normal();\n"
+"#endif\n"
+"   gl_Position = matrix.mVP * (matrix.mW * (OBJECT * vec4(P, 1.0)));\n"
 "}\n"
 ;
 static const char *s_glslf_mesh = 
@@ -96,8 +155,77 @@ static const char *s_glslf_mesh_line =
 "   outColor = vec4(0.7,0.7,0.8,1);\n"
 "}\n"
 ;
-GLSLShader  s_shaderMesh;
-GLSLShader  s_shaderMeshLine;
+static const char *s_glslf_mesh_depth = 
+"#version 430\n"
+"void main() {\n"
+"}\n"
+;
+#define MESHSHADER_INSTANCED    1
+#define MESHSHADER_OCTNORMALS   2
+#define MESHSHADER_DEPTH        4 // states of the depth-only commands (not a shader variant)
+GLSLShader  s_shaderMesh[4];        // for each combination of MESHSHADER_* flags
+GLSLShader  s_shaderMeshLine[4];
+GLSLShader  s_shaderMeshDepth[2];   // MESHSHADER_INSTANCED or not
+
+static std::string meshVertexShader(int variant, bool bPositionOnly=false)
+{
+    std::string src("#version 430\n");
+    if(bPositionOnly)
+        src += "#define POSITION_ONLY\n";
+    if(variant & MESHSHADER_INSTANCED)
+        src += "#define INSTANCED\n";
+    if(variant & MESHSHADER_OCTNORMALS)
+        src += "#define OCT_NORMALS\n";
+    return src + s_glslv_mesh;
+}
+
+//------------------------------------------------------------------------------
+// program for a primitive group: lines vs. polygons (no normals for lines)
+//------------------------------------------------------------------------------
+static void bindMeshShader(GLenum topologyGL, int variant)
+{
+    if(variant & MESHSHADER_DEPTH)
+    {
+        // same offset as the shading of polygons: same depth
+        glEnable(GL_POLYGON_OFFSET_FILL);
+        glPolygonOffset(1.0, 1.0);
+        s_shaderMeshDepth[variant & MESHSHADER_INSTANCED].bindShader();
+    }
+    else if((topologyGL == GL_LINES)||(topologyGL == GL_LINE_STRIP))
+    {
+        glDisable(GL_POLYGON_OFFSET_FILL);
+        s_shaderMeshLine[variant].bindShader();
+    } else {
+        glEnable(GL_POLYGON_OFFSET_FILL);
+        glPolygonOffset(1.0, 1.0); // no issue with redundant call here: the state capture will just deal with simplifying things
+        s_shaderMesh[variant].bindShader();
+    }
+}
+
+//------------------------------------------------------------------------------
+// size of an attribute for one vertex; stride of the positions in the
+// position streams: 4 bytes aligned (see extractPositions)
+//------------------------------------------------------------------------------
+static GLuint attributeBytes(const bk3d::Attribute* pA)
+{
+    switch(pA->formatGL)
+    {
+    case GL_BYTE:
+    case GL_UNSIGNED_BYTE:
+        return pA->numComp;
+    case GL_SHORT:
+    case GL_UNSIGNED_SHORT:
+    case GL_HALF_FLOAT:
+        return pA->numComp * 2;
+    case GL_DOUBLE:
+        return pA->numComp * 8;
+    }
+    return pA->numComp * 4;
+}
+static GLuint positionStride(const bk3d::Attribute* pA)
+{
+    return (attributeBytes(pA) + 3) & ~3u;
+}
 
 
 //------------------------------------------------------------------------------
@@ -108,16 +236,33 @@ Bk3dModel::Bk3dModel(const char *name, vec3f *pPos, float *pScale)
     assert(name);
     m_name                  = std::string(name);
     m_bRecordObject         = true;
+    m_bRecaptureStates      = false;
     m_objectMatrices        = NULL;
     m_objectMatricesNItems  = 0;
     m_material              = NULL;
     m_materialNItems        = 0;
     m_commandList           = 0;
     m_meshFile              = NULL;
+    m_bufferMemory          = NULL;
+    m_bufferMemorySz        = 0;
+    m_bKeepBufferArea       = false;
+    m_streamFile            = NULL;
+    m_streamUpload          = NULL;
+    m_cacheFile             = NULL;
+    m_cacheHash             = 0;
+    m_cacheStamp[0]         = 0;
+    m_cacheStamp[1]         = 0;
+    m_cacheNumVBOs          = 0;
+    m_residentBytes         = 0;
+    m_frame                 = 0;
+    m_bReady                = false;
+    m_quantizeMode          = VTXQUANT_NONE;
     m_posOffset             = pPos ? *pPos : vec3f(0,0,0);
     m_scale                 = pScale ? *pScale : 0.0f;
     m_tokenBufferModel.bufferID = 0;
+    m_tokenBufferDepth.bufferID = 0;
     memset(&m_uboObjectMatrices,0, sizeof(BO));
+    memset(&m_uboMeshMatrices,0, sizeof(BO));
     memset(&m_uboMaterial,      0, sizeof(BO));
     memset(&m_stats,            0, sizeof(Stats));
 }
@@ -128,22 +273,39 @@ Bk3dModel::~Bk3dModel()
 
     for(int i=0;i<m_ObjVBOs.size(); i++)
     {
-        glMakeNamedBufferNonResidentNV(m_ObjVBOs[i].Id);
-        glDeleteBuffers(1, &m_ObjVBOs[i].Id);
+        if(m_ObjVBOs[i].Id == 0)
+            continue; // out-of-core: not resident
+        releaseBO(m_ObjVBOs[i]);
     }
     for(int i=0;i<m_ObjEBOs.size(); i++)
     {
-        glMakeNamedBufferNonResidentNV(m_ObjEBOs[i].Id);
-        glDeleteBuffers(1, &m_ObjEBOs[i].Id);
+        if(m_ObjEBOs[i].Id == 0)
+            continue;
+        releaseBO(m_ObjEBOs[i]);
     }
     glMakeNamedBufferNonResidentNV(m_uboObjectMatrices.Id);
     glDeleteBuffers(1, &m_uboObjectMatrices.Id);
+    if(m_uboMeshMatrices.Id)
+    {
+        glMakeNamedBufferNonResidentNV(m_uboMeshMatrices.Id);
+        glDeleteBuffers(1, &m_uboMeshMatrices.Id);
+    }
     glMakeNamedBufferNonResidentNV(m_uboMaterial.Id);
     glDeleteBuffers(1, &m_uboMaterial.Id);
     delete [] m_objectMatrices;
     delete [] m_material;
-    if(m_meshFile)
+    abortStream();
+    endStream();
+    if(m_streamFile)
+        GCLOSE(m_streamFile);
+    if(m_cacheFile)
+        fclose(m_cacheFile);
+    if(m_meshFileMapping.base)
+        bk3d::unmapFile(&m_meshFileMapping);
+    else if(m_meshFile)
         free(m_meshFile);
+    if(m_bufferMemory)
+        free(m_bufferMemory);
 }
 //------------------------------------------------------------------------------
 // destroy the command buffers and states
@@ -156,11 +318,19 @@ void Bk3dModel::deleteCommandListData()
     m_tokenBufferModel.bufferAddr = 0;
     m_tokenBufferModel.bufferID = 0;
     m_tokenBufferModel.data.clear();
+    if(m_tokenBufferDepth.bufferID)
+        glDeleteBuffers(1, &m_tokenBufferDepth.bufferID);
+    m_tokenBufferDepth.bufferAddr = 0;
+    m_tokenBufferDepth.bufferID = 0;
+    m_tokenBufferDepth.data.clear();
+    m_tokenPatches.clear();
+    m_bRecaptureStates = false;
 
     // delete FBOs... m_tokenBufferModel.fbos
     for(int i=0; i<m_commandModel.stateGroups.size(); i++)
         glDeleteStatesNV(1, &m_commandModel.stateGroups[i]);
     m_commandModel.clear();
+    m_commandDepth.clear();
     m_bRecordObject     = true;
     if(m_commandList)
         glDeleteCommandListsNV(1, &m_commandList);
@@ -186,7 +356,10 @@ void Bk3dModel::releaseState(GLuint s)
         ++iM;
     }
     if(s<=0)
+    {
         m_glStates.clear();
+        m_stateSources.clear();
+    }
 }
 //------------------------------------------------------------------------------
 //
@@ -229,38 +402,106 @@ GLenum Bk3dModel::topologyWithoutStrips(GLenum topologyGL)
 //------------------------------------------------------------------------------
 //
 //------------------------------------------------------------------------------
-GLuint Bk3dModel::findStateOrCreate(bk3d::Mesh *pMesh, bk3d::PrimGroup* pPG)
+GLuint Bk3dModel::findStateOrCreate(bk3d::Mesh *pMesh, bk3d::PrimGroup* pPG, int variant)
 {
-    States sl = { pPG->topologyGL };
+    States sl = { pPG->topologyGL, variant, vertexFormat(pMesh) };
     std::map<States, GLuint, StateLess >::iterator iM = m_glStates.find(sl);
     if(iM == m_glStates.end())
     {
         GLuint id;
-        GLenum topologyGL = topologyWithoutStrips(pPG->topologyGL);
-        if(topologyGL == GL_NONE) // fail
+        if(topologyWithoutStrips(pPG->topologyGL) == GL_NONE) // fail
             return 0;
         glCreateStatesNV(1, &id);
-        //
-        // CAPTURE the states here
-        //
-        glStateCaptureNV(id, topologyGL);
-        emucmdlist::StateCaptureNV(id, topologyGL); // for emulation purpose
-        bk3d::AttributePool* pA = pMesh->pAttributes;
-        if(pA->n > 1)
-        {
-            emucmdlist::StateCaptureNV_Extra(id
-                , pA->p[0]->strideBytes, pA->p[0]->numComp, pA->p[0]->dataOffsetBytes
-                , pA->p[1]->strideBytes, pA->p[1]->numComp, pA->p[1]->dataOffsetBytes);
-        } else {
-            emucmdlist::StateCaptureNV_Extra(id
-                , pA->p[0]->strideBytes, pA->p[0]->numComp, pA->p[0]->dataOffsetBytes, 0,0,0);
-        }
+        captureState(id, sl, pMesh, pPG);
+        StateSource src = { pMesh, pPG };
+        m_stateSources[sl] = src;
         m_glStates[sl] = id;
         return id;
     }
     return iM->second;
 }
 //------------------------------------------------------------------------------
+// sets what the state sl needs and captures it in id
+//------------------------------------------------------------------------------
+void Bk3dModel::captureState(GLuint id, const States &sl, bk3d::Mesh *pMesh, bk3d::PrimGroup* pPG)
+{
+    GLenum topologyGL = topologyWithoutStrips(pPG->topologyGL);
+    bool bDepth = (sl.variant & MESHSHADER_DEPTH) != 0;
+    // the program and vertex format of this primitive group: the ones set may already be for the next
+    bindMeshShader(pPG->topologyGL, sl.variant);
+    if(bDepth)
+        bindPositionFormat(pMesh);
+    else
+        bindVertexFormat(pMesh);
+    int numAttribs = bDepth ? 1 : pMesh->pAttributes->n;
+    for(int a=0; a<16; a++)
+    {
+        if(a < numAttribs)
+            glEnableVertexAttribArray(a);
+        else
+            glDisableVertexAttribArray(a);
+    }
+    // depth-only: no color. After a depth prepass, the shaded pass must pass on equal depths
+    if(bDepth)
+        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    else if(g_bDepthPrepass && !m_posStreams.empty())
+        glDepthFunc(GL_LEQUAL);
+    //
+    // CAPTURE the states here
+    //
+    glStateCaptureNV(id, topologyGL);
+    emucmdlist::StateCaptureNV(id, topologyGL); // for emulation purpose
+    bk3d::AttributePool* pA = pMesh->pAttributes;
+    if(bDepth)
+    {
+        emucmdlist::StateCaptureNV_Extra(id
+            , positionStride(pA->p[0]), pA->p[0]->numComp, 0, 0,0,0);
+    }
+    else if(pA->n > 1)
+    {
+        emucmdlist::StateCaptureNV_Extra(id
+            , pA->p[0]->strideBytes, pA->p[0]->numComp, pA->p[0]->dataOffsetBytes
+            , pA->p[1]->strideBytes, pA->p[1]->numComp, pA->p[1]->dataOffsetBytes);
+    } else {
+        emucmdlist::StateCaptureNV_Extra(id
+            , pA->p[0]->strideBytes, pA->p[0]->numComp, pA->p[0]->dataOffsetBytes, 0,0,0);
+    }
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    glDepthFunc(GL_LESS);
+}
+//------------------------------------------------------------------------------
+// attribute formats of a mesh. Quantized ones are normalized (see quantizeVertices)
+//------------------------------------------------------------------------------
+void Bk3dModel::bindVertexFormat(bk3d::Mesh *pMesh)
+{
+    GLboolean normalized = vertexFormat(pMesh) ? GL_TRUE : GL_FALSE;
+    for(int s=0; s<pMesh->pAttributes->n; s++)
+    {
+        bk3d::Attribute* pA = pMesh->pAttributes->p[s];
+        glBindVertexBuffer(s, 0, 0, pA->strideBytes);
+        glVertexAttribFormat(s,pA->numComp, pA->formatGL, normalized, pA->dataOffsetBytes);
+    }
+}
+//------------------------------------------------------------------------------
+// attribute 0 alone, as in the position streams (see extractPositions)
+//------------------------------------------------------------------------------
+void Bk3dModel::bindPositionFormat(bk3d::Mesh *pMesh)
+{
+    bk3d::Attribute* pA = pMesh->pAttributes->p[0];
+    glBindVertexBuffer(0, 0, 0, positionStride(pA));
+    glVertexAttribFormat(0, pA->numComp, pA->formatGL, vertexFormat(pMesh) ? GL_TRUE : GL_FALSE, 0);
+}
+//------------------------------------------------------------------------------
+// meshes which primitive groups all got merged elsewhere have nothing to draw
+//------------------------------------------------------------------------------
+static bool hasDraws(const bk3d::Mesh* pMesh)
+{
+    for(int pg=0; pg<pMesh->pPrimGroups->n; pg++)
+        if(pMesh->pPrimGroups->p[pg]->indexCount > 0)
+            return true;
+    return false;
+}
+//------------------------------------------------------------------------------
 // if states from one to the other are different, return true
 //------------------------------------------------------------------------------
 bool Bk3dModel::comparePG(const bk3d::PrimGroup* pPrevPG, const bk3d::PrimGroup* pPG)
@@ -300,222 +541,411 @@ bool Bk3dModel::compareAttribs(bk3d::Mesh* pPrevMesh, bk3d::Mesh* pMesh)
 }
 
 //------------------------------------------------------------------------------
-// topology to 0 means we just build things as we get them
-// specific topology will only retain these ones
+// what the tokens of a range of draw records can take at most: the job gets it
+// once and for all, rather than growing along the recording. Each record may
+// start another mesh
 //------------------------------------------------------------------------------
-int Bk3dModel::recordMeshes(GLenum topology, std::vector<int> &offsets, GLsizei &tokenTableOffset, int &totalDCs, GLuint m_fboMSAA8x)
+size_t Bk3dModel::tokenBytesBound(const std::vector<DrawRecord> &records, int first, int last)
 {
-    int nDCs = 0;
-    // first default state capture
-    GLuint              curState = -1;
-    GLuint              curMaterial = 0xFFFFFFFF;
-    GLuint              curObjectTransform = 0xFFFFFFFF;
-    bk3d::PrimGroup*    pPrevPG = NULL;
-    bk3d::Mesh*         pPrevMesh = NULL;
-    bool                changed = false;
-    int                 prevNAttr = -1;
-    std::string         tokentable;
-
-    BO curVBO;
-    BO curEBO;
+    const size_t uniformSz = sizeof(UniformAddressCommandNV);
+    const size_t drawSz = sizeof(ElementAddressCommandNV) + sizeof(DrawElementsInstancedCommandNV);
+    size_t sz = 0;
+    for(int r=first; r< last; r++)
+    {
+        int i = records[r].mesh;
+        bk3d::Mesh *pMesh = m_meshFile->pMeshes->p[i];
+        std::map<int, Instances>::iterator iInst = m_instances.find(i);
+        size_t slices = (iInst != m_instances.end()) ? (iInst->second.count + INSTANCES_PER_DRAW-1) / INSTANCES_PER_DRAW : 1;
+        sz += uniformSz + pMesh->pAttributes->n * sizeof(AttributeAddressCommandNV);
+        sz += 2 * uniformSz + slices * (uniformSz + drawSz);
+    }
+    return sz;
+}
+//------------------------------------------------------------------------------
+// primitives drawn by a primitive group, for the stats
+//------------------------------------------------------------------------------
+static unsigned int primitiveCount(const bk3d::PrimGroup* pPG)
+{
+    switch(pPG->topologyGL)
+    {
+    case GL_LINES:
+        return pPG->indexCount/2;
+    case GL_LINE_STRIP:
+        return pPG->indexCount-1;
+    case GL_TRIANGLES:
+        return pPG->indexCount/3;
+    case GL_TRIANGLE_STRIP:
+        return pPG->indexCount-2;
+    case GL_QUADS:
+        return pPG->indexCount/4;
+    case GL_QUAD_STRIP:
+        return pPG->indexCount-3;
+    }
+    return 0; // GL_POINTS
+}
+//------------------------------------------------------------------------------
+// sort key of a primitive group of mesh i: the fields of g_SortKey, the first
+// one in the most significant bits
+// t: topology, s: shader variant, f: vertex format, m: material, x: transform
+// Values too big for their field get clamped: the order gets worse, the tokens
+// stay right. bits returns how many bits the key takes
+//------------------------------------------------------------------------------
+#define SORTKEY_IDBITS 20
 
-    //////////////////////////////////////////////
-    // Loop through meshes
-    //
-    // Hack: my captured models do have a bad geometry in mesh #0... *start with 1*
-    for(int i=g_firstMesh; i< m_meshFile->pMeshes->n; i++)
-	{
-		bk3d::Mesh *pMesh = m_meshFile->pMeshes->p[i];
-        int idx = (int)pMesh->userPtr;
-        curVBO = m_ObjVBOs[idx];
-        curEBO = m_ObjEBOs[idx];
-        int n = pMesh->pAttributes->n;
-        //
-        // the Mesh can (should) have a transformation associated to itself
-        // this is the mode where the primitive groups share the same transformation
-        // Change the uniform pointer of object transformation if it changed
-        //
-        if(pMesh->pTransforms
-            && (pMesh->pTransforms->n > 0)
-            && (curObjectTransform != pMesh->pTransforms->p[0]->ID))
+GLuint64 Bk3dModel::drawKey(int i, const bk3d::PrimGroup* pPG, int &bits)
+{
+    static const GLenum s_topologies[] = { GL_LINES, GL_TRIANGLES, GL_TRIANGLE_FAN, GL_QUADS, GL_POINTS };
+    const GLuint maxID = (1<<SORTKEY_IDBITS) - 1;
+    bk3d::Mesh *pMesh = m_meshFile->pMeshes->p[i];
+    bool bInstanced = m_instances.count(i) > 0;
+    GLuint64 key = 0;
+    unsigned int fields = 0;
+    bits = 0;
+    for(const char* c = g_SortKey.c_str(); *c; c++)
+    {
+        GLuint value = 0;
+        int n;
+        switch(*c)
         {
-            curObjectTransform = pMesh->pTransforms->p[0]->ID;
-            m_tokenBufferModel.data += buildUniformAddressCommand(UBO_MATRIXOBJ, m_uboObjectMatrices.Addr + (curObjectTransform * sizeof(MatrixBufferObject)), sizeof(MatrixBufferObject), STAGE_VERTEX);
-            m_stats.uniform_update++;
+        case 't':
+            n = 3;
+            value = (GLuint)(std::find(s_topologies, s_topologies + 5, topologyWithoutStrips(pPG->topologyGL)) - s_topologies);
+            break;
+        case 's':
+            n = 2;
+            value = (bInstanced ? MESHSHADER_INSTANCED : 0) | (vertexFormat(pMesh) ? MESHSHADER_OCTNORMALS : 0);
+            break;
+        case 'f':
+            n = 2;
+            value = vertexFormat(pMesh);
+            break;
+        case 'm':
+            n = SORTKEY_IDBITS;
+            value = pPG->pMaterial ? std::min((GLuint)pPG->pMaterial->ID + 1, maxID) : 0;
+            break;
+        case 'x':
+            // instances take their transforms from the draws; meshes with a matrix
+            // of their own (see initMeshTransforms) go after the others
+            n = SORTKEY_IDBITS;
+            if(bInstanced)
+                value = 0;
+            else if(pPG->pTransforms && (pPG->pTransforms->n > 0))
+                value = std::min((GLuint)pPG->pTransforms->p[0]->ID + 1, maxID);
+            else if(!m_meshMatrix.empty() && (m_meshMatrix[i] != ~0u))
+                value = maxID;
+            else if(pMesh->pTransforms && (pMesh->pTransforms->n > 0))
+                value = std::min((GLuint)pMesh->pTransforms->p[0]->ID + 1, maxID);
+            break;
+        default:
+            continue;
         }
-        //
-        // check if attribute info changed
-        //
-        if(pPrevMesh && compareAttribs(pPrevMesh, pMesh))
+        unsigned int field = 1 << (*c - 'a');
+        if((fields & field) || (bits + n > 64))
+            continue; // already in the key, or no room left
+        fields |= field;
+        key = (key << n) | value;
+        bits += n;
+    }
+    return key;
+}
+//------------------------------------------------------------------------------
+// the primitive groups to draw, in the order of the meshes; sorted on their key
+// when bSort. The radix sort is stable: draws with the same key stay in the
+// order of the meshes and keep sharing their attribute addresses
+// Returns the bits of the key
+//------------------------------------------------------------------------------
+int Bk3dModel::buildDrawRecords(std::vector<DrawRecord> &records, bool bSort)
+{
+    int keyBits = 0;
+    records.clear();
+    for(int i=g_firstMesh; i< m_meshFile->pMeshes->n; i++)
+    {
+        bk3d::Mesh *pMesh = m_meshFile->pMeshes->p[i];
+        if(m_ObjVBOs[(int)(size_t)pMesh->userPtr].Id == 0)
+            continue; // out-of-core: not resident, no token for this mesh
+        if(!m_meshPrototype.empty() && (m_meshPrototype[i] != i))
+            continue; // drawn with the instances of its prototype
+        if(!hasDraws(pMesh))
+            continue; // merged in another mesh (see flattenStatic)
+        for(int pg=0; pg<pMesh->pPrimGroups->n; pg++)
         {
-            changed = true;
-            if(pPrevPG)
-            {
-                // search for a state already available for our needs
-                curState = findStateOrCreate(pPrevMesh, pPrevPG);
-                m_commandModel.stateGroups.push_back(curState);
-                m_commandModel.fbos.push_back(m_fboMSAA8x);
-
-                // store the size of the token table
-                m_commandModel.sizes.push_back((GLsizei)m_tokenBufferModel.data.size() - tokenTableOffset);
-                offsets.push_back(tokenTableOffset);
-
-                // new offset and ptr
-                tokenTableOffset = (GLsizei)m_tokenBufferModel.data.size();
-                pPrevPG = NULL;
-            }
+            bk3d::PrimGroup* pPG = pMesh->pPrimGroups->p[pg];
+            // filter unsuported primitives: FANS (unless converted by processPrimGroups). Merged groups have nothing left
+            if((topologyWithoutStrips(pPG->topologyGL) == GL_NONE) || (pPG->indexCount == 0))
+                continue;
+            DrawRecord rec = { bSort ? drawKey(i, pPG, keyBits) : 0, i, pg };
+            records.push_back(rec);
         }
-        //
-        // build COMMANDS to assign pointers to attributes
-        //
-        int s=0;
-        for(; s<n; s++)
+    }
+    if(!bSort || records.empty())
+        return keyBits;
+    //
+    // LSD radix sort, 16 bits a pass. Passes where all the records have the same
+    // digit are skipped
+    //
+    std::vector<DrawRecord> sorted(records.size());
+    std::vector<size_t> counts(1<<16);
+    for(int shift=0; shift<keyBits; shift += 16)
+    {
+        std::fill(counts.begin(), counts.end(), 0);
+        for(size_t r=0; r<records.size(); r++)
+            counts[(records[r].key >> shift) & 0xFFFF]++;
+        if(counts[(records[0].key >> shift) & 0xFFFF] == records.size())
+            continue;
+        size_t sum = 0;
+        for(size_t d=0; d<counts.size(); d++)
         {
-            bk3d::Attribute* pA = pMesh->pAttributes->p[s];
-            bk3d::Slot*      pS = pMesh->pSlots->p[pA->slot];
-            tokentable += buildAttributeAddressCommand(s, curVBO.Addr + (GLuint64)pS->userPtr.p, pS->vtxBufferSizeBytes);
-            m_stats.attr_update++;
-
-            // set the OpenGL part... not necessary, normally
-            //if((pPrevMesh==NULL) || changed)
-            {
-                //glVertexAttribFormatNV(0, 3, GL_FLOAT, GL_FALSE, sizeof(vec3f));
-                glBindVertexBuffer(s, 0, 0, pA->strideBytes);
-                glVertexAttribFormat(s,pA->numComp, pA->formatGL, GL_FALSE, pA->dataOffsetBytes);
-                //glBufferAddressRangeNV(GL_VERTEX_ATTRIB_ARRAY_ADDRESS_NV, s, (GLuint64)pS->userPtr.p, pS->vtxBufferSizeBytes);
-	            glEnableVertexAttribArray(s);
-            }
+            size_t c = counts[d];
+            counts[d] = sum;
+            sum += c;
         }
-        changed = false;
-        for(int a=s; a<prevNAttr; a++)
-	        glDisableVertexAttribArray(a);
-        prevNAttr = n;
-        ////////////////////////////////////////
-        // Primitive groups in the mesh
-        //
-        for(int pg=0; pg<pMesh->pPrimGroups->n; pg++)
+        for(size_t r=0; r<records.size(); r++)
+            sorted[counts[(records[r].key >> shift) & 0xFFFF]++] = records[r];
+        records.swap(sorted);
+    }
+    return keyBits;
+}
+//------------------------------------------------------------------------------
+// tokens of the draw records [job.first, job.last), cut in segments wherever
+// the state changes. No OpenGL: runs on the recording threads (see recordTokenBufferObject)
+// The tokens of a mesh (transform, attribute addresses) are set again each time
+// the records go to another mesh
+// Depth-only jobs take attribute 0 from the position streams, draw no material
+// and leave lines and points to the shaded pass
+//------------------------------------------------------------------------------
+void Bk3dModel::recordJob(RecordJob &job, const std::vector<DrawRecord> &records)
+{
+    GLuint              curMaterial = 0xFFFFFFFF;
+    GLuint              curObjectTransform = 0xFFFFFFFF;
+    int                 curMesh = -1;
+    BO                  curEBO;
+    std::map<int, Instances>::iterator iInst;
+    bool                bInstanced = false;
+    bool                bMeshMatrix = false; // the mesh sets a transform of its own
+    int                 variant = 0;
+    bk3d::PrimGroup*    pPrevPG = NULL;
+    bk3d::Mesh*         pPrevMesh = NULL;
+    bk3d::Mesh*         pPrevPGMesh = NULL;
+    int                 prevVariant = 0;
+    TokenStream         tokentable; // attribute addresses, until the next draw
+    TokenStream        &data = job.tokens;
+    Stats              &stats = job.stats;
+
+    data.clear();
+    data.reserve(tokenBytesBound(records, job.first, job.last));
+    job.segments.clear();
+    memset(&stats, 0, sizeof(Stats));
+    job.nDCs = 0;
+    //////////////////////////////////////////////
+    // Loop through the draw records
+    //
+    for(int r=job.first; r< job.last; r++)
+    {
+        int i = records[r].mesh;
+        bk3d::Mesh *pMesh = m_meshFile->pMeshes->p[i];
+        bk3d::PrimGroup* pPG = pMesh->pPrimGroups->p[records[r].pg];
+        GLenum PGTopo = topologyWithoutStrips(pPG->topologyGL);
+        if(job.bDepth && ((PGTopo == GL_LINES) || (PGTopo == GL_POINTS)))
+            continue;
+        if(job.bDepth && (m_posStreams[i].sizeBytes == 0))
+            continue; // no position stream (see extractPositions)
+        if(i != curMesh)
         {
-            bk3d::PrimGroup* pPG = pMesh->pPrimGroups->p[pg];
-            GLenum PGTopo = topologyWithoutStrips(pPG->topologyGL);
-            // filter unsuported primitives: FANS
-            if(((topology != 0xFFFFFFFF) && (topology != PGTopo)) || (PGTopo == GL_NONE))
-                continue;
+            curMesh = i;
+            BO curVBO = m_ObjVBOs[(int)(size_t)pMesh->userPtr];
+            curEBO = m_ObjEBOs[m_meshEBO[i]];
+            iInst = m_instances.find(i);
+            bInstanced = iInst != m_instances.end();
+            variant = (bInstanced ? MESHSHADER_INSTANCED : 0);
+            if(job.bDepth)
+                variant |= MESHSHADER_DEPTH;
+            else if(vertexFormat(pMesh))
+                variant |= MESHSHADER_OCTNORMALS;
             //
-            // change the program is lines vs. polygons: no normals for lines
+            // the Mesh can (should) have a transformation associated to itself
+            // this is the mode where the primitive groups share the same transformation
+            // Change the uniform pointer of object transformation if it changed
+            // (instances: their transforms are given to each draw)
             //
-            if((pPG->topologyGL == GL_LINES)||(pPG->topologyGL == GL_LINE_STRIP))
+            bool bOwnMatrix = !m_meshMatrix.empty() && (m_meshMatrix[i] != ~0u);
+            bMeshMatrix = bInstanced || bOwnMatrix || (pMesh->pTransforms && (pMesh->pTransforms->n > 0));
+            if(!bInstanced && bOwnMatrix)
             {
-                glDisable(GL_POLYGON_OFFSET_FILL);
-                s_shaderMeshLine.bindShader();
-            } else {
-                glEnable(GL_POLYGON_OFFSET_FILL);
-                glPolygonOffset(1.0, 1.0); // no issue with redundant call here: the state capture will just deal with simplifying things
-                s_shaderMesh.bindShader();
-
+                // a matrix of its own (see initMeshTransforms)
+                curObjectTransform = 0xFFFFFFFF;
+                data.uniformAddress(UBO_MATRIXOBJ, m_uboMeshMatrices.Addr + m_meshMatrix[i] * sizeof(mat4f), sizeof(mat4f), STAGE_VERTEX);
+                stats.uniform_update++;
+            }
+            else if(!bInstanced && pMesh->pTransforms
+                && (pMesh->pTransforms->n > 0)
+                && (curObjectTransform != pMesh->pTransforms->p[0]->ID))
+            {
+                curObjectTransform = pMesh->pTransforms->p[0]->ID;
+                data.uniformAddress(UBO_MATRIXOBJ, m_uboObjectMatrices.Addr + (curObjectTransform * sizeof(MatrixBufferObject)), sizeof(MatrixBufferObject), STAGE_VERTEX);
+                stats.uniform_update++;
             }
-
             //
-            // Change the uniform pointer if material changed
+            // check if attribute info changed
             //
-            if(pPG->pMaterial && (curMaterial != pPG->pMaterial->ID))
+            if(!job.bDepth && pPrevMesh && pPrevPG && compareAttribs(pPrevMesh, pMesh))
             {
-                curMaterial = pPG->pMaterial->ID;
-                m_tokenBufferModel.data += buildUniformAddressCommand(UBO_MATERIAL, m_uboMaterial.Addr + (curMaterial * sizeof(MaterialBuffer)), sizeof(MaterialBuffer), STAGE_FRAGMENT);
-                m_stats.uniform_update++;
+                TokenSegment seg = { data.size(), pPrevPGMesh, pPrevPG, prevVariant };
+                job.segments.push_back(seg);
+                pPrevPG = NULL;
             }
             //
-            // the Primitive group can also have its own transformation
-            // this is the mode where the mesh don't own the transformation but its primitive groups do
-            // Change the uniform pointer of object transformation if it changed
+            // build COMMANDS to assign pointers to attributes
             //
-            if(pPG->pTransforms
-                && (pPG->pTransforms->n > 0)
-                && (curObjectTransform != pPG->pTransforms->p[0]->ID))
+            tokentable.clear();
+            if(job.bDepth)
             {
-                curObjectTransform = pPG->pTransforms->p[0]->ID;
-                m_tokenBufferModel.data += buildUniformAddressCommand(UBO_MATRIXOBJ, m_uboObjectMatrices.Addr + (curObjectTransform * sizeof(MatrixBufferObject)), sizeof(MatrixBufferObject), STAGE_VERTEX);
-                m_stats.uniform_update++;
+                tokentable.attributeAddress(0, curVBO.Addr + m_posStreams[i].offset, m_posStreams[i].sizeBytes);
+                stats.attr_update++;
             }
-            // if something changed: mark the cut for the previous stuff
-            // and start a new section
-            if(pPrevPG && comparePG(pPrevPG, pPG))
+            else for(int s=0; s<pMesh->pAttributes->n; s++)
             {
-                // search for a state already available for our needs
-                curState = findStateOrCreate(pMesh, pPrevPG);
-                m_commandModel.stateGroups.push_back(curState);
-                m_commandModel.fbos.push_back(m_fboMSAA8x);
-
-                // store the size of the token table
-                m_commandModel.sizes.push_back((GLsizei)m_tokenBufferModel.data.size() - tokenTableOffset);
-                offsets.push_back(tokenTableOffset);
-
-                // new offset
-                tokenTableOffset = (GLsizei)m_tokenBufferModel.data.size();
+                bk3d::Attribute* pA = pMesh->pAttributes->p[s];
+                bk3d::Slot*      pS = pMesh->pSlots->p[pA->slot];
+                tokentable.attributeAddress(s, curVBO.Addr + (GLuint64)pS->userPtr.p, pS->vtxBufferSizeBytes);
+                stats.attr_update++;
             }
-            if(!tokentable.empty())
+            pPrevMesh = pMesh;
+        }
+        //
+        // Change the uniform pointer if material changed
+        //
+        if(!job.bDepth && pPG->pMaterial && (curMaterial != pPG->pMaterial->ID))
+        {
+            curMaterial = pPG->pMaterial->ID;
+            data.uniformAddress(UBO_MATERIAL, m_uboMaterial.Addr + (curMaterial * sizeof(MaterialBuffer)), sizeof(MaterialBuffer), STAGE_FRAGMENT);
+            stats.uniform_update++;
+        }
+        //
+        // the Primitive group can also have its own transformation
+        // this is the mode where the mesh don't own the transformation but its primitive groups do
+        // Change the uniform pointer of object transformation if it changed
+        //
+        if(pPG->pTransforms
+            && (pPG->pTransforms->n > 0)
+            && (curObjectTransform != pPG->pTransforms->p[0]->ID))
+        {
+            curObjectTransform = pPG->pTransforms->p[0]->ID;
+            data.uniformAddress(UBO_MATRIXOBJ, m_uboObjectMatrices.Addr + (curObjectTransform * sizeof(MatrixBufferObject)), sizeof(MatrixBufferObject), STAGE_VERTEX);
+            stats.uniform_update++;
+        }
+        //
+        // no transformation at all: the first one of the table, as set at the beginning
+        // of the token buffer. Not whatever a previous mesh, its instances or the previous
+        // job left (the own matrices and instances leave curObjectTransform unknown)
+        //
+        else if(!bMeshMatrix && !(pPG->pTransforms && (pPG->pTransforms->n > 0)) && (curObjectTransform != 0))
+        {
+            curObjectTransform = 0;
+            data.uniformAddress(UBO_MATRIXOBJ, m_uboObjectMatrices.Addr, sizeof(MatrixBufferObject), STAGE_VERTEX);
+            stats.uniform_update++;
+        }
+        // if something changed: mark the cut for the previous stuff
+        // and start a new section
+        if(pPrevPG && (comparePG(pPrevPG, pPG) || (prevVariant != variant) || (vertexFormat(pPrevPGMesh) != vertexFormat(pMesh))))
+        {
+            TokenSegment seg = { data.size(), pPrevPGMesh, pPrevPG, prevVariant };
+            job.segments.push_back(seg);
+        }
+        if(!tokentable.empty())
+        {
+            data.append(tokentable);
+            tokentable.clear();
+        }
+        // add other token COMMANDS: elements + drawcall
+        if(pPG->indexArrayByteSize > 0)
+            data.elementAddress(curEBO.Addr + (GLuint64)pPG->userPtr, pPG->indexFormatGL);
+        if(bInstanced)
+        {
+            // as many draws as slices of the table of transforms the UBO can take
+            for(GLuint first=0; first<iInst->second.count; first += INSTANCES_PER_DRAW)
             {
-                m_tokenBufferModel.data += tokentable;
-                tokentable.clear();
+                GLuint count = std::min(iInst->second.count - first, (GLuint)INSTANCES_PER_DRAW);
+                data.uniformAddress(UBO_MATRIXOBJ, m_uboMeshMatrices.Addr + (iInst->second.first + first) * sizeof(mat4f), count * sizeof(mat4f), STAGE_VERTEX);
+                stats.uniform_update++;
+                if(pPG->indexArrayByteSize > 0)
+                    data.drawElementsInstanced(pPG->topologyGL, pPG->indexCount, count, baseVertex(pPG));
+                else
+                    data.drawArraysInstanced(pPG->topologyGL, pPG->indexCount, count);
+                job.nDCs++;
             }
-//            m_tokenBufferModel.data += buildUniformAddressCommand(UBO_LIGHT, g_uboLight.Addr, sizeof(LightBuffer), STAGE_FRAGMENT);
-///                m_stats.uniform_update++;
-            // add other token COMMANDS: elements + drawcall
+            curObjectTransform = 0xFFFFFFFF;
+            stats.primitives += primitiveCount(pPG) * iInst->second.count;
+        } else {
             if(pPG->indexArrayByteSize > 0)
-            {
-                m_tokenBufferModel.data += buildElementAddressCommand(curEBO.Addr + (GLuint64)pPG->userPtr, pPG->indexFormatGL);
-                m_tokenBufferModel.data += buildDrawElementsCommand(pPG->topologyGL, pPG->indexCount);
-                nDCs++;
-            } else {
-                m_tokenBufferModel.data += buildDrawArraysCommand(pPG->topologyGL, pPG->indexCount);
-                nDCs++;
-            }
-            // gather some stats
-            switch(pPG->topologyGL)
-            {
-            case GL_LINES:
-                m_stats.primitives += pPG->indexCount/2;
-                break;
-            case GL_LINE_STRIP:
-                m_stats.primitives += pPG->indexCount-1;
-                break;
-            case GL_TRIANGLES:
-                m_stats.primitives += pPG->indexCount/3;
-                break;
-            case GL_TRIANGLE_STRIP:
-                m_stats.primitives += pPG->indexCount-2;
-                break;
-            case GL_QUADS:
-                m_stats.primitives += pPG->indexCount/4;
-                break;
-            case GL_QUAD_STRIP:
-                m_stats.primitives += pPG->indexCount-3;
-                break;
-            case GL_POINTS:
-                //m_stats.primitives += pPG->indexCount;
-                break;
-            }
-            m_stats.drawcalls++;
+                data.drawElements(pPG->topologyGL, pPG->indexCount, baseVertex(pPG));
+            else
+                data.drawArrays(pPG->topologyGL, pPG->indexCount);
+            job.nDCs++;
+            stats.primitives += primitiveCount(pPG);
+        }
+        stats.drawcalls++;
 
-            pPrevPG = pPG;
-        } // for(int pg=0; pg<pMesh->pPrimGroups->n; pg++)
-        pPrevMesh = pMesh;
-    } // for(int i=0; i< m_meshFile->pMeshes->n; i++)
+        pPrevPG = pPG;
+        pPrevPGMesh = pMesh;
+        prevVariant = variant;
+    } // for(int r=job.first; r< job.last; r++)
     if(pPrevPG)
     {
-        // search for a state already available for our needs
-        curState = findStateOrCreate(pPrevMesh, pPrevPG);
-        m_commandModel.stateGroups.push_back(curState);
-        m_commandModel.fbos.push_back(m_fboMSAA8x);
-
-        // store the size of the token table
-        m_commandModel.sizes.push_back((GLsizei)m_tokenBufferModel.data.size() - tokenTableOffset);
-        offsets.push_back(tokenTableOffset);
-
-        // new offset and ptr
-        tokenTableOffset = (GLsizei)m_tokenBufferModel.data.size();
-        pPrevPG = NULL;
+        TokenSegment seg = { data.size(), pPrevPGMesh, pPrevPG, prevVariant };
+        job.segments.push_back(seg);
+    }
+}
+//------------------------------------------------------------------------------
+// GL side of the recording: the tokens of the jobs of a pass go one after the
+// other in the token buffer and each segment gets its state object. A batch
+// starts where the previous one ended, so that tokens before a cut are part of
+// it. Jobs start with no state of their own: when the first segment of a job
+// needs the same state as the last one of the previous job, it continues its batch.
+// Returns the number of draw calls
+//------------------------------------------------------------------------------
+int Bk3dModel::stitchJobs(std::vector<RecordJob> &jobs, bool bDepth, TokenBuffer &tb, CommandStatesBatch &batches, std::vector<int> &offsets, GLuint fbo)
+{
+    int nDCs = 0;
+    size_t sz = tb.data.size();
+    for(size_t j=0; j<jobs.size(); j++)
+        if(jobs[j].bDepth == bDepth)
+            sz += jobs[j].tokens.size();
+    tb.data.reserve(sz);
+    size_t batchEnd = offsets.empty() ? 0 : offsets.back() + batches.sizes.back();
+    const TokenSegment* pLast = NULL;
+    for(size_t j=0; j<jobs.size(); j++)
+    {
+        RecordJob &job = jobs[j];
+        if(job.bDepth != bDepth)
+            continue;
+        size_t base = tb.data.size();
+        tb.data.append(job.tokens);
+        nDCs += job.nDCs;
+        if(!bDepth)
+        {
+            m_stats.primitives      += job.stats.primitives;
+            m_stats.drawcalls       += job.stats.drawcalls;
+            m_stats.attr_update     += job.stats.attr_update;
+            m_stats.uniform_update  += job.stats.uniform_update;
+        }
+        for(size_t s=0; s<job.segments.size(); s++)
+        {
+            const TokenSegment &seg = job.segments[s];
+            GLuint id = findStateOrCreate(seg.pMesh, seg.pPG, seg.variant);
+            if((s == 0) && pLast && (batches.stateGroups.back() == id) && !comparePG(pLast->pPG, seg.pPG)
+              && (pLast->pMesh->pAttributes->n == seg.pMesh->pAttributes->n))
+            {
+                batches.sizes.back() = (GLsizei)(base + seg.end - offsets.back());
+            } else {
+                batches.stateGroups.push_back(id);
+                batches.fbos.push_back(fbo);
+                batches.sizes.push_back((GLsizei)(base + seg.end - batchEnd));
+                offsets.push_back((int)batchEnd);
+            }
+            batchEnd = base + seg.end;
+            pLast = &seg;
+        }
     }
-    totalDCs += nDCs;
     return nDCs;
 }
 //------------------------------------------------------------------------------
@@ -531,6 +961,9 @@ void Bk3dModel::init_command_list()
     glCreateCommandListsNV(1, &m_commandList);
     {
         glCommandListSegmentsNV(m_commandList, 1);
+        // depth prepass first, in the same segment
+        if(g_bDepthPrepass && (m_commandDepth.numItems > 0))
+            glListDrawCommandsStatesClientNV(m_commandList, 0, &m_commandDepth.dataPtrs[0], &m_commandDepth.sizes[0], &m_commandDepth.stateGroups[0], &m_commandDepth.fbos[0], int(m_commandDepth.fbos.size() ));
         glListDrawCommandsStatesClientNV(m_commandList, 0, &m_commandModel.dataPtrs[0], &m_commandModel.sizes[0], &m_commandModel.stateGroups[0], &m_commandModel.fbos[0], int(m_commandModel.fbos.size() )); 
     }
     glCompileCommandListNV(m_commandList);
@@ -545,6 +978,71 @@ void Bk3dModel::update_fbo_target(GLuint fbo)
     // simple case now: same for all
     for(int i=0; i<m_commandModel.fbos.size(); i++)
         m_commandModel.fbos[i] = fbo;
+    for(int i=0; i<m_commandDepth.fbos.size(); i++)
+        m_commandDepth.fbos[i] = fbo;
+}
+//------------------------------------------------------------------------------
+// the render target changed (MSAA, supersampling): rather than recording the
+// tokens again, the ones depending on it get rewritten in place and only their
+// ranges get uploaded again. The state objects are captured again for the new
+// FBO at the next display (see recaptureStates)
+//------------------------------------------------------------------------------
+void Bk3dModel::patchTargets(GLuint fbo, float lineWidth)
+{
+    if(m_bRecordObject)
+        return; // nothing recorded yet
+    update_fbo_target(fbo);
+    for(size_t i=0; i<m_tokenPatches.size(); i++)
+    {
+        const TokenPatch &patch = m_tokenPatches[i];
+        char* p = &m_tokenBufferModel.data[patch.offset];
+        size_t sz = 0;
+        switch(patch.type)
+        {
+        case PATCH_LINEWIDTH:
+            {
+                TokenStream ts(p, sizeof(LineWidthCommandNV));
+                ts.lineWidth(lineWidth);
+                sz = ts.size();
+            }
+            break;
+        }
+        if(m_tokenBufferModel.bufferID && sz)
+            glNamedBufferSubDataEXT(m_tokenBufferModel.bufferID, patch.offset, sz, p);
+    }
+    m_bRecaptureStates = true;
+}
+//------------------------------------------------------------------------------
+// the same states again, for the FBO now bound; then the command-list
+//------------------------------------------------------------------------------
+void Bk3dModel::recaptureStates()
+{
+    std::map<States, GLuint, StateLess >::iterator iM;
+    glEnableClientState(GL_VERTEX_ATTRIB_ARRAY_UNIFIED_NV);
+    glEnableClientState(GL_ELEMENT_ARRAY_UNIFIED_NV);
+    glEnableClientState(GL_UNIFORM_BUFFER_UNIFIED_NV);
+    // the ones of the viewport token buffer come first
+    if(m_commandModel.numItems > 0)
+    {
+        glStateCaptureNV(m_commandModel.stateGroups[0], GL_TRIANGLES);
+        emucmdlist::StateCaptureNV(m_commandModel.stateGroups[0], GL_TRIANGLES);
+    }
+    if(m_commandDepth.numItems > 0)
+    {
+        glStateCaptureNV(m_commandDepth.stateGroups[0], GL_TRIANGLES);
+        emucmdlist::StateCaptureNV(m_commandDepth.stateGroups[0], GL_TRIANGLES);
+    }
+    for(iM = m_glStates.begin(); iM != m_glStates.end(); ++iM)
+    {
+        const StateSource &src = m_stateSources[iM->first];
+        captureState(iM->second, iM->first, src.pMesh, src.pPG);
+    }
+    init_command_list();
+    glDisableClientState(GL_VERTEX_ATTRIB_ARRAY_UNIFIED_NV);
+    glDisableClientState(GL_ELEMENT_ARRAY_UNIFIED_NV);
+    glDisableClientState(GL_UNIFORM_BUFFER_UNIFIED_NV);
+    m_bRecaptureStates = false;
+    LOGI("%s: %d state objects captured again\n", m_name.c_str(), (int)m_glStates.size());
 }
 //------------------------------------------------------------------------------
 // build token buffer, states objects and commandList for the 3D Object
@@ -553,6 +1051,14 @@ void Bk3dModel::update_fbo_target(GLuint fbo)
 // then the states will be captured. The idea is to capture them everytime one
 // changed.
 //------------------------------------------------------------------------------
+static void logTokenOptimization(const char* what, const TokenOptStats &opt)
+{
+    LOGI("%s: %d tokens and %.2f kb less (%d attribute and %d uniform addresses already set, %d element addresses folded in the draws)\n",
+        what, opt.tokensIn - opt.tokensOut, (float)(opt.bytesIn - opt.bytesOut)/1024.0f, opt.attrDropped, opt.uniformDropped, opt.elementsFolded);
+}
+
+#define RECORD_MINDRAWS 256 // per recording thread: below, threads cost more than they save
+
 bool Bk3dModel::recordTokenBufferObject(GLuint m_fboMSAA8x)
 {
     deleteCommandListData();
@@ -560,7 +1066,6 @@ bool Bk3dModel::recordTokenBufferObject(GLuint m_fboMSAA8x)
     if(!m_meshFile)
         return false;
 
-    GLsizei tokenTableOffset = 0;
     std::vector<int> offsets;
 
     glEnableClientState(GL_VERTEX_ATTRIB_ARRAY_UNIFIED_NV);
@@ -587,48 +1092,84 @@ bool Bk3dModel::recordTokenBufferObject(GLuint m_fboMSAA8x)
     //
     LOGI("Creating a command-Buffer for %d Meshes\n", m_meshFile->pMeshes->n);
     LOGFLUSH();
-    m_tokenBufferModel.data += buildLineWidthCommand(g_Supersampling);
-    m_tokenBufferModel.data += buildUniformAddressCommand(UBO_MATRIX, g_uboMatrix.Addr, sizeof(MatrixBufferGlobal), STAGE_VERTEX);
-    m_tokenBufferModel.data += buildUniformAddressCommand(UBO_MATRIXOBJ, m_uboObjectMatrices.Addr, sizeof(MatrixBufferObject), STAGE_VERTEX);
-    m_tokenBufferModel.data += buildUniformAddressCommand(UBO_LIGHT, g_uboLight.Addr, sizeof(LightBuffer), STAGE_FRAGMENT);
-    m_stats.uniform_update+=3;
-
-    int nDCs = 0;
-    int totalDCs = 0;
-    switch(g_TokenBufferGrouping)
+    //
+    // one pass over the meshes: a record per primitive group to draw. Sorting by
+    // states (grouping) orders them on their key, so that draws needing the same
+    // state object and uniforms end up next to each other (see drawKey)
+    //
+    std::vector<DrawRecord> records;
+    bool bSort = g_TokenBufferGrouping == 1;
+    int keyBits = buildDrawRecords(records, bSort);
+    if(bSort)
     {
-    case 0:
-        nDCs = recordMeshes(-1, offsets, tokenTableOffset, totalDCs, m_fboMSAA8x);
-        break;
-    case 1:
-        LOGI("Sorting by primitive types\n", m_meshFile->pMeshes->n);
-        LOGFLUSH();
-        nDCs = recordMeshes(GL_LINES, offsets, tokenTableOffset, totalDCs, m_fboMSAA8x);
-        LOGI("GL_LINES: %d\n", nDCs);
-        LOGFLUSH();
-        nDCs = recordMeshes(GL_TRIANGLES, offsets, tokenTableOffset, totalDCs, m_fboMSAA8x);
-        LOGI("GL_TRIANGLES/STRIP: %d\n", nDCs);
-        LOGFLUSH();
-        nDCs = recordMeshes(GL_TRIANGLE_FAN, offsets, tokenTableOffset, totalDCs, m_fboMSAA8x);
-        LOGI("GL_TRIANGLE_FAN: %d\n", nDCs);
-        LOGFLUSH();
-        nDCs = recordMeshes(GL_QUADS, offsets, tokenTableOffset, totalDCs, m_fboMSAA8x);
-        LOGI("GL_QUADS/STRIP: %d\n", nDCs);
+        LOGI("Sorting %d draws on '%s' (%d bits keys)\n", (int)records.size(), g_SortKey.c_str(), keyBits);
         LOGFLUSH();
-        nDCs = recordMeshes(GL_POINTS, offsets, tokenTableOffset, totalDCs, m_fboMSAA8x);
-        LOGI("GL_POINTS: %d\n", nDCs);
-        LOGFLUSH();
-        break;
     }
     //
-    // create the buffer object for this token buffer:
+    // CPU phase: the tokens of ranges of records, as long as each other, on the
+    // recording threads. The same ranges again for the depth-only commands
     //
-    glGenBuffers(1, &m_tokenBufferModel.bufferID);
-    glNamedBufferDataEXT(m_tokenBufferModel.bufferID, m_tokenBufferModel.data.size(), &m_tokenBufferModel.data[0], GL_STATIC_DRAW);
-    // get the 64 bits pointer and make it resident: bedcause we will go through its pointer
-    glGetNamedBufferParameterui64vNV(m_tokenBufferModel.bufferID, GL_BUFFER_GPU_ADDRESS_NV, &m_tokenBufferModel.bufferAddr);
-    glMakeNamedBufferResidentNV(m_tokenBufferModel.bufferID, GL_READ_ONLY);
-    LOGOK("Token buffer of %.2f kb created for %d state changes and %d Drawcalls\n", (float)m_tokenBufferModel.data.size()/1024.0, m_commandModel.stateGroups.size(), totalDCs);
+    int numRecords = (int)records.size();
+    int numThreads = g_RecordThreads > 0 ? g_RecordThreads : (int)std::thread::hardware_concurrency();
+    numThreads = std::max(1, std::min(numThreads, numRecords / RECORD_MINDRAWS));
+    bool bDepth = !m_posStreams.empty();
+    std::vector<RecordJob> jobs((bDepth ? 2 : 1) * numThreads);
+    for(size_t j=0; j<jobs.size(); j++)
+    {
+        int r = (int)j % numThreads;
+        jobs[j].bDepth = (int)j >= numThreads;
+        jobs[j].first = (int)(((size_t)numRecords * r) / numThreads);
+        jobs[j].last = (int)(((size_t)numRecords * (r+1)) / numThreads);
+    }
+    if(numThreads == 1)
+    {
+        for(size_t j=0; j<jobs.size(); j++)
+            recordJob(jobs[j], records);
+    } else {
+        std::atomic<int> nextJob(0);
+        std::vector<std::thread> workers;
+        for(int t=0; t<numThreads; t++)
+            workers.push_back(std::thread([&]() {
+                for(int j; (j = nextJob++) < (int)jobs.size(); )
+                    recordJob(jobs[j], records);
+            }));
+        for(int t=0; t<numThreads; t++)
+            workers[t].join();
+    }
+    //
+    // GL phase: state objects and the token buffer
+    //
+    TokenPatch lw = { m_tokenBufferModel.data.size(), PATCH_LINEWIDTH };
+    m_tokenPatches.push_back(lw);
+    m_tokenBufferModel.data.lineWidth(g_Supersampling);
+    m_tokenBufferModel.data.uniformAddress(UBO_MATRIX, g_uboMatrix.Addr, sizeof(MatrixBufferGlobal), STAGE_VERTEX);
+    m_tokenBufferModel.data.uniformAddress(UBO_MATRIXOBJ, m_uboObjectMatrices.Addr, sizeof(MatrixBufferObject), STAGE_VERTEX);
+    m_tokenBufferModel.data.uniformAddress(UBO_LIGHT, g_uboLight.Addr, sizeof(LightBuffer), STAGE_FRAGMENT);
+    m_stats.uniform_update+=3;
+
+    int totalDCs = stitchJobs(jobs, false, m_tokenBufferModel, m_commandModel, offsets, m_fboMSAA8x);
+    // no draw (e.g. out-of-core with nothing resident yet): sizes only has the viewport batch
+    if(g_bOptimizeTokens && !offsets.empty())
+    {
+        std::vector<size_t> marks;
+        for(size_t i=0; i<m_tokenPatches.size(); i++)
+            marks.push_back(m_tokenPatches[i].offset);
+        TokenOptStats opt = optimizeTokens(m_tokenBufferModel.data, offsets, &m_commandModel.sizes[1], marks, m_ObjEBOs);
+        for(size_t i=0; i<m_tokenPatches.size(); i++)
+            m_tokenPatches[i].offset = marks[i];
+        m_stats.attr_update -= opt.attrDropped;
+        m_stats.uniform_update -= opt.uniformDropped;
+        logTokenOptimization("token buffer", opt);
+    }
+    //
+    // create the buffer object for this token buffer:
+    //
+    glGenBuffers(1, &m_tokenBufferModel.bufferID);
+    glNamedBufferDataEXT(m_tokenBufferModel.bufferID, m_tokenBufferModel.data.size(), &m_tokenBufferModel.data[0], GL_STATIC_DRAW);
+    // get the 64 bits pointer and make it resident: bedcause we will go through its pointer
+    glGetNamedBufferParameterui64vNV(m_tokenBufferModel.bufferID, GL_BUFFER_GPU_ADDRESS_NV, &m_tokenBufferModel.bufferAddr);
+    glMakeNamedBufferResidentNV(m_tokenBufferModel.bufferID, GL_READ_ONLY);
+    LOGOK("Token buffer of %.2f kb created for %d state changes and %d Drawcalls (%d recording threads)\n", (float)m_tokenBufferModel.data.size()/1024.0, m_commandModel.stateGroups.size(), totalDCs, numThreads);
     LOGOK("Total of %d primitives\n", m_stats.primitives);
     LOGFLUSH();
     //
@@ -644,6 +1185,43 @@ bool Bk3dModel::recordTokenBufferObject(GLuint m_fboMSAA8x)
         m_commandModel.dataGPUPtrs.push_back(m_tokenBufferModel.bufferAddr + offsets[i]);
     }
     //
+    // depth-only commands, from the position streams (see -z)
+    //
+    if(bDepth)
+    {
+        std::vector<int> depthOffsets;
+        glCreateStatesNV(1, &st);
+        glStateCaptureNV(st, GL_TRIANGLES);
+        emucmdlist::StateCaptureNV(st, GL_TRIANGLES); // for emulation purpose
+        m_commandDepth.pushBatch(st, m_fboMSAA8x,
+            g_tokenBufferViewport.bufferAddr,
+            &g_tokenBufferViewport.data[0],
+            g_tokenBufferViewport.data.size() );
+        m_tokenBufferDepth.data.uniformAddress(UBO_MATRIX, g_uboMatrix.Addr, sizeof(MatrixBufferGlobal), STAGE_VERTEX);
+        m_tokenBufferDepth.data.uniformAddress(UBO_MATRIXOBJ, m_uboObjectMatrices.Addr, sizeof(MatrixBufferObject), STAGE_VERTEX);
+        int nDepthDCs = stitchJobs(jobs, true, m_tokenBufferDepth, m_commandDepth, depthOffsets, m_fboMSAA8x);
+        if(g_bOptimizeTokens && !depthOffsets.empty())
+        {
+            std::vector<size_t> marks;
+            logTokenOptimization("depth token buffer", optimizeTokens(m_tokenBufferDepth.data, depthOffsets, &m_commandDepth.sizes[1], marks, m_ObjEBOs));
+        }
+        if(!m_tokenBufferDepth.data.empty())
+        {
+            glGenBuffers(1, &m_tokenBufferDepth.bufferID);
+            glNamedBufferDataEXT(m_tokenBufferDepth.bufferID, m_tokenBufferDepth.data.size(), &m_tokenBufferDepth.data[0], GL_STATIC_DRAW);
+            glGetNamedBufferParameterui64vNV(m_tokenBufferDepth.bufferID, GL_BUFFER_GPU_ADDRESS_NV, &m_tokenBufferDepth.bufferAddr);
+            glMakeNamedBufferResidentNV(m_tokenBufferDepth.bufferID, GL_READ_ONLY);
+        }
+        m_commandDepth.numItems += depthOffsets.size();
+        for(int i=0; i<depthOffsets.size(); i++)
+        {
+            m_commandDepth.dataPtrs.push_back(&m_tokenBufferDepth.data[depthOffsets[i]]);
+            m_commandDepth.dataGPUPtrs.push_back(m_tokenBufferDepth.bufferAddr + depthOffsets[i]);
+        }
+        LOGOK("Depth token buffer of %.2f kb created for %d state changes and %d Drawcalls\n", (float)m_tokenBufferDepth.data.size()/1024.0, (int)depthOffsets.size(), nDepthDCs);
+        LOGFLUSH();
+    }
+    //
     // Create the command-list
     //
     init_command_list();
@@ -657,23 +1235,277 @@ bool Bk3dModel::recordTokenBufferObject(GLuint m_fboMSAA8x)
     return true;
 }
 
+//------------------------------------------------------------------------------
+// Geometry heap (-H <Mb>): rather than buffer objects of their own, all models
+// take their VBO/EBO ranges from a few big resident buffers shared by all.
+// Each buffer keeps a free-list of its ranges by offset, so that neighbours get
+// merged back when freed; allocations take the best fit of all buffers. Bigger
+// ranges than the heap size get a buffer for themselves. Buffers are dropped
+// once empty.
+// When a range can't fit although there is enough free space in total, the
+// buffers get compacted (-D 1): used ranges move down and their owners get
+// their BOs updated (see relocateBO) and record their commands again
+//------------------------------------------------------------------------------
+#define HEAP_ALIGNMENT 256
+struct HeapRange {
+    GLsizeiptr  Sz;
+    Bk3dModel*  owner;
+};
+struct HeapBuffer {
+    GLuint      Id;
+    GLuint64    Addr;
+    GLsizeiptr  Sz;
+    std::map<GLintptr, GLsizeiptr>  freeRanges; // the free-list: offset -> size
+    std::map<GLintptr, HeapRange>   usedRanges;
+};
+static std::vector<HeapBuffer> s_heapBuffers;
+
+static GLsizeiptr heapFreeBytes()
+{
+    GLsizeiptr sz = 0;
+    for(size_t b=0; b<s_heapBuffers.size(); b++)
+        for(std::map<GLintptr, GLsizeiptr>::iterator iF = s_heapBuffers[b].freeRanges.begin(); iF != s_heapBuffers[b].freeRanges.end(); ++iF)
+            sz += iF->second;
+    return sz;
+}
+
+static bool heapBestFit(GLsizeiptr sz, size_t &buffer, GLintptr &offset)
+{
+    GLsizeiptr best = 0;
+    for(size_t b=0; b<s_heapBuffers.size(); b++)
+        for(std::map<GLintptr, GLsizeiptr>::iterator iF = s_heapBuffers[b].freeRanges.begin(); iF != s_heapBuffers[b].freeRanges.end(); ++iF)
+            if((iF->second >= sz) && ((best == 0) || (iF->second < best)))
+            {
+                best = iF->second;
+                buffer = b;
+                offset = iF->first;
+            }
+    return best > 0;
+}
+
+//------------------------------------------------------------------------------
+// moves the used ranges of each buffer to its beginning. Overlapping moves go
+// through a scratch buffer: a copy can't overlap itself
+//------------------------------------------------------------------------------
+void Bk3dModel::compactGeometryHeap()
+{
+    GLuint scratch = 0;
+    GLsizeiptr scratchSz = 0;
+    GLsizeiptr moved = 0;
+    for(size_t b=0; b<s_heapBuffers.size(); b++)
+    {
+        HeapBuffer &hb = s_heapBuffers[b];
+        std::map<GLintptr, HeapRange> usedRanges;
+        GLintptr cursor = 0;
+        for(std::map<GLintptr, HeapRange>::iterator iU = hb.usedRanges.begin(); iU != hb.usedRanges.end(); ++iU)
+        {
+            GLintptr from = iU->first;
+            GLsizeiptr sz = iU->second.Sz;
+            if(from != cursor)
+            {
+                if(from - cursor < sz)
+                {
+                    if(scratchSz < sz)
+                    {
+                        if(scratch)
+                            glDeleteBuffers(1, &scratch);
+                        glGenBuffers(1, &scratch);
+                        glNamedBufferDataEXT(scratch, sz, NULL, GL_STREAM_COPY);
+                        scratchSz = sz;
+                    }
+                    glNamedCopyBufferSubDataEXT(hb.Id, scratch, from, 0, sz);
+                    glNamedCopyBufferSubDataEXT(scratch, hb.Id, 0, cursor, sz);
+                }
+                else
+                    glNamedCopyBufferSubDataEXT(hb.Id, hb.Id, from, cursor, sz);
+                iU->second.owner->relocateBO(hb.Id, from, cursor, hb.Addr);
+                moved += sz;
+            }
+            usedRanges[cursor] = iU->second;
+            cursor += sz;
+        }
+        hb.usedRanges.swap(usedRanges);
+        hb.freeRanges.clear();
+        if(cursor < hb.Sz)
+            hb.freeRanges[cursor] = hb.Sz - cursor;
+    }
+    if(scratch)
+        glDeleteBuffers(1, &scratch);
+    LOGI("geometry heap compacted: %f Mb moved\n", (float)moved/(float)(1024*1024));
+}
+
+//------------------------------------------------------------------------------
+// a buffer object for bo.Sz bytes: a range of the heap or a buffer of its own
+//------------------------------------------------------------------------------
+void Bk3dModel::allocateBO(BO &bo)
+{
+    bo.Offset = 0;
+    if(g_GeometryHeapMb <= 0)
+    {
+        glGenBuffers(1, &bo.Id);
+        glNamedBufferDataEXT(bo.Id, bo.Sz, NULL, GL_STATIC_DRAW);
+        glGetNamedBufferParameterui64vNV(bo.Id, GL_BUFFER_GPU_ADDRESS_NV, &bo.Addr);
+        if(bo.Sz > 0)
+            glMakeNamedBufferResidentNV(bo.Id, GL_READ_ONLY);
+        return;
+    }
+    GLsizeiptr sz = (bo.Sz + HEAP_ALIGNMENT-1) & ~(GLsizeiptr)(HEAP_ALIGNMENT-1);
+    size_t b = 0;
+    GLintptr offset = 0;
+    bool bFit = (sz == 0) && !s_heapBuffers.empty();
+    if(!bFit && (sz > 0))
+    {
+        bFit = heapBestFit(sz, b, offset);
+        if(!bFit && g_bHeapCompaction && (heapFreeBytes() >= sz))
+        {
+            compactGeometryHeap();
+            bFit = heapBestFit(sz, b, offset);
+        }
+    }
+    if(!bFit)
+    {
+        HeapBuffer hb;
+        hb.Sz = std::max(sz, (GLsizeiptr)g_GeometryHeapMb * 1024*1024);
+        glGenBuffers(1, &hb.Id);
+        glNamedBufferDataEXT(hb.Id, hb.Sz, NULL, GL_STATIC_DRAW);
+        glGetNamedBufferParameterui64vNV(hb.Id, GL_BUFFER_GPU_ADDRESS_NV, &hb.Addr);
+        glMakeNamedBufferResidentNV(hb.Id, GL_READ_ONLY);
+        hb.freeRanges[0] = hb.Sz;
+        s_heapBuffers.push_back(hb);
+        b = s_heapBuffers.size() - 1;
+        offset = 0;
+        LOGI("geometry heap: buffer #%d of %f Mb\n", (int)b, (float)hb.Sz/(float)(1024*1024));
+    }
+    HeapBuffer &hb = s_heapBuffers[b];
+    bo.Id = hb.Id;
+    bo.Offset = offset;
+    bo.Addr = hb.Addr + offset;
+    if(sz == 0)
+        return; // nothing reserved
+    std::map<GLintptr, GLsizeiptr>::iterator iF = hb.freeRanges.find(offset);
+    GLsizeiptr left = iF->second - sz;
+    hb.freeRanges.erase(iF);
+    if(left > 0)
+        hb.freeRanges[offset + sz] = left;
+    HeapRange r = { sz, this };
+    hb.usedRanges[offset] = r;
+}
+
+//------------------------------------------------------------------------------
+// gives the range back to the free-list of its buffer, merged with its free neighbours
+//------------------------------------------------------------------------------
+void Bk3dModel::releaseBO(BO &bo)
+{
+    if(g_GeometryHeapMb <= 0)
+    {
+        if(bo.Sz > 0)
+            glMakeNamedBufferNonResidentNV(bo.Id);
+        glDeleteBuffers(1, &bo.Id);
+    }
+    // empty ones have nothing reserved
+    for(size_t b=0; (g_GeometryHeapMb > 0) && (bo.Sz > 0) && (b<s_heapBuffers.size()); b++)
+    {
+        HeapBuffer &hb = s_heapBuffers[b];
+        if(hb.Id != bo.Id)
+            continue;
+        std::map<GLintptr, HeapRange>::iterator iU = hb.usedRanges.find(bo.Offset);
+        if(iU == hb.usedRanges.end())
+            break;
+        GLintptr offset = iU->first;
+        GLsizeiptr sz = iU->second.Sz;
+        hb.usedRanges.erase(iU);
+        std::map<GLintptr, GLsizeiptr>::iterator iNext = hb.freeRanges.lower_bound(offset);
+        if((iNext != hb.freeRanges.end()) && (iNext->first == offset + sz))
+        {
+            sz += iNext->second;
+            hb.freeRanges.erase(iNext++);
+        }
+        if(iNext != hb.freeRanges.begin())
+        {
+            std::map<GLintptr, GLsizeiptr>::iterator iPrev = iNext;
+            --iPrev;
+            if(iPrev->first + iPrev->second == offset)
+            {
+                offset = iPrev->first;
+                sz += iPrev->second;
+                hb.freeRanges.erase(iPrev);
+            }
+        }
+        hb.freeRanges[offset] = sz;
+        if(hb.usedRanges.empty())
+        {
+            glMakeNamedBufferNonResidentNV(hb.Id);
+            glDeleteBuffers(1, &hb.Id);
+            s_heapBuffers.erase(s_heapBuffers.begin() + b);
+        }
+        break;
+    }
+    bo.Id = 0;
+    bo.Addr = 0;
+    bo.Offset = 0;
+}
+
+//------------------------------------------------------------------------------
+// a range of the heap moved (see compactGeometryHeap): GPU addresses in the
+// token buffers are wrong now
+//------------------------------------------------------------------------------
+void Bk3dModel::relocateBO(GLuint id, GLintptr from, GLintptr to, GLuint64 bufferAddr)
+{
+    for(int k=0; k<2; k++)
+    {
+        std::vector<BO> &bos = k ? m_ObjEBOs : m_ObjVBOs;
+        for(size_t i=0; i<bos.size(); i++)
+            if((bos[i].Id == id) && (bos[i].Offset == from) && (bos[i].Sz > 0))
+            {
+                bos[i].Offset = to;
+                bos[i].Addr = bufferAddr + to;
+            }
+    }
+    m_bRecordObject = true;
+}
+
 //------------------------------------------------------------------------------
 // It is possible to create one VBO for one Mesh; and one EBO for each primitive group
 // however, for this sample, we will create only one VBO for all and one EBO
 // meshes and primitive groups will have an offset in these buffers
 //------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+// files repacked by tools/bk3d_repack hold the exact image of each buffer
+// object: every item of a buffer object is at the same distance from its
+// offset in it. Then the whole buffer object gets uploaded with one copy
+//------------------------------------------------------------------------------
+struct BakedLayout
+{
+    std::vector<const char*>    base;
+    std::vector<GLsizeiptr>     end;
+    bool check(size_t bo, const void* pData, GLsizeiptr offset, GLsizeiptr sz)
+    {
+        if(base.size() <= bo)
+        {
+            base.resize(bo+1, NULL);
+            end.resize(bo+1, 0);
+        }
+        const char* b = (const char*)pData - offset;
+        if(base[bo] == NULL)
+            base[bo] = b;
+        else if(base[bo] != b)
+            return false;
+        if(offset + sz > end[bo])
+            end[bo] = offset + sz;
+        return true;
+    }
+};
+
 bool Bk3dModel::initBuffersObject()
 {
     LOGOK("Init buffers\n");
     LOGFLUSH();
     BO curVBO;
     BO curEBO;
-    unsigned int totalVBOSz = 0;
-    unsigned int totalEBOSz = 0;
+    GLuint64 totalVBOSz = 0;
+    GLuint64 totalEBOSz = 0;
     memset(&curVBO, 0, sizeof(curVBO));
     memset(&curEBO, 0, sizeof(curEBO));
-	glGenBuffers(1, &curVBO.Id);
-	glGenBuffers(1, &curEBO.Id);
 
     //m_meshFile->pMeshes->n = 60000;
     //
@@ -708,7 +1540,7 @@ bool Bk3dModel::initBuffersObject()
         glMakeNamedBufferResidentNV(m_uboMaterial.Id, GL_READ_WRITE);
         glBindBufferBase(GL_UNIFORM_BUFFER,UBO_MATERIAL, m_uboMaterial.Id);
 
-        LOGI("%d materials stored in %d Kb\n", m_meshFile->pMaterials->nMaterials, (m_uboMaterial.Sz+512)/1024);
+        LOGI("%d materials stored in %d Kb\n", m_meshFile->pMaterials->nMaterials, (int)((m_uboMaterial.Sz+512)/1024));
         LOGFLUSH();
     }
 
@@ -731,168 +1563,2140 @@ bool Bk3dModel::initBuffersObject()
         if(m_uboObjectMatrices.Id == 0)
             glGenBuffers(1, &m_uboObjectMatrices.Id);
 
-        m_uboObjectMatrices.Sz = sizeof(MatrixBufferObject) * m_objectMatricesNItems;
-        glNamedBufferDataEXT(m_uboObjectMatrices.Id, m_uboObjectMatrices.Sz, m_objectMatrices, GL_STREAM_DRAW);
-        glGetNamedBufferParameterui64vNV(m_uboObjectMatrices.Id, GL_BUFFER_GPU_ADDRESS_NV, (GLuint64EXT*)&m_uboObjectMatrices.Addr);
-        glMakeNamedBufferResidentNV(m_uboObjectMatrices.Id, GL_READ_WRITE);
-        glBindBufferBase(GL_UNIFORM_BUFFER,UBO_MATRIXOBJ, m_uboObjectMatrices.Id);
+        m_uboObjectMatrices.Sz = sizeof(MatrixBufferObject) * m_objectMatricesNItems;
+        glNamedBufferDataEXT(m_uboObjectMatrices.Id, m_uboObjectMatrices.Sz, m_objectMatrices, GL_STREAM_DRAW);
+        glGetNamedBufferParameterui64vNV(m_uboObjectMatrices.Id, GL_BUFFER_GPU_ADDRESS_NV, (GLuint64EXT*)&m_uboObjectMatrices.Addr);
+        glMakeNamedBufferResidentNV(m_uboObjectMatrices.Id, GL_READ_WRITE);
+        glBindBufferBase(GL_UNIFORM_BUFFER,UBO_MATRIXOBJ, m_uboObjectMatrices.Id);
+
+        LOGI("%d matrices stored in %d Kb\n", m_meshFile->pTransforms->nBones, (int)((m_uboObjectMatrices.Sz + 512)/1024));
+        LOGFLUSH();
+    }
+
+    //
+    // out-of-core: buffer objects are made for each mesh when it gets close to the camera
+    //
+    if(g_StreamingBudgetMb > 0)
+        return initBuffersOutOfCore();
+    //
+    // the layout and content of the buffer objects were processed in a previous run
+    //
+    if(m_cacheFile)
+        return initBuffersFromCache();
+    //
+    // First pass: which VBO and EBO each mesh goes in (see bk3d::planBuffers)
+    // and offsets to where we'll find data back
+    //
+    int numMeshes = m_meshFile->pMeshes->n;
+    std::vector<unsigned long long> vtxSz(numMeshes, 0), idxSz(numMeshes, 0);
+    for(int i=0; i< numMeshes; i++)
+    {
+        bk3d::Mesh *pMesh = m_meshFile->pMeshes->p[i];
+        if(!m_meshPrototype.empty() && (m_meshPrototype[i] != i))
+            continue; // takes no room
+        for(int s=0; s<pMesh->pSlots->n; s++)
+            vtxSz[i] += ((GLsizeiptr)pMesh->pSlots->p[s]->vtxBufferSizeBytes + 0xFF) & ~(GLsizeiptr)0xFF;
+        if(!m_posStreams.empty() && (m_posStreams[i].slot < 0))
+            vtxSz[i] += (m_posStreams[i].sizeBytes + 0xFF) & ~(GLsizeiptr)0xFF;
+        for(int pg=0; pg<pMesh->pPrimGroups->n; pg++)
+            idxSz[i] += ((GLsizeiptr)pMesh->pPrimGroups->p[pg]->indexArrayByteSize + 0xFF) & ~(GLsizeiptr)0xFF;
+    }
+    std::vector<int> vboOf, eboOf;
+    unsigned long long budgets[2] = { (unsigned long long)g_MaxBOSz * 1024*1024, (unsigned long long)g_MaxEBOSz * 1024*1024 };
+    BO emptyBO;
+    memset(&emptyBO, 0, sizeof(BO));
+    m_ObjVBOs.assign(bk3d::planBuffers(vtxSz, budgets[0], vboOf), emptyBO);
+    m_ObjEBOs.assign(bk3d::planBuffers(idxSz, budgets[1], eboOf), emptyBO);
+    m_meshEBO.assign(numMeshes, 0);
+    std::vector<int> meshesIn[2];
+    std::vector<GLsizeiptr> dataIn[2];
+    meshesIn[0].assign(m_ObjVBOs.size(), 0); dataIn[0].assign(m_ObjVBOs.size(), 0);
+    meshesIn[1].assign(m_ObjEBOs.size(), 0); dataIn[1].assign(m_ObjEBOs.size(), 0);
+    BakedLayout bakedVBOs, bakedEBOs;
+    bool bBaked = true;
+    bk3d::Mesh *pMesh = NULL;
+    for(int i=0; i< numMeshes; i++)
+	{
+		pMesh = m_meshFile->pMeshes->p[i];
+        if(!m_meshPrototype.empty() && (m_meshPrototype[i] != i))
+        {
+            // same geometry as a previous mesh: same place in the same buffer objects
+            bk3d::Mesh *pProto = m_meshFile->pMeshes->p[m_meshPrototype[i]];
+            pMesh->userPtr = pProto->userPtr;
+            m_meshEBO[i] = m_meshEBO[m_meshPrototype[i]];
+            for(int s=0; s<pMesh->pSlots->n; s++)
+            {
+                pMesh->pSlots->p[s]->userData = 0;
+                pMesh->pSlots->p[s]->userPtr = pProto->pSlots->p[s]->userPtr;
+            }
+            for(int pg=0; pg<pMesh->pPrimGroups->n; pg++)
+                pMesh->pPrimGroups->p[pg]->userPtr = pProto->pPrimGroups->p[pg]->userPtr;
+            if(!m_posStreams.empty())
+                m_posStreams[i] = m_posStreams[m_meshPrototype[i]];
+            continue;
+        }
+        pMesh->userPtr = (void*)(size_t)vboOf[i]; // keep track of the VBO
+        m_meshEBO[i] = eboOf[i];
+        BO &vbo = m_ObjVBOs[vboOf[i]];
+        BO &ebo = m_ObjEBOs[eboOf[i]];
+        meshesIn[0][vboOf[i]]++;
+        if(idxSz[i] > 0)
+            meshesIn[1][eboOf[i]]++;
+        //
+        // Slots: buffers for vertices
+        //
+        int n = pMesh->pSlots->n;
+        for(int s=0; s<n; s++)
+        {
+            bk3d::Slot* pS = pMesh->pSlots->p[s];
+            pS->userData = 0;
+            pS->userPtr = (int*)(size_t)vbo.Sz;
+            bBaked = bBaked && bakedVBOs.check(vboOf[i], pS->pVtxBufferData, vbo.Sz, pS->vtxBufferSizeBytes);
+            vbo.Sz += ((GLsizeiptr)pS->vtxBufferSizeBytes + 0xFF) & ~(GLsizeiptr)0xFF;
+            dataIn[0][vboOf[i]] += pS->vtxBufferSizeBytes;
+        }
+        //
+        // position stream: after the slots (see extractPositions)
+        //
+        if(!m_posStreams.empty() && (m_posStreams[i].sizeBytes > 0))
+        {
+            PositionStream &ps = m_posStreams[i];
+            if(ps.slot >= 0)
+                ps.offset = (GLuint64)(size_t)pMesh->pSlots->p[ps.slot]->userPtr.p;
+            else {
+                ps.offset = vbo.Sz;
+                bBaked = bBaked && bakedVBOs.check(vboOf[i], ps.pData, vbo.Sz, ps.sizeBytes);
+                vbo.Sz += (ps.sizeBytes + 0xFF) & ~(GLsizeiptr)0xFF;
+                dataIn[0][vboOf[i]] += ps.sizeBytes;
+            }
+        }
+        //
+        // Primitive groups
+        //
+        for(int pg=0; pg<pMesh->pPrimGroups->n; pg++)
+        {
+            bk3d::PrimGroup* pPG = pMesh->pPrimGroups->p[pg];
+            if(pPG->indexArrayByteSize > 0)
+            {
+                pPG->userPtr = (void*)(size_t)ebo.Sz;
+                bBaked = bBaked && bakedEBOs.check(eboOf[i], pPG->pIndexBufferData, ebo.Sz, pPG->indexArrayByteSize);
+                ebo.Sz += ((GLsizeiptr)pPG->indexArrayByteSize + 0xFF) & ~(GLsizeiptr)0xFF;
+                dataIn[1][eboOf[i]] += pPG->indexArrayByteSize;
+            } else {
+                pPG->userPtr = (void*)~0;
+            }
+        }
+	}
+    //
+    // creation of the buffer objects, in place: the heap may move the ones created first
+    // (glNamedBufferStorageEXT() not working with NSight !!! https://www.opengl.org/registry/specs/ARB/buffer_storage.txt)
+    //
+    for(int k=0; k<2; k++)
+    {
+        std::vector<BO> &bos = k ? m_ObjEBOs : m_ObjVBOs;
+        for(size_t b=0; b<bos.size(); b++)
+        {
+            allocateBO(bos[b]);
+            (k ? totalEBOSz : totalVBOSz) += bos[b].Sz;
+            LOGI("%s #%d: %d meshes, %.2f Mb (%.0f%% of the budget), %.0f%% of it used by data\n", k ? "EBO" : "VBO", (int)b, meshesIn[k][b],
+                (float)bos[b].Sz/(float)(1024*1024), budgets[k] > 0 ? 100.0f * (float)bos[b].Sz / (float)budgets[k] : 0.0f,
+                bos[b].Sz > 0 ? 100.0f * (float)dataIn[k][b] / (float)bos[b].Sz : 0.0f);
+        }
+    }
+    //
+    // second pass: put stuff in the buffer and store offsets
+    //
+    if(m_streamUpload)
+    {
+        // the loader thread inflates the file in the staging ring: copies go on in streamStep()
+        if(!beginStreamUpload())
+            return false;
+    }
+    else if(bBaked)
+    {
+        // the buffer area already is the image of each buffer object
+        LOGI("baked layout: one copy per buffer object\n");
+        for(int i=0; i<(int)bakedVBOs.base.size(); i++)
+            if(bakedVBOs.base[i])
+                glNamedBufferSubDataEXT(m_ObjVBOs[i].Id, m_ObjVBOs[i].Offset, bakedVBOs.end[i], bakedVBOs.base[i]);
+        for(int i=0; i<(int)bakedEBOs.base.size(); i++)
+            if(bakedEBOs.base[i])
+                glNamedBufferSubDataEXT(m_ObjEBOs[i].Id, m_ObjEBOs[i].Offset, bakedEBOs.end[i], bakedEBOs.base[i]);
+    }
+    else for(int i=0; i< m_meshFile->pMeshes->n; i++)
+	{
+		bk3d::Mesh *pMesh = m_meshFile->pMeshes->p[i];
+        if(!m_meshPrototype.empty() && (m_meshPrototype[i] != i))
+            continue; // uploaded with its prototype
+        curVBO = m_ObjVBOs[(int)(size_t)pMesh->userPtr];
+        curEBO = m_ObjEBOs[m_meshEBO[i]];
+        int n = pMesh->pSlots->n;
+        for(int s=0; s<n; s++)
+        {
+            bk3d::Slot* pS = pMesh->pSlots->p[s];
+            glNamedBufferSubDataEXT(curVBO.Id, curVBO.Offset + (GLintptr)(size_t)pS->userPtr.p, pS->vtxBufferSizeBytes, pS->pVtxBufferData);
+        }
+        if(!m_posStreams.empty() && m_posStreams[i].pData)
+            glNamedBufferSubDataEXT(curVBO.Id, curVBO.Offset + (GLintptr)m_posStreams[i].offset, m_posStreams[i].sizeBytes, m_posStreams[i].pData);
+        for(int pg=0; pg<pMesh->pPrimGroups->n; pg++)
+        {
+            bk3d::PrimGroup* pPG = pMesh->pPrimGroups->p[pg];
+            if(pPG->indexArrayByteSize > 0)
+                glNamedBufferSubDataEXT(curEBO.Id, curEBO.Offset + (GLintptr)(size_t)pPG->userPtr, pPG->indexArrayByteSize, pPG->pIndexBufferData);
+        }
+        //glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	}
+    LOGI("meshes: %d in :%d VBOs (%f Mb) and %d EBOs (%f Mb) \n", m_meshFile->pMeshes->n, m_ObjVBOs.size(), (float)totalVBOSz/(float)(1024*1024), m_ObjEBOs.size(), (float)totalEBOSz/(float)(1024*1024));
+    LOGFLUSH();
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Out-of-core mode (see -O <Mb>): each mesh gets its own VBO/EBO, only created
+// when the mesh gets in (or close to) the view frustum. Past the budget, the
+// meshes unseen for the longest time lose their buffer objects.
+// Vertex and index data are read from the bk3d file when needed: with mapped
+// files (-f 1), the system only pages-in the meshes that got uploaded and can
+// drop these clean pages whenever it wants
+//------------------------------------------------------------------------------
+#define STREAMING_MARGIN 1.5f // bounding spheres get bigger: meshes near the frustum are fetched, too
+
+bool Bk3dModel::initBuffersOutOfCore()
+{
+    GLuint64 totalSz = 0;
+    int n = m_meshFile->pMeshes->n;
+    m_ObjVBOs.resize(n);
+    m_ObjEBOs.resize(n);
+    m_meshEBO.resize(n);
+    m_meshLastUsed.assign(n, 0);
+    for(int i=0; i<n; i++)
+    {
+        bk3d::Mesh *pMesh = m_meshFile->pMeshes->p[i];
+        pMesh->userPtr = (void*)(size_t)i;
+        m_meshEBO[i] = i;
+        BO &vbo = m_ObjVBOs[i];
+        BO &ebo = m_ObjEBOs[i];
+        memset(&vbo, 0, sizeof(BO));
+        memset(&ebo, 0, sizeof(BO));
+        // same 256 bytes aligned layout as initBuffersObject(), but in buffers of its own
+        for(int s=0; s<pMesh->pSlots->n; s++)
+        {
+            bk3d::Slot* pS = pMesh->pSlots->p[s];
+            pS->userData = 0;
+            pS->userPtr = (int*)(size_t)vbo.Sz;
+            vbo.Sz += ((GLsizeiptr)pS->vtxBufferSizeBytes + 0xFF) & ~(GLsizeiptr)0xFF;
+        }
+        if(!m_posStreams.empty() && (m_posStreams[i].sizeBytes > 0))
+        {
+            PositionStream &ps = m_posStreams[i];
+            if(ps.slot >= 0)
+                ps.offset = (GLuint64)(size_t)pMesh->pSlots->p[ps.slot]->userPtr.p;
+            else {
+                ps.offset = vbo.Sz;
+                vbo.Sz += (ps.sizeBytes + 0xFF) & ~(GLsizeiptr)0xFF;
+            }
+        }
+        for(int pg=0; pg<pMesh->pPrimGroups->n; pg++)
+        {
+            bk3d::PrimGroup* pPG = pMesh->pPrimGroups->p[pg];
+            if(pPG->indexArrayByteSize > 0)
+            {
+                pPG->userPtr = (void*)(size_t)ebo.Sz;
+                ebo.Sz += ((GLsizeiptr)pPG->indexArrayByteSize + 0xFF) & ~(GLsizeiptr)0xFF;
+            } else {
+                pPG->userPtr = (void*)~0;
+            }
+        }
+        totalSz += vbo.Sz + ebo.Sz;
+    }
+    LOGI("meshes: %d streamed out-of-core (%f Mb in total, %d Mb budget)\n", n, (float)totalSz/(float)(1024*1024), g_StreamingBudgetMb);
+    return true;
+}
+
+void Bk3dModel::makeMeshResident(int i)
+{
+    bk3d::Mesh *pMesh = m_meshFile->pMeshes->p[i];
+    BO &vbo = m_ObjVBOs[i];
+    BO &ebo = m_ObjEBOs[i];
+    // both first: the heap may move the one allocated first
+    allocateBO(vbo);
+    allocateBO(ebo);
+    for(int s=0; s<pMesh->pSlots->n; s++)
+    {
+        bk3d::Slot* pS = pMesh->pSlots->p[s];
+        glNamedBufferSubDataEXT(vbo.Id, vbo.Offset + (GLintptr)(size_t)pS->userPtr.p, pS->vtxBufferSizeBytes, pS->pVtxBufferData);
+    }
+    if(!m_posStreams.empty() && m_posStreams[i].pData)
+        glNamedBufferSubDataEXT(vbo.Id, vbo.Offset + (GLintptr)m_posStreams[i].offset, m_posStreams[i].sizeBytes, m_posStreams[i].pData);
+    for(int pg=0; pg<pMesh->pPrimGroups->n; pg++)
+    {
+        bk3d::PrimGroup* pPG = pMesh->pPrimGroups->p[pg];
+        if(pPG->indexArrayByteSize > 0)
+            glNamedBufferSubDataEXT(ebo.Id, ebo.Offset + (GLintptr)(size_t)pPG->userPtr, pPG->indexArrayByteSize, pPG->pIndexBufferData);
+    }
+    m_residentBytes += vbo.Sz + ebo.Sz;
+}
+
+void Bk3dModel::evictMesh(int i)
+{
+    BO &vbo = m_ObjVBOs[i];
+    BO &ebo = m_ObjEBOs[i];
+    releaseBO(vbo);
+    releaseBO(ebo);
+    m_residentBytes -= vbo.Sz + ebo.Sz;
+}
+
+static bool lastUsedLess(const std::pair<unsigned int,int> &a, const std::pair<unsigned int,int> &b) { return a.first < b.first; }
+
+//------------------------------------------------------------------------------
+// mvp: from the model to the clip space. Returns true if the resident set changed
+//------------------------------------------------------------------------------
+bool Bk3dModel::updateResidency(const mat4f &mvp)
+{
+    bool changed = false;
+    GLuint64 uploaded = 0;
+    GLuint64 budget = (GLuint64)g_StreamingBudgetMb * 1024*1024;
+    m_frame++;
+    for(int i=0; i<m_meshFile->pMeshes->n; i++)
+    {
+        bk3d::Mesh *pMesh = m_meshFile->pMeshes->p[i];
+        //
+        // frustum planes in the space of the mesh
+        //
+        mat4f m = mvp;
+        if(pMesh->pTransforms && (pMesh->pTransforms->n > 0) && m_objectMatrices)
+            m = mvp * m_objectMatrices[pMesh->pTransforms->p[0]->ID].mO;
+        const float *a = m.mat_array;
+        float r = pMesh->bsphere.radius * STREAMING_MARGIN;
+        const float *c = pMesh->bsphere.pos;
+        bool visible = true;
+        for(int p=0; visible && (p<6); p++)
+        {
+            // rows of the matrix: w +/- x, w +/- y, w +/- z
+            int row = p>>1;
+            float sign = (p & 1) ? -1.0f : 1.0f;
+            float pl[4];
+            for(int k=0; k<4; k++)
+                pl[k] = a[k*4+3] + sign * a[k*4+row];
+            float len = sqrtf(pl[0]*pl[0] + pl[1]*pl[1] + pl[2]*pl[2]);
+            if((pl[0]*c[0] + pl[1]*c[1] + pl[2]*c[2] + pl[3]) < -r*len)
+                visible = false;
+        }
+        if(!visible)
+            continue;
+        m_meshLastUsed[i] = m_frame;
+        if((m_ObjVBOs[i].Id == 0) && (uploaded < (GLuint64)g_StreamingUploadMb * 1024*1024))
+        {
+            makeMeshResident(i);
+            uploaded += m_ObjVBOs[i].Sz + m_ObjEBOs[i].Sz;
+            changed = true;
+        }
+    }
+    //
+    // LRU eviction of the meshes that aren't visible in this frame
+    //
+    if(m_residentBytes > budget)
+    {
+        std::vector< std::pair<unsigned int,int> > lru;
+        for(int i=0; i<m_meshFile->pMeshes->n; i++)
+            if(m_ObjVBOs[i].Id && (m_meshLastUsed[i] != m_frame))
+                lru.push_back(std::pair<unsigned int,int>(m_meshLastUsed[i], i));
+        std::sort(lru.begin(), lru.end(), lastUsedLess);
+        for(int j=0; (j<lru.size()) && (m_residentBytes > budget); j++)
+        {
+            evictMesh(lru[j].second);
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+//------------------------------------------------------------------------------
+// attributes and slots of a mesh in a compact vertex format (see VTXQUANT_*):
+// positions then normals, interleaved in the slot of positions. No data
+//------------------------------------------------------------------------------
+static void setQuantizedFormat(bk3d::Mesh* pMesh, int mode)
+{
+    GLuint stride = mode == VTXQUANT_OCT8 ? 8 : 12;
+    bk3d::Attribute* pP = pMesh->pAttributes->p[0];
+    bk3d::Slot* pS = pMesh->pSlots->p[pP->slot];
+    if(pMesh->pAttributes->n > 1)
+    {
+        bk3d::Attribute* pN = pMesh->pAttributes->p[1];
+        if(pN->slot != pP->slot)
+            pMesh->pSlots->p[pN->slot]->vtxBufferSizeBytes = 0;
+        pN->formatGL        = mode == VTXQUANT_OCT8 ? GL_BYTE : GL_SHORT;
+        pN->numComp         = 2;
+        pN->strideBytes     = stride;
+        pN->dataOffsetBytes = mode == VTXQUANT_OCT8 ? 6 : 8;
+        pN->slot            = pP->slot;
+    }
+    pP->formatGL            = GL_UNSIGNED_SHORT;
+    pP->numComp             = 3;
+    pP->strideBytes         = stride;
+    pP->dataOffsetBytes     = 0;
+    pS->vtxBufferStrideBytes= stride;
+    pS->vtxBufferSizeBytes  = pS->vertexCount * stride;
+}
+
+//------------------------------------------------------------------------------
+// Cache of processed models (see -C <folder>): for a source file and the options
+// changing the layout, it stores the layout of the VBOs/EBOs, their content and
+// the auto-scaling of the model. On a hit, only the header area gets read from
+// the source file and the buffer objects are read straight from the cache.
+// Token buffers aren't cached: they hold GPU addresses and state objects that
+// are only valid for the current run
+//
+// layout: CacheHeader | GLsizeiptr sizes of the VBOs then of the EBOs
+//       | for each mesh: int VBO index, int EBO index, int prototype, int vertex format, AABBox,
+//         GLuint64 offsets of its slots then offset and state of its primitive groups,
+//         GLuint64 offset and size, GLuint stride and int slot of its position stream
+//       | content of the VBOs then of the EBOs
+//------------------------------------------------------------------------------
+#define CACHE_MAGIC     0x50334b42 // 'BK3P'
+#define CACHE_VERSION   0x108
+struct CacheHeader {
+    unsigned int        magic;
+    unsigned int        version;
+    unsigned long long  sourceSize;
+    unsigned long long  sourceTime; // modification time
+    unsigned long long  sourceHash;
+    int                 maxBOSz;
+    int                 maxEBOSz;
+    int                 numMeshes;
+    int                 numVBOs;
+    int                 numEBOs;
+    int                 firstMesh;  // findInstances() only takes prototypes from there
+    float               posOffset[3];
+    float               scale;      // 0 if the model isn't auto-scaled
+};
+
+//------------------------------------------------------------------------------
+// no OpenGL: can run on a loader thread. Entries are named after the size and
+// modification time of the source file: the content is only hashed when they
+// match, to tell for sure. A miss leaves m_cacheName set so that uploadModel()
+// writes the entry, and *pSource with the content of the source file: it had
+// to be read for the hash of the entry, loadFile() loads the model from it
+//------------------------------------------------------------------------------
+bool Bk3dModel::openCache(const char *path, std::vector<char> *pSource)
+{
+    m_cacheName.clear();
+    unsigned long long &size = m_cacheStamp[0], &time = m_cacheStamp[1];
+    if(!bk3d::fileStamp(path, &size, &time))
+        return false;
+    // the options processing the layout are part of the name
+    // (-m too: meshes before it can't be prototypes of instances)
+    char name[112];
+    int options = (g_bCompactIndices ? 1 : 0) | (g_bMergePrimGroups ? 2 : 0) | (g_bInstancing ? 4 : 0) | (g_QuantizeVertices << 3)
+                | (g_bDepthStream ? 0x20 : 0);
+    sprintf(name, "/%llx_%llx_%d_%d_%x_%d.bk3dcache", size, time, g_MaxBOSz, g_MaxEBOSz, options, g_firstMesh);
+    m_cacheName = g_CacheDir + std::string(name);
+    FILE *fp = fopen(m_cacheName.c_str(), "rb");
+    CacheHeader ch;
+    if(fp && (fread(&ch, sizeof(CacheHeader), 1, fp) == 1)
+      && (ch.magic == CACHE_MAGIC) && (ch.version == CACHE_VERSION) && (ch.sourceSize == size) && (ch.sourceTime == time)
+      && (ch.maxBOSz == g_MaxBOSz) && (ch.maxEBOSz == g_MaxEBOSz) && (ch.firstMesh == g_firstMesh))
+    {
+        // only files which header area can be read alone have their buffer objects cached
+        GFILE fd;
+        if(m_meshFile = bk3d::loadHeader(path, &fd))
+        {
+            GCLOSE(fd);
+            if((ch.numMeshes == m_meshFile->pMeshes->n) && (bk3d::hashFile(path) == ch.sourceHash))
+            {
+                if(readCacheLayout(fp, ch.numVBOs, ch.numEBOs))
+                {
+                    LOGI("%s found in the cache\n", m_name.c_str());
+                    m_cacheHash = ch.sourceHash;
+                    m_cacheNumVBOs = ch.numVBOs;
+                    if((m_scale <= 0.0) && (ch.scale > 0.0))
+                    {
+                        m_posOffset = vec3f(ch.posOffset[0], ch.posOffset[1], ch.posOffset[2]);
+                        m_scale = ch.scale;
+                    }
+                    m_cacheFile = fp; // initBuffersObject() will read the rest
+                    return true;
+                }
+                // truncated or corrupted: made again from the source
+                LOGW("%s: %s is corrupted. The entry is made again\n", m_name.c_str(), m_cacheName.c_str());
+                clearCacheLayout();
+                fclose(fp);
+                fp = NULL;
+                remove(m_cacheName.c_str());
+            }
+            free(m_meshFile);
+            m_meshFile = NULL;
+        }
+    }
+    if(fp)
+        fclose(fp);
+    // miss: the content is read once, for the hash and to be loaded
+    FILE *src = fopen(path, "rb");
+    if(src)
+    {
+        pSource->resize((size_t)bk3d::fileSize(src));
+        if(!pSource->empty() && (fread(&(*pSource)[0], 1, pSource->size(), src) != pSource->size()))
+            pSource->clear();
+        fclose(src);
+    }
+    if(pSource->empty())
+    {
+        m_cacheName.clear();
+        return false;
+    }
+    m_cacheHash = bk3d::hashBytes(&(*pSource)[0], pSource->size());
+    return false;
+}
+
+//------------------------------------------------------------------------------
+// layout part of a cache entry, read and checked on the loader thread before a
+// hit is reported: counts and sizes against the length of the file, indices
+// and offsets against the buffer objects. fp stays at the content of the
+// buffer objects. Returns false on anything wrong: the entry is a miss then
+//------------------------------------------------------------------------------
+template<class T> static bool readCache(FILE *fp, T *p, size_t n=1)
+{
+    return fread(p, sizeof(T), n, fp) == n;
+}
+
+bool Bk3dModel::readCacheLayout(FILE *fp, int numVBOs, int numEBOs)
+{
+    unsigned long long fileSz = bk3d::fileSize(fp);
+    if((numVBOs < 0) || (numEBOs < 0) || (fileSz < sizeof(CacheHeader))
+      || ((unsigned long long)(numVBOs + numEBOs) * sizeof(GLsizeiptr) > fileSz - sizeof(CacheHeader)))
+        return false;
+    std::vector<GLsizeiptr> &sizes = m_cacheSizes;
+    sizes.resize(numVBOs + numEBOs);
+    if(!sizes.empty() && !readCache(fp, &sizes[0], sizes.size()))
+        return false;
+    unsigned long long contentSz = 0;
+    for(size_t i=0; i<sizes.size(); i++)
+    {
+        if((sizes[i] < 0) || ((unsigned long long)sizes[i] > fileSz))
+            return false;
+        contentSz += sizes[i];
+    }
+    int n = m_meshFile->pMeshes->n;
+    for(int i=0; i< n; i++)
+    {
+        bk3d::Mesh *pMesh = m_meshFile->pMeshes->p[i];
+        int idx, ebo, proto, format;
+        GLuint64 offset;
+        if(!readCache(fp, &idx) || !readCache(fp, &ebo) || !readCache(fp, &proto) || !readCache(fp, &format)
+          || (idx < 0) || (idx >= numVBOs) || (ebo < 0) || (ebo >= numEBOs) || (proto < 0) || (proto >= n)
+          || (format < VTXQUANT_NONE) || (format > VTXQUANT_OCT8))
+            return false;
+        GLuint64 vboSz = (GLuint64)sizes[idx];
+        GLuint64 eboSz = (GLuint64)sizes[numVBOs + ebo];
+        pMesh->userPtr = (void*)(size_t)idx;
+        m_meshEBO.push_back(ebo);
+        // mesh which geometry it uses: see findInstances()
+        if((proto != i) && m_meshPrototype.empty())
+            for(int k=0; k< n; k++)
+                m_meshPrototype.push_back(k);
+        if(!m_meshPrototype.empty())
+            m_meshPrototype[i] = proto;
+        // VTXQUANT_* format and the box it is relative to: see quantizeVertices()
+        if(!readCache(fp, &pMesh->aabbox))
+            return false;
+        if(format != VTXQUANT_NONE)
+        {
+            setQuantizedFormat(pMesh, format);
+            m_quantizeMode = format;
+            m_quantizedMeshes.insert(pMesh);
+        }
+        for(int s=0; s<pMesh->pSlots->n; s++)
+        {
+            if(!readCache(fp, &offset) || (offset > vboSz))
+                return false;
+            pMesh->pSlots->p[s]->userData = 0;
+            pMesh->pSlots->p[s]->userPtr = (int*)(size_t)offset;
+        }
+        for(int pg=0; pg<pMesh->pPrimGroups->n; pg++)
+        {
+            bk3d::PrimGroup* pPG = pMesh->pPrimGroups->p[pg];
+            // {narrowed, topology, count, format, size, minIndex, maxIndex} : see processPrimGroups()
+            GLuint pgState[7];
+            if(!readCache(fp, &offset) || !readCache(fp, pgState, 7) || (offset + pgState[4] > eboSz))
+                return false;
+            pPG->userPtr = (void*)(size_t)offset;
+            pPG->topologyGL         = pgState[1];
+            pPG->indexCount         = pgState[2];
+            pPG->indexFormatGL      = pgState[3];
+            pPG->indexArrayByteSize = pgState[4];
+            pPG->minIndex           = pgState[5];
+            pPG->maxIndex           = pgState[6];
+            pPG->primRestartIndex   = 0;
+            if(pgState[0])
+                m_narrowedPGs.insert(pPG);
+        }
+        // see extractPositions()
+        PositionStream ps = { NULL, 0, 0, -1, 0 };
+        GLuint64 posSz;
+        if(!readCache(fp, &ps.offset) || !readCache(fp, &posSz) || !readCache(fp, &ps.strideBytes) || !readCache(fp, &ps.slot)
+          || (ps.slot < -1) || (ps.slot >= pMesh->pSlots->n) || (posSz > vboSz) || (ps.offset > vboSz - posSz))
+            return false;
+        ps.sizeBytes = (GLsizeiptr)posSz;
+        if(g_bDepthStream)
+            m_posStreams.push_back(ps);
+    }
+    // nothing more, nothing less than the content of the buffer objects
+    long pos = ftell(fp);
+    return (pos > 0) && ((unsigned long long)pos + contentSz == fileSz);
+}
+
+//------------------------------------------------------------------------------
+// what readCacheLayout() may have set before finding something wrong
+//------------------------------------------------------------------------------
+void Bk3dModel::clearCacheLayout()
+{
+    m_cacheSizes.clear();
+    m_meshEBO.clear();
+    m_meshPrototype.clear();
+    m_quantizedMeshes.clear();
+    m_narrowedPGs.clear();
+    m_posStreams.clear();
+}
+
+//------------------------------------------------------------------------------
+// GL thread: the layout is there already (see openCache). Only the content of
+// the buffer objects is left to read. Should it fail after all (the entry got
+// changed since), the entry is deleted and the model isn't uploaded
+//------------------------------------------------------------------------------
+bool Bk3dModel::initBuffersFromCache()
+{
+    std::vector<GLsizeiptr> sizes;
+    sizes.swap(m_cacheSizes);
+    int numVBOs = m_cacheNumVBOs;
+    bool ok = true;
+    //
+    // buffer objects: read straight into their storage
+    //
+    GLuint64 totalSz[2] = {0, 0};
+    for(int i=0; i<sizes.size(); i++)
+    {
+        BO bo;
+        memset(&bo, 0, sizeof(BO));
+        bo.Sz = sizes[i];
+        if(g_GeometryHeapMb <= 0)
+        {
+            glGenBuffers(1, &bo.Id);
+            glNamedBufferDataEXT(bo.Id, bo.Sz, NULL, GL_STATIC_DRAW);
+            if(bo.Sz > 0)
+            {
+                void* p = glMapNamedBufferRangeEXT(bo.Id, 0, bo.Sz, GL_MAP_WRITE_BIT|GL_MAP_INVALIDATE_BUFFER_BIT);
+                ok = ok && p && (fread(p, 1, bo.Sz, m_cacheFile) == (size_t)bo.Sz);
+                glUnmapNamedBufferEXT(bo.Id);
+            }
+            glGetNamedBufferParameterui64vNV(bo.Id, GL_BUFFER_GPU_ADDRESS_NV, &bo.Addr);
+            glMakeNamedBufferResidentNV(bo.Id, GL_READ_ONLY);
+        }
+        else
+        {
+            // a range of the heap: its buffer is resident and used by others already
+            allocateBO(bo);
+            std::vector<char> chunk(bo.Sz < 16*1024*1024 ? (size_t)bo.Sz : 16*1024*1024);
+            for(GLsizeiptr o=0; o<bo.Sz; o += chunk.size())
+            {
+                GLsizeiptr sz = bo.Sz - o < (GLsizeiptr)chunk.size() ? bo.Sz - o : (GLsizeiptr)chunk.size();
+                if(!ok || (fread(&chunk[0], 1, sz, m_cacheFile) != (size_t)sz))
+                {
+                    ok = false;
+                    break;
+                }
+                glNamedBufferSubDataEXT(bo.Id, bo.Offset + o, sz, &chunk[0]);
+            }
+        }
+        if(i < numVBOs)
+            m_ObjVBOs.push_back(bo);
+        else
+            m_ObjEBOs.push_back(bo);
+        totalSz[i < numVBOs ? 0 : 1] += bo.Sz;
+    }
+    fclose(m_cacheFile);
+    m_cacheFile = NULL;
+    if(!ok)
+    {
+        LOGE("%s: couldn't read %s. The entry is deleted\n", m_name.c_str(), m_cacheName.c_str());
+        remove(m_cacheName.c_str());
+        m_cacheName.clear();
+        return false;
+    }
+    // a hit: nothing to write back (see finishUpload)
+    m_cacheName.clear();
+    LOGI("meshes: %d in :%d VBOs (%f Mb) and %d EBOs (%f Mb) from the cache\n", m_meshFile->pMeshes->n, m_ObjVBOs.size(), (float)totalSz[0]/(float)(1024*1024), m_ObjEBOs.size(), (float)totalSz[1]/(float)(1024*1024));
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// the content of the buffer objects is read back from the GPU: whatever path
+// the upload took, the CPU may not have a copy of it anymore
+//------------------------------------------------------------------------------
+bool Bk3dModel::writeCache(bool bAutoScale)
+{
+    std::string tmpName = m_cacheName + std::string(".tmp");
+    FILE *fp = fopen(tmpName.c_str(), "wb");
+    if(!fp)
+    {
+        LOGW("couldn't write the cache file %s\n", m_cacheName.c_str());
+        return false;
+    }
+    CacheHeader ch;
+    memset(&ch, 0, sizeof(CacheHeader));
+    ch.magic        = CACHE_MAGIC;
+    ch.version      = CACHE_VERSION;
+    ch.sourceHash   = m_cacheHash;
+    ch.sourceSize   = m_cacheStamp[0];
+    ch.sourceTime   = m_cacheStamp[1];
+    ch.maxBOSz      = g_MaxBOSz;
+    ch.maxEBOSz     = g_MaxEBOSz;
+    ch.numMeshes    = m_meshFile->pMeshes->n;
+    ch.numVBOs      = (int)m_ObjVBOs.size();
+    ch.numEBOs      = (int)m_ObjEBOs.size();
+    ch.firstMesh    = g_firstMesh;
+    if(bAutoScale)
+    {
+        ch.posOffset[0] = m_posOffset[0]; ch.posOffset[1] = m_posOffset[1]; ch.posOffset[2] = m_posOffset[2];
+        ch.scale = m_scale;
+    }
+    fwrite(&ch, sizeof(CacheHeader), 1, fp);
+    std::vector<BO*> bos;
+    for(int i=0; i<m_ObjVBOs.size(); i++)
+        bos.push_back(&m_ObjVBOs[i]);
+    for(int i=0; i<m_ObjEBOs.size(); i++)
+        bos.push_back(&m_ObjEBOs[i]);
+    for(int i=0; i<bos.size(); i++)
+        fwrite(&bos[i]->Sz, sizeof(GLsizeiptr), 1, fp);
+    for(int i=0; i< m_meshFile->pMeshes->n; i++)
+    {
+        bk3d::Mesh *pMesh = m_meshFile->pMeshes->p[i];
+        int idx = (int)(size_t)pMesh->userPtr;
+        int proto = m_meshPrototype.empty() ? i : m_meshPrototype[i];
+        GLuint64 offset;
+        fwrite(&idx, sizeof(int), 1, fp);
+        fwrite(&m_meshEBO[i], sizeof(int), 1, fp);
+        fwrite(&proto, sizeof(int), 1, fp);
+        int format = vertexFormat(pMesh);
+        fwrite(&format, sizeof(int), 1, fp);
+        fwrite(&pMesh->aabbox, sizeof(bk3d::AABBox), 1, fp);
+        for(int s=0; s<pMesh->pSlots->n; s++)
+        {
+            offset = (GLuint64)(size_t)pMesh->pSlots->p[s]->userPtr.p;
+            fwrite(&offset, sizeof(GLuint64), 1, fp);
+        }
+        for(int pg=0; pg<pMesh->pPrimGroups->n; pg++)
+        {
+            bk3d::PrimGroup* pPG = pMesh->pPrimGroups->p[pg];
+            offset = (GLuint64)(size_t)pPG->userPtr;
+            fwrite(&offset, sizeof(GLuint64), 1, fp);
+            GLuint pgState[7] = { m_narrowedPGs.count(pPG) ? 1u : 0u, pPG->topologyGL, pPG->indexCount,
+                pPG->indexFormatGL, pPG->indexArrayByteSize, pPG->minIndex, pPG->maxIndex };
+            fwrite(pgState, sizeof(GLuint), 7, fp);
+        }
+        PositionStream ps = { NULL, 0, 0, -1, 0 };
+        if(!m_posStreams.empty())
+            ps = m_posStreams[i];
+        GLuint64 posSz = (GLuint64)ps.sizeBytes;
+        fwrite(&ps.offset, sizeof(GLuint64), 1, fp);
+        fwrite(&posSz, sizeof(GLuint64), 1, fp);
+        fwrite(&ps.strideBytes, sizeof(GLuint), 1, fp);
+        fwrite(&ps.slot, sizeof(int), 1, fp);
+    }
+    std::vector<char> chunk(16*1024*1024);
+    for(int i=0; i<bos.size(); i++)
+        for(GLsizeiptr o=0; o<bos[i]->Sz; o += chunk.size())
+        {
+            GLsizeiptr sz = bos[i]->Sz - o < (GLsizeiptr)chunk.size() ? bos[i]->Sz - o : (GLsizeiptr)chunk.size();
+            glGetNamedBufferSubDataEXT(bos[i]->Id, bos[i]->Offset + o, sz, &chunk[0]);
+            fwrite(&chunk[0], 1, sz, fp);
+        }
+    bool bOk = ferror(fp) == 0;
+    fclose(fp);
+    // the entry only shows-up when complete
+    if(!bOk || rename(tmpName.c_str(), m_cacheName.c_str()))
+    {
+        LOGW("couldn't write the cache file %s\n", m_cacheName.c_str());
+        remove(tmpName.c_str());
+        return false;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// topology a primitive group gets once converted to a list. GL_NONE: left as is
+//------------------------------------------------------------------------------
+static GLenum listTopology(GLenum topologyGL)
+{
+    switch(topologyGL)
+    {
+    case GL_TRIANGLES:
+    case GL_TRIANGLE_STRIP:
+    case GL_TRIANGLE_FAN:
+    case GL_QUADS:
+    case GL_QUAD_STRIP:
+        return GL_TRIANGLES;
+    case GL_LINES:
+    case GL_LINE_STRIP:
+    case GL_LINE_LOOP:
+        return GL_LINES;
+    }
+    // points too: GL_POINTS is 0, like GL_NONE
+    return GL_NONE;
+}
+
+//------------------------------------------------------------------------------
+// amount of list indices for count indices of a primitive group without restart
+//------------------------------------------------------------------------------
+static GLuint listIndexCount(GLenum topologyGL, GLuint count)
+{
+    switch(topologyGL)
+    {
+    case GL_TRIANGLES:      return (count / 3) * 3;
+    case GL_TRIANGLE_STRIP:
+    case GL_TRIANGLE_FAN:   return count > 2 ? (count - 2) * 3 : 0;
+    case GL_QUADS:          return (count / 4) * 6;
+    case GL_QUAD_STRIP:     return count > 3 ? ((count - 2) / 2) * 6 : 0;
+    case GL_LINES:          return (count / 2) * 2;
+    case GL_LINE_STRIP:     return count > 1 ? (count - 1) * 2 : 0;
+    case GL_LINE_LOOP:      return count > 1 ? count * 2 : 0;
+    }
+    return count;
+}
+
+//------------------------------------------------------------------------------
+// appends the indices of a source (see IndexRun) as a list. pData NULL: the
+// source isn't indexed (vertices 0 to count-1). Restart indices cut strips,
+// fans and loops
+//------------------------------------------------------------------------------
+static void appendListIndices(const Bk3dModel::IndexSource &src, const void* pData, std::vector<GLuint> &out)
+{
+    std::vector<GLuint> prim; // vertices since the last restart
+    for(GLuint i=0; i<=src.count; i++)
+    {
+        GLuint v = 0;
+        bool bRestart = i == src.count;
+        if(!bRestart)
+        {
+            v = !pData ? i : (src.format == GL_UNSIGNED_INT ? ((const GLuint*)pData)[i] : ((const GLushort*)pData)[i]);
+            bRestart = src.restart && (v == src.restart);
+        }
+        if(!bRestart)
+        {
+            prim.push_back(v);
+            continue;
+        }
+        size_t n = prim.size();
+        switch(src.topology)
+        {
+        case GL_TRIANGLE_STRIP:
+            for(size_t k=0; k+2<n; k++)
+            {
+                // odd triangles of a strip are flipped
+                GLuint tri[3] = { prim[k + (k & 1)], prim[k + 1 - (k & 1)], prim[k + 2] };
+                out.insert(out.end(), tri, tri + 3);
+            }
+            break;
+        case GL_TRIANGLE_FAN:
+            for(size_t k=1; k+1<n; k++)
+            {
+                GLuint tri[3] = { prim[0], prim[k], prim[k + 1] };
+                out.insert(out.end(), tri, tri + 3);
+            }
+            break;
+        case GL_QUADS:
+            for(size_t k=0; k+3<n; k+=4)
+            {
+                GLuint tri[6] = { prim[k], prim[k+1], prim[k+2], prim[k], prim[k+2], prim[k+3] };
+                out.insert(out.end(), tri, tri + 6);
+            }
+            break;
+        case GL_QUAD_STRIP:
+            for(size_t k=0; k+3<n; k+=2)
+            {
+                GLuint tri[6] = { prim[k], prim[k+1], prim[k+3], prim[k], prim[k+3], prim[k+2] };
+                out.insert(out.end(), tri, tri + 6);
+            }
+            break;
+        case GL_LINE_STRIP:
+        case GL_LINE_LOOP:
+            for(size_t k=0; k+1<n; k++)
+            {
+                GLuint line[2] = { prim[k], prim[k + 1] };
+                out.insert(out.end(), line, line + 2);
+            }
+            if((src.topology == GL_LINE_LOOP) && (n > 1))
+            {
+                GLuint line[2] = { prim[n - 1], prim[0] };
+                out.insert(out.end(), line, line + 2);
+            }
+            break;
+        case GL_TRIANGLES:
+            out.insert(out.end(), prim.begin(), prim.begin() + (n / 3) * 3);
+            break;
+        case GL_LINES:
+            out.insert(out.end(), prim.begin(), prim.begin() + (n / 2) * 2);
+            break;
+        default:
+            out.insert(out.end(), prim.begin(), prim.end());
+            break;
+        }
+        prim.clear();
+    }
+}
+
+//------------------------------------------------------------------------------
+// writes the list indices of a run in the format chosen for its primitive group
+//------------------------------------------------------------------------------
+static void storeIndices(const std::vector<GLuint> &indices, const bk3d::PrimGroup* pPG, GLuint base, void* pDst)
+{
+    if(pPG->indexFormatGL == GL_UNSIGNED_SHORT)
+        for(size_t i=0; i<indices.size(); i++)
+            ((GLushort*)pDst)[i] = (GLushort)(indices[i] - base);
+    else
+        memcpy(pDst, &indices[0], indices.size() * sizeof(GLuint));
+}
+
+//------------------------------------------------------------------------------
+// a group without material keeps the one of the previous group: make it explicit
+//------------------------------------------------------------------------------
+static void explicitMaterials(bk3d::FileHeader* pFile)
+{
+    bk3d::Material* pCurMat = NULL;
+    for(int i=0; i< pFile->pMeshes->n; i++)
+    {
+        bk3d::Mesh *pMesh = pFile->pMeshes->p[i];
+        for(int pg=0; pg<pMesh->pPrimGroups->n; pg++)
+        {
+            bk3d::PrimGroup* pPG = pMesh->pPrimGroups->p[pg];
+            if(pPG->pMaterial)
+                pCurMat = pPG->pMaterial;
+            else
+                pPG->pMaterial = pCurMat;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+// Processing of the primitive groups of each mesh, before any layout is made:
+// - strips, fans, loops and quads become lists (g_bMergePrimGroups)
+// - groups of a mesh with the same material and list topology are merged into
+//   the first of them: one index range, one draw. The others get indexCount 0
+//   (meshes where primitive groups have their own transforms are left alone)
+// - 32 bits indices which range fits in 16 bits get rebased against minIndex
+//   and narrowed (g_bCompactIndices): the draw uses minIndex as base vertex
+// Index data in memory is rebuilt right away in m_indexData. When it is still
+// in the file (see streamBufferArea), only sizes are set here, from the file's
+// minIndex/maxIndex: m_indexRuns tells how to build the data on its way to the
+// EBO. Groups sharing their index buffer with others are left as they are.
+// No OpenGL: runs on the loader thread
+//------------------------------------------------------------------------------
+void Bk3dModel::processPrimGroups()
+{
+    std::set<const bk3d::PrimGroup*> sharedIBs;
+    for(int i=0; i< m_meshFile->pMeshes->n; i++)
+    {
+        bk3d::Mesh *pMesh = m_meshFile->pMeshes->p[i];
+        for(int pg=0; pg<pMesh->pPrimGroups->n; pg++)
+        {
+            bk3d::PrimGroup* pPG = pMesh->pPrimGroups->p[pg];
+            if(pPG->pOwnerOfIB && (pPG->pOwnerOfIB != pPG))
+            {
+                sharedIBs.insert(pPG);
+                sharedIBs.insert(pPG->pOwnerOfIB);
+            }
+        }
+    }
+    // materials made explicit before merging compares them
+    if(g_bMergePrimGroups)
+        explicitMaterials(m_meshFile);
+    int numDraws[2] = { 0, 0 }; // before, after
+    int numNarrowed = 0;
+    for(int i=0; i< m_meshFile->pMeshes->n; i++)
+    {
+        bk3d::Mesh *pMesh = m_meshFile->pMeshes->p[i];
+        bool bPGTransforms = false;
+        for(int pg=0; pg<pMesh->pPrimGroups->n; pg++)
+            if(pMesh->pPrimGroups->p[pg]->pTransforms && (pMesh->pPrimGroups->p[pg]->pTransforms->n > 0))
+                bPGTransforms = true;
+        //
+        // gather the runs: the first group of each is where the merged draw happens
+        //
+        std::vector<bk3d::PrimGroup*> leaders;
+        std::vector<IndexRun> runs;
+        for(int pg=0; pg<pMesh->pPrimGroups->n; pg++)
+        {
+            bk3d::PrimGroup* pPG = pMesh->pPrimGroups->p[pg];
+            numDraws[0]++;
+            GLenum topo = listTopology(pPG->topologyGL);
+            bool bIndexed = pPG->indexArrayByteSize > 0;
+            if((topo == GL_NONE) || (pPG->indexCount == 0) || sharedIBs.count(pPG)
+              || (bIndexed && (pPG->indexFormatGL != GL_UNSIGNED_INT) && (pPG->indexFormatGL != GL_UNSIGNED_SHORT))
+              || (bIndexed && (pPG->indexArrayByteSize != pPG->indexCount * (pPG->indexFormatGL == GL_UNSIGNED_INT ? 4 : 2)))
+              // sizes can't be known ahead with restart in data still in the file
+              || (m_streamFile && pPG->primRestartIndex))
+            {
+                numDraws[1]++;
+                continue;
+            }
+            IndexSource src = { bIndexed ? (const void*)pPG->pIndexBufferData : NULL, pPG->indexCount,
+                pPG->indexFormatGL, pPG->topologyGL, pPG->primRestartIndex, pPG->minIndex, pPG->maxIndex };
+            if(!bIndexed)
+            {
+                src.minIndex = 0;
+                src.maxIndex = pPG->indexCount - 1;
+            }
+            size_t r = 0;
+            if(g_bMergePrimGroups && !bPGTransforms)
+                for(; r<leaders.size(); r++)
+                    if((listTopology(leaders[r]->topologyGL) == topo) && (leaders[r]->pMaterial == pPG->pMaterial))
+                        break;
+            if(g_bMergePrimGroups && !bPGTransforms && (r < leaders.size()))
+            {
+                runs[r].sources.push_back(src);
+                pPG->indexCount = 0;
+                pPG->indexArrayByteSize = 0;
+                continue;
+            }
+            leaders.push_back(pPG);
+            runs.push_back(IndexRun());
+            runs.back().sources.push_back(src);
+            numDraws[1]++;
+        }
+        //
+        // new index data of the runs that need it
+        //
+        for(size_t r=0; r<runs.size(); r++)
+        {
+            bk3d::PrimGroup* pPG = leaders[r];
+            IndexRun &run = runs[r];
+            const IndexSource &first = run.sources[0];
+            GLenum topo = listTopology(first.topology);
+            bool bConvert = g_bMergePrimGroups && ((run.sources.size() > 1) || (topo != first.topology));
+            // range: the real one when data is in memory
+            std::vector<GLuint> indices;
+            GLuint count = 0, minIndex = 0xFFFFFFFF, maxIndex = 0;
+            for(size_t s=0; s<run.sources.size(); s++)
+            {
+                const IndexSource &src = run.sources[s];
+                if(m_streamFile && src.pData)
+                {
+                    count += listIndexCount(src.topology, src.count);
+                    minIndex = std::min(minIndex, src.minIndex);
+                    maxIndex = std::max(maxIndex, src.maxIndex);
+                }
+                else
+                    appendListIndices(src, src.pData, indices);
+            }
+            for(size_t n=0; n<indices.size(); n++)
+            {
+                minIndex = std::min(minIndex, indices[n]);
+                maxIndex = std::max(maxIndex, indices[n]);
+            }
+            count += (GLuint)indices.size();
+            // 0xFFFF stays free for primitive restart
+            bool bNarrow = g_bCompactIndices && (count > 0) && (maxIndex - minIndex < 0xFFFF)
+                && ((first.format == GL_UNSIGNED_INT) || bConvert);
+            if(!bConvert && !bNarrow)
+                continue;
+            // the group now draws the whole run
+            pPG->topologyGL = bConvert ? topo : first.topology;
+            pPG->indexCount = count;
+            pPG->indexFormatGL = bNarrow || (maxIndex < 0xFFFF) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+            pPG->indexArrayByteSize = count * (pPG->indexFormatGL == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint));
+            pPG->minIndex = minIndex;
+            pPG->maxIndex = maxIndex;
+            pPG->primRestartIndex = 0;
+            pPG->indexArrayByteOffset = 0;
+            if(bNarrow)
+            {
+                m_narrowedPGs.insert(pPG);
+                numNarrowed++;
+            }
+            if(count == 0)
+                pPG->indexArrayByteSize = 0;
+            else if(m_streamFile)
+                m_indexRuns[pPG] = run;
+            else
+            {
+                m_indexData.push_back(std::vector<char>(pPG->indexArrayByteSize));
+                storeIndices(indices, pPG, bNarrow ? minIndex : 0, &m_indexData.back()[0]);
+                pPG->pIndexBufferData = &m_indexData.back()[0];
+            }
+        }
+    }
+    LOGI("%s: %d draws out of %d primitive groups, %d with 16 bits indices rebased\n", m_name.c_str(), numDraws[1], numDraws[0], numNarrowed);
+}
+
+//------------------------------------------------------------------------------
+// a transform that never changes: no curve nor IK handle on it or its parents
+//------------------------------------------------------------------------------
+static bool staticTransform(bk3d::Bone* pBone)
+{
+    for(; pBone; pBone = pBone->getParent())
+        if((pBone->pFloatArrays && (pBone->pFloatArrays->n > 0)) || (pBone->pIKHandles && (pBone->pIKHandles->n > 0)))
+            return false;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// meshes flattenStatic() can deal with: static transform, no skinning nor blend
+// shapes, float3 positions (and normals), slots holding exactly their vertices
+// and primitive groups that can become lists
+//------------------------------------------------------------------------------
+static bool flattenable(const bk3d::Mesh* pMesh)
+{
+    if((pMesh->pBSSlots && (pMesh->pBSSlots->n > 0)) || (pMesh->numJointInfluence > 0)
+      || (pMesh->pTransforms && ((pMesh->pTransforms->n > 1) || ((pMesh->pTransforms->n == 1) && !staticTransform(pMesh->pTransforms->p[0])))))
+        return false;
+    int n = pMesh->pAttributes->n;
+    if((n < 1) || (pMesh->pSlots->n < 1))
+        return false;
+    for(int a=0; a<n && a<2; a++)
+        if((pMesh->pAttributes->p[a]->formatGL != GL_FLOAT) || (pMesh->pAttributes->p[a]->numComp < 3))
+            return false;
+    GLuint count = pMesh->pSlots->p[0]->vertexCount;
+    for(int s=0; s<pMesh->pSlots->n; s++)
+    {
+        const bk3d::Slot* pS = pMesh->pSlots->p[s];
+        if((pS->vertexCount != count) || (count == 0) || !pS->pVtxBufferData || (pS->vtxBufferSizeBytes != count * pS->vtxBufferStrideBytes))
+            return false;
+    }
+    bool bDraws = false;
+    for(int pg=0; pg<pMesh->pPrimGroups->n; pg++)
+    {
+        const bk3d::PrimGroup* pPG = pMesh->pPrimGroups->p[pg];
+        if(pPG->pTransforms && (pPG->pTransforms->n > 0))
+            return false;
+        if(pPG->indexCount == 0)
+            continue;
+        if((listTopology(pPG->topologyGL) == GL_NONE)
+          || ((pPG->indexArrayByteSize > 0) && (pPG->indexFormatGL != GL_UNSIGNED_INT) && (pPG->indexFormatGL != GL_UNSIGNED_SHORT)))
+            return false;
+        bDraws = true;
+    }
+    return bDraws;
+}
+
+//------------------------------------------------------------------------------
+// Static scene flattening (-F): the vertices of the meshes which transform never
+// changes get transformed to the model space, with the matrix their UBO entry
+// would hold. Meshes of the same vertex layout get merged in the first of them:
+// its slots hold the vertices of all, and it gets a new table of primitive
+// groups: one list per material and topology, indices rebased against where the
+// vertices of each mesh went. The other meshes are left with nothing to draw.
+// The first mesh draws with an identity matrix (see initMeshTransforms).
+// A merge stops at the size of a VBO (-v). Needs the data in memory.
+// No OpenGL: runs on the loader thread
+//------------------------------------------------------------------------------
+void Bk3dModel::flattenStatic()
+{
+    explicitMaterials(m_meshFile);
+    //
+    // meshes by vertex layout
+    //
+    struct FlatGroup {
+        std::vector<GLuint64>   layout;
+        std::vector<int>        meshes;
+        GLuint                  numVertices;
+        GLsizeiptr              vertexBytes;
+    };
+    std::vector<FlatGroup> groups;
+    GLsizeiptr maxBytes = (GLsizeiptr)g_MaxBOSz * 1024*1024;
+    std::vector<GLuint64> layout;
+    int numDrawsBefore = 0, numDrawsAfter = 0, numMeshes = 0;
+    for(int i=g_firstMesh; i< m_meshFile->pMeshes->n; i++)
+    {
+        bk3d::Mesh *pMesh = m_meshFile->pMeshes->p[i];
+        if(!flattenable(pMesh))
+            continue;
+        layout.clear();
+        GLsizeiptr bytes = 0;
+        for(int s=0; s<pMesh->pSlots->n; s++)
+        {
+            layout.push_back(pMesh->pSlots->p[s]->vtxBufferStrideBytes);
+            bytes += pMesh->pSlots->p[s]->vtxBufferSizeBytes;
+        }
+        for(int a=0; a<pMesh->pAttributes->n; a++)
+        {
+            const bk3d::Attribute* pA = pMesh->pAttributes->p[a];
+            GLuint64 attr[5] = { pA->formatGL, pA->numComp, pA->strideBytes, pA->dataOffsetBytes, pA->slot };
+            layout.insert(layout.end(), attr, attr + 5);
+        }
+        GLuint count = pMesh->pSlots->p[0]->vertexCount;
+        // the last group of this layout, unless it would get too big
+        int g = (int)groups.size() - 1;
+        for(; g >= 0; g--)
+            if(groups[g].layout == layout)
+                break;
+        if((g < 0) || (groups[g].vertexBytes + bytes > maxBytes) || (groups[g].numVertices + (GLuint64)count >= 0xFFFFFFFF))
+        {
+            g = (int)groups.size();
+            groups.push_back(FlatGroup());
+            groups[g].layout = layout;
+            groups[g].numVertices = 0;
+            groups[g].vertexBytes = 0;
+        }
+        groups[g].meshes.push_back(i);
+        groups[g].numVertices += count;
+        groups[g].vertexBytes += bytes;
+        numMeshes++;
+    }
+    //
+    // merge each group in its first mesh
+    //
+    for(size_t g=0; g<groups.size(); g++)
+    {
+        FlatGroup &group = groups[g];
+        bk3d::Mesh *pHost = m_meshFile->pMeshes->p[group.meshes[0]];
+        int numSlots = pHost->pSlots->n;
+        std::vector<char*> slotData(numSlots);
+        for(int s=0; s<numSlots; s++)
+        {
+            m_vertexData.push_back(std::vector<char>(group.numVertices * pHost->pSlots->p[s]->vtxBufferStrideBytes));
+            slotData[s] = &m_vertexData.back()[0];
+        }
+        const bk3d::Attribute* pP = pHost->pAttributes->p[0];
+        const bk3d::Attribute* pN = pHost->pAttributes->n > 1 ? (const bk3d::Attribute*)pHost->pAttributes->p[1] : NULL;
+        // lists of each material and topology, in the order they show-up
+        std::vector<bk3d::PrimGroup*> templates;
+        std::vector< std::vector<GLuint> > lists;
+        float boxMin[3] = { FLT_MAX, FLT_MAX, FLT_MAX }, boxMax[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+        GLuint base = 0;
+        for(size_t k=0; k<group.meshes.size(); k++)
+        {
+            bk3d::Mesh *pMesh = m_meshFile->pMeshes->p[group.meshes[k]];
+            GLuint count = pMesh->pSlots->p[0]->vertexCount;
+            mat4f m(array16_id);
+            if(pMesh->pTransforms && (pMesh->pTransforms->n > 0) && m_meshFile->pTransforms)
+                memcpy(m.mat_array, m_meshFile->pTransforms->pBones[pMesh->pTransforms->p[0]->ID]->Matrix().m, sizeof(mat4f));
+            // normals: cofactors of the 3x3 part, the inverse-transpose up to the determinant
+            const float* c0 = m.mat_array; const float* c1 = m.mat_array + 4; const float* c2 = m.mat_array + 8;
+            float cof[3][3] = {
+                { c1[1]*c2[2] - c1[2]*c2[1], c1[2]*c2[0] - c1[0]*c2[2], c1[0]*c2[1] - c1[1]*c2[0] },
+                { c2[1]*c0[2] - c2[2]*c0[1], c2[2]*c0[0] - c2[0]*c0[2], c2[0]*c0[1] - c2[1]*c0[0] },
+                { c0[1]*c1[2] - c0[2]*c1[1], c0[2]*c1[0] - c0[0]*c1[2], c0[0]*c1[1] - c0[1]*c1[0] } };
+            float det = c0[0]*cof[0][0] + c0[1]*cof[0][1] + c0[2]*cof[0][2];
+            bool bMirrored = det < 0.0f;
+            //
+            // vertices
+            //
+            for(int s=0; s<numSlots; s++)
+            {
+                bk3d::Slot* pS = pMesh->pSlots->p[s];
+                memcpy(slotData[s] + base * pS->vtxBufferStrideBytes, (const char*)pS->pVtxBufferData, pS->vtxBufferSizeBytes);
+            }
+            char* pDstP = slotData[pP->slot] + base * pHost->pSlots->p[pP->slot]->vtxBufferStrideBytes + pP->dataOffsetBytes;
+            char* pDstN = pN ? slotData[pN->slot] + base * pHost->pSlots->p[pN->slot]->vtxBufferStrideBytes + pN->dataOffsetBytes : NULL;
+            for(GLuint v=0; v<count; v++)
+            {
+                float* p = (float*)(pDstP + v * pP->strideBytes);
+                float t[3];
+                for(int c=0; c<3; c++)
+                {
+                    t[c] = c0[c]*p[0] + c1[c]*p[1] + c2[c]*p[2] + m.mat_array[12 + c];
+                    boxMin[c] = std::min(boxMin[c], t[c]);
+                    boxMax[c] = std::max(boxMax[c], t[c]);
+                }
+                memcpy(p, t, sizeof(t));
+                if(!pN)
+                    continue;
+                float* nrm = (float*)(pDstN + v * pN->strideBytes);
+                for(int c=0; c<3; c++)
+                    t[c] = cof[0][c]*nrm[0] + cof[1][c]*nrm[1] + cof[2][c]*nrm[2];
+                float len = sqrtf(t[0]*t[0] + t[1]*t[1] + t[2]*t[2]);
+                if(bMirrored)
+                    len = -len;
+                if(len != 0.0f)
+                    for(int c=0; c<3; c++)
+                        nrm[c] = t[c] / len;
+            }
+            //
+            // indices: as lists, rebased
+            //
+            for(int pg=0; pg<pMesh->pPrimGroups->n; pg++)
+            {
+                bk3d::PrimGroup* pPG = pMesh->pPrimGroups->p[pg];
+                if(pPG->indexCount == 0)
+                    continue;
+                numDrawsBefore++;
+                GLenum topo = listTopology(pPG->topologyGL);
+                size_t l = 0;
+                for(; l<templates.size(); l++)
+                    if((templates[l]->topologyGL == topo) && (templates[l]->pMaterial == pPG->pMaterial))
+                        break;
+                if(l == templates.size())
+                {
+                    m_flatPrimGroups.push_back(*pPG);
+                    templates.push_back(&m_flatPrimGroups.back());
+                    templates.back()->topologyGL = topo;
+                    lists.push_back(std::vector<GLuint>());
+                }
+                bool bIndexed = pPG->indexArrayByteSize > 0;
+                IndexSource src = { bIndexed ? (const void*)pPG->pIndexBufferData : NULL, pPG->indexCount,
+                    pPG->indexFormatGL, pPG->topologyGL, pPG->primRestartIndex, pPG->minIndex, pPG->maxIndex };
+                std::vector<GLuint> &list = lists[l];
+                size_t first = list.size();
+                appendListIndices(src, src.pData, list);
+                GLuint offset = base + (bIndexed ? baseVertex(pPG) : 0);
+                for(size_t n=first; n<list.size(); n++)
+                    list[n] += offset;
+                // a mirroring transform turns the triangles around
+                if(bMirrored && (topo == GL_TRIANGLES))
+                    for(size_t n=first; n+2<list.size(); n+=3)
+                        std::swap(list[n+1], list[n+2]);
+                pPG->indexCount = 0;
+                pPG->indexArrayByteSize = 0;
+            }
+            // nothing left in the other meshes
+            if(k > 0)
+                for(int s=0; s<numSlots; s++)
+                {
+                    pMesh->pSlots->p[s]->vertexCount = 0;
+                    pMesh->pSlots->p[s]->vtxBufferSizeBytes = 0;
+                }
+            base += count;
+        }
+        //
+        // the first mesh now holds everything
+        //
+        for(int s=0; s<numSlots; s++)
+        {
+            bk3d::Slot* pS = pHost->pSlots->p[s];
+            pS->vertexCount = group.numVertices;
+            pS->vtxBufferSizeBytes = group.numVertices * pS->vtxBufferStrideBytes;
+            pS->pVtxBufferData = slotData[s];
+        }
+        for(int a=0; a<pHost->pAttributes->n; a++)
+        {
+            bk3d::Attribute* pA = pHost->pAttributes->p[a];
+            pA->pAttributeBufferData = slotData[pA->slot] + pA->dataOffsetBytes;
+        }
+        pHost->aabbox.min.x = boxMin[0]; pHost->aabbox.min.y = boxMin[1]; pHost->aabbox.min.z = boxMin[2];
+        pHost->aabbox.max.x = boxMax[0]; pHost->aabbox.max.y = boxMax[1]; pHost->aabbox.max.z = boxMax[2];
+        m_flatPools.push_back(std::vector<char>(sizeof(bk3d::PrimGroupPool) + templates.size() * sizeof(bk3d::Ptr64<bk3d::PrimGroup>)));
+        bk3d::PrimGroupPool* pPool = (bk3d::PrimGroupPool*)&m_flatPools.back()[0];
+        pPool->n = (int)templates.size();
+        for(size_t l=0; l<templates.size(); l++)
+        {
+            bk3d::PrimGroup* pPG = templates[l];
+            const std::vector<GLuint> &list = lists[l];
+            pPG->indexCount = (GLuint)list.size();
+            pPG->indexFormatGL = group.numVertices <= 0xFFFF ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+            pPG->indexArrayByteSize = pPG->indexCount * (pPG->indexFormatGL == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint));
+            pPG->indexArrayByteOffset = 0;
+            pPG->minIndex = list.empty() ? 0 : *std::min_element(list.begin(), list.end());
+            pPG->maxIndex = list.empty() ? 0 : *std::max_element(list.begin(), list.end());
+            pPG->primRestartIndex = 0;
+            pPG->pOwnerOfIB = pPG;
+            pPG->userPtr = NULL;
+            if(list.empty())
+                pPG->indexArrayByteSize = 0;
+            else
+            {
+                m_indexData.push_back(std::vector<char>(pPG->indexArrayByteSize));
+                storeIndices(list, pPG, 0, &m_indexData.back()[0]);
+                pPG->pIndexBufferData = &m_indexData.back()[0];
+            }
+            pPool->p[l] = pPG;
+            numDrawsAfter++;
+        }
+        pHost->pPrimGroups = pPool;
+        m_flatMeshes.insert(pHost);
+    }
+    LOGI("%s: %d static meshes flattened into %d, %d draws instead of %d\n", m_name.c_str(), numMeshes, (int)groups.size(), numDrawsAfter, numDrawsBefore);
+}
+
+//------------------------------------------------------------------------------
+// float3 positions (and normals) in slots of their own, no transforms in the
+// primitive groups: these are the meshes quantizeVertices() can deal with
+//------------------------------------------------------------------------------
+static bool quantizable(const bk3d::Mesh* pMesh)
+{
+    int n = pMesh->pAttributes->n;
+    if((n < 1) || (pMesh->pTransforms && (pMesh->pTransforms->n > 1)))
+        return false;
+    const bk3d::Attribute* pP = pMesh->pAttributes->p[0];
+    const bk3d::Attribute* pN = n > 1 ? (const bk3d::Attribute*)pMesh->pAttributes->p[1] : NULL;
+    const bk3d::Slot* pS = pMesh->pSlots->p[pP->slot];
+    if((pP->formatGL != GL_FLOAT) || (pP->numComp != 3) || (pS->vertexCount == 0) || !pS->pVtxBufferData
+      || (pS->vtxBufferSizeBytes < (pS->vertexCount-1) * pP->strideBytes + pP->dataOffsetBytes + 3*sizeof(float)))
+        return false;
+    if(pN)
+    {
+        const bk3d::Slot* pSN = pMesh->pSlots->p[pN->slot];
+        if((pN->formatGL != GL_FLOAT) || (pN->numComp != 3) || (pSN->vertexCount != pS->vertexCount) || !pSN->pVtxBufferData
+          || (pSN->vtxBufferSizeBytes < (pSN->vertexCount-1) * pN->strideBytes + pN->dataOffsetBytes + 3*sizeof(float)))
+            return false;
+    }
+    // the slots get rebuilt: nothing else in them
+    for(int a=2; a<n; a++)
+        if((pMesh->pAttributes->p[a]->slot == pP->slot) || (pN && (pMesh->pAttributes->p[a]->slot == pN->slot)))
+            return false;
+    for(int pg=0; pg<pMesh->pPrimGroups->n; pg++)
+        if(pMesh->pPrimGroups->p[pg]->pTransforms && (pMesh->pPrimGroups->p[pg]->pTransforms->n > 0))
+            return false;
+    return true;
+}
+
+static float signNotZero(float v) { return v >= 0.0f ? 1.0f : -1.0f; }
+
+//------------------------------------------------------------------------------
+// Compact vertex format (-Q, see VTXQUANT_*): positions become 16 bits in the
+// bounding box of the mesh (refreshed from the positions), normals get
+// octahedral-encoded in 2 snorm16 or 2 snorm8. The object matrix maps the box
+// back (see initMeshTransforms) and the vertex program decodes normals.
+// Other meshes are left as they are (see quantizable). The worst errors of the
+// model get reported. Needs the data in memory: not when streamed from the file.
+// No OpenGL: runs on the loader thread
+//------------------------------------------------------------------------------
+void Bk3dModel::quantizeVertices()
+{
+    m_quantizeMode = g_QuantizeVertices;
+    GLuint stride = m_quantizeMode == VTXQUANT_OCT8 ? 8 : 12;
+    float normalScale = m_quantizeMode == VTXQUANT_OCT8 ? 127.0f : 32767.0f;
+    size_t bytesBefore = 0, bytesAfter = 0;
+    float maxPosError = 0.0f;   // relative to the size of the mesh
+    float maxNormalError = 0.0f;// in degrees
+    for(int i=0; i< m_meshFile->pMeshes->n; i++)
+    {
+        bk3d::Mesh *pMesh = m_meshFile->pMeshes->p[i];
+        if(!quantizable(pMesh))
+            continue;
+        bk3d::Attribute* pP = pMesh->pAttributes->p[0];
+        bk3d::Attribute* pN = pMesh->pAttributes->n > 1 ? (bk3d::Attribute*)pMesh->pAttributes->p[1] : NULL;
+        bk3d::Slot* pS = pMesh->pSlots->p[pP->slot];
+        GLuint count = pS->vertexCount;
+        const char* pSrcP = (const char*)pS->pVtxBufferData + pP->dataOffsetBytes;
+        const char* pSrcN = pN ? (const char*)pMesh->pSlots->p[pN->slot]->pVtxBufferData + pN->dataOffsetBytes : NULL;
+        bytesBefore += pS->vtxBufferSizeBytes;
+        if(pN && (pN->slot != pP->slot))
+            bytesBefore += pMesh->pSlots->p[pN->slot]->vtxBufferSizeBytes;
+        //
+        // box of the positions
+        //
+        float boxMin[3] = { FLT_MAX, FLT_MAX, FLT_MAX }, boxMax[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+        for(GLuint v=0; v<count; v++)
+        {
+            const float* p = (const float*)(pSrcP + v * pP->strideBytes);
+            for(int c=0; c<3; c++)
+            {
+                boxMin[c] = std::min(boxMin[c], p[c]);
+                boxMax[c] = std::max(boxMax[c], p[c]);
+            }
+        }
+        pMesh->aabbox.min.x = boxMin[0]; pMesh->aabbox.min.y = boxMin[1]; pMesh->aabbox.min.z = boxMin[2];
+        pMesh->aabbox.max.x = boxMax[0]; pMesh->aabbox.max.y = boxMax[1]; pMesh->aabbox.max.z = boxMax[2];
+        float size = std::max(boxMax[0] - boxMin[0], std::max(boxMax[1] - boxMin[1], boxMax[2] - boxMin[2]));
+        //
+        // encode
+        //
+        m_vertexData.push_back(std::vector<char>(count * stride, 0));
+        char* pDst = &m_vertexData.back()[0];
+        for(GLuint v=0; v<count; v++)
+        {
+            const float* p = (const float*)(pSrcP + v * pP->strideBytes);
+            GLushort* q = (GLushort*)(pDst + v * stride);
+            for(int c=0; c<3; c++)
+            {
+                float extent = boxMax[c] - boxMin[c];
+                float t = extent > 0.0f ? (p[c] - boxMin[c]) / extent : 0.0f;
+                q[c] = (GLushort)(std::min(std::max(t, 0.0f), 1.0f) * 65535.0f + 0.5f);
+                if(size > 0.0f)
+                    maxPosError = std::max(maxPosError, fabsf(boxMin[c] + (q[c] / 65535.0f) * extent - p[c]) / size);
+            }
+            if(!pN)
+                continue;
+            const float* nrm = (const float*)(pSrcN + v * pN->strideBytes);
+            float len = sqrtf(nrm[0]*nrm[0] + nrm[1]*nrm[1] + nrm[2]*nrm[2]);
+            float n[3] = { 0.0f, 0.0f, 1.0f };
+            if(len > 0.0f)
+                for(int c=0; c<3; c++)
+                    n[c] = nrm[c] / len;
+            float l1 = fabsf(n[0]) + fabsf(n[1]) + fabsf(n[2]);
+            float o[2] = { n[0] / l1, n[1] / l1 };
+            if(n[2] < 0.0f)
+            {
+                float ox = o[0];
+                o[0] = (1.0f - fabsf(o[1])) * signNotZero(ox);
+                o[1] = (1.0f - fabsf(ox)) * signNotZero(o[1]);
+            }
+            // decoded as the vertex program would, for the error
+            float d[2];
+            if(m_quantizeMode == VTXQUANT_OCT8)
+            {
+                signed char* e = (signed char*)(pDst + v * stride + 6);
+                for(int c=0; c<2; c++)
+                {
+                    e[c] = (signed char)floorf(o[c] * normalScale + 0.5f);
+                    d[c] = std::max(e[c] / normalScale, -1.0f);
+                }
+            } else {
+                GLshort* e = (GLshort*)(pDst + v * stride + 8);
+                for(int c=0; c<2; c++)
+                {
+                    e[c] = (GLshort)floorf(o[c] * normalScale + 0.5f);
+                    d[c] = std::max(e[c] / normalScale, -1.0f);
+                }
+            }
+            float dn[3] = { d[0], d[1], 1.0f - fabsf(d[0]) - fabsf(d[1]) };
+            if(dn[2] < 0.0f)
+            {
+                float dx = dn[0];
+                dn[0] = (1.0f - fabsf(dn[1])) * signNotZero(dx);
+                dn[1] = (1.0f - fabsf(dx)) * signNotZero(dn[1]);
+            }
+            float dlen = sqrtf(dn[0]*dn[0] + dn[1]*dn[1] + dn[2]*dn[2]);
+            float cosine = (n[0]*dn[0] + n[1]*dn[1] + n[2]*dn[2]) / dlen;
+            maxNormalError = std::max(maxNormalError, acosf(std::min(std::max(cosine, -1.0f), 1.0f)) / nv_to_rad);
+        }
+        setQuantizedFormat(pMesh, m_quantizeMode);
+        pS->pVtxBufferData = pDst;
+        pP->pAttributeBufferData = pDst;
+        if(pN)
+            pN->pAttributeBufferData = pDst + pN->dataOffsetBytes;
+        bytesAfter += pS->vtxBufferSizeBytes;
+        m_quantizedMeshes.insert(pMesh);
+    }
+    LOGI("%s: %d meshes quantized, %.2f Mb of vertices instead of %.2f Mb. Max errors: position %.5f%% of the mesh size, normal %.3f degrees\n",
+        m_name.c_str(), (int)m_quantizedMeshes.size(), (float)bytesAfter/(1024.0f*1024.0f), (float)bytesBefore/(1024.0f*1024.0f),
+        maxPosError * 100.0f, maxNormalError);
+}
+
+//------------------------------------------------------------------------------
+// everything a draw of the mesh depends on, but its transform. Data is compared
+// only when this matches (see findInstances)
+//------------------------------------------------------------------------------
+static void geometryKey(const bk3d::Mesh* pMesh, const std::set<const bk3d::PrimGroup*> &narrowedPGs, bool bQuantized, std::vector<GLuint64> &key)
+{
+    key.clear();
+    if(bQuantized)
+    {
+        // same data can mean another box (see quantizeVertices)
+        GLuint box[6];
+        memcpy(box, &pMesh->aabbox.min.x, 3*sizeof(float));
+        memcpy(box + 3, &pMesh->aabbox.max.x, 3*sizeof(float));
+        key.insert(key.end(), box, box + 6);
+    }
+    key.push_back(pMesh->pSlots->n);
+    key.push_back(pMesh->pAttributes->n);
+    key.push_back(pMesh->pPrimGroups->n);
+    for(int s=0; s<pMesh->pSlots->n; s++)
+        key.push_back(pMesh->pSlots->p[s]->vtxBufferSizeBytes);
+    for(int a=0; a<pMesh->pAttributes->n; a++)
+    {
+        const bk3d::Attribute* pA = pMesh->pAttributes->p[a];
+        key.push_back(pA->formatGL);
+        key.push_back(pA->numComp);
+        key.push_back(pA->strideBytes);
+        key.push_back(pA->dataOffsetBytes);
+        key.push_back(pA->slot);
+    }
+    for(int pg=0; pg<pMesh->pPrimGroups->n; pg++)
+    {
+        const bk3d::PrimGroup* pPG = pMesh->pPrimGroups->p[pg];
+        key.push_back(pPG->topologyGL);
+        key.push_back(pPG->indexCount);
+        key.push_back(pPG->indexFormatGL);
+        key.push_back(pPG->indexArrayByteSize);
+        key.push_back(pPG->minIndex);
+        key.push_back(pPG->primRestartIndex);
+        key.push_back((GLuint64)(size_t)(const bk3d::Material*)pPG->pMaterial);
+        key.push_back(narrowedPGs.count(pPG));
+    }
+}
+
+static unsigned long long hashBytes(unsigned long long h, const void* p, size_t sz)
+{
+    for(size_t i=0; i<sz; i++)
+        h = (h ^ ((const unsigned char*)p)[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+//------------------------------------------------------------------------------
+// Meshes repeating the geometry of a previous one (CAD assemblies: the same bolt
+// or clip everywhere) only differ by their transform. Keys and data of the meshes
+// get hashed, then compared for real: copies use the vertices and indices of
+// their prototype (see initBuffersObject) and get drawn with it, as instances
+// (see recordJob).
+// Only meshes with one transform of their own and none in their primitive groups
+// qualify. Needs the data in memory: not when streamed from the file.
+// No OpenGL: runs on the loader thread
+//------------------------------------------------------------------------------
+void Bk3dModel::findInstances()
+{
+    m_meshPrototype.clear();
+    int n = m_meshFile->pMeshes->n;
+    std::vector<int> prototypes(n);
+    std::multimap<unsigned long long, int> hashes;
+    std::vector<GLuint64> key, protoKey;
+    int numCopies = 0;
+    for(int i=0; i<n; i++)
+    {
+        prototypes[i] = i;
+        bk3d::Mesh *pMesh = m_meshFile->pMeshes->p[i];
+        // meshes before g_firstMesh aren't drawn: can't be prototypes
+        // (flattened ones are in the model space already, or left empty)
+        bool bQualifies = (i >= g_firstMesh) && pMesh->pTransforms && (pMesh->pTransforms->n == 1)
+            && !m_flatMeshes.count(pMesh) && hasDraws(pMesh);
+        for(int pg=0; bQualifies && (pg<pMesh->pPrimGroups->n); pg++)
+            if(pMesh->pPrimGroups->p[pg]->pTransforms && (pMesh->pPrimGroups->p[pg]->pTransforms->n > 0))
+                bQualifies = false;
+        if(!bQualifies)
+            continue;
+        geometryKey(pMesh, m_narrowedPGs, m_quantizedMeshes.count(pMesh) > 0, key);
+        unsigned long long h = hashBytes(0xcbf29ce484222325ULL, &key[0], key.size() * sizeof(GLuint64));
+        for(int s=0; s<pMesh->pSlots->n; s++)
+            h = hashBytes(h, (const char*)pMesh->pSlots->p[s]->pVtxBufferData, pMesh->pSlots->p[s]->vtxBufferSizeBytes);
+        for(int pg=0; pg<pMesh->pPrimGroups->n; pg++)
+            if(pMesh->pPrimGroups->p[pg]->indexArrayByteSize > 0)
+                h = hashBytes(h, (const char*)pMesh->pPrimGroups->p[pg]->pIndexBufferData, pMesh->pPrimGroups->p[pg]->indexArrayByteSize);
+        std::pair<std::multimap<unsigned long long, int>::iterator, std::multimap<unsigned long long, int>::iterator> range = hashes.equal_range(h);
+        for(std::multimap<unsigned long long, int>::iterator iH = range.first; iH != range.second; ++iH)
+        {
+            bk3d::Mesh *pProto = m_meshFile->pMeshes->p[iH->second];
+            geometryKey(pProto, m_narrowedPGs, m_quantizedMeshes.count(pProto) > 0, protoKey);
+            bool bSame = key == protoKey;
+            for(int s=0; bSame && (s<pMesh->pSlots->n); s++)
+                bSame = memcmp((const char*)pMesh->pSlots->p[s]->pVtxBufferData, (const char*)pProto->pSlots->p[s]->pVtxBufferData, pMesh->pSlots->p[s]->vtxBufferSizeBytes) == 0;
+            for(int pg=0; bSame && (pg<pMesh->pPrimGroups->n); pg++)
+                if(pMesh->pPrimGroups->p[pg]->indexArrayByteSize > 0)
+                    bSame = memcmp((const char*)pMesh->pPrimGroups->p[pg]->pIndexBufferData, (const char*)pProto->pPrimGroups->p[pg]->pIndexBufferData, pMesh->pPrimGroups->p[pg]->indexArrayByteSize) == 0;
+            if(bSame)
+            {
+                prototypes[i] = iH->second;
+                break;
+            }
+        }
+        if(prototypes[i] == i)
+            hashes.insert(std::make_pair(h, i));
+        else
+            numCopies++;
+    }
+    if(numCopies > 0)
+        m_meshPrototype.swap(prototypes);
+    LOGI("%s: %d meshes out of %d are copies of others\n", m_name.c_str(), numCopies, n);
+}
+
+//------------------------------------------------------------------------------
+// Depth passes only need the positions, that slots interleave with normals and
+// more: each mesh gets its attribute 0 tightly packed in a range of its own,
+// after its slots in the VBO (see initBuffersObject). Slots with nothing else
+// than the positions, packed the same way, are used as they are.
+// Copies of a geometry use the stream of their prototype
+//------------------------------------------------------------------------------
+void Bk3dModel::extractPositions()
+{
+    int n = m_meshFile->pMeshes->n;
+    PositionStream none = { NULL, 0, 0, -1, 0 };
+    m_posStreams.assign(n, none);
+    int numCopied = 0, numInPlace = 0;
+    GLsizeiptr bytes = 0;
+    for(int i=0; i<n; i++)
+    {
+        bk3d::Mesh *pMesh = m_meshFile->pMeshes->p[i];
+        if(!m_meshPrototype.empty() && (m_meshPrototype[i] != i))
+            continue;
+        if((pMesh->pAttributes->n < 1) || !hasDraws(pMesh))
+            continue;
+        bk3d::Attribute* pP = pMesh->pAttributes->p[0];
+        bk3d::Slot* pS = pMesh->pSlots->p[pP->slot];
+        GLuint eltSz = attributeBytes(pP);
+        GLuint stride = positionStride(pP);
+        if((pS->vertexCount == 0) || !pS->pVtxBufferData
+          || (pS->vtxBufferSizeBytes < (pS->vertexCount-1) * pP->strideBytes + pP->dataOffsetBytes + eltSz))
+            continue;
+        PositionStream &ps = m_posStreams[i];
+        ps.strideBytes = stride;
+        ps.sizeBytes = (GLsizeiptr)pS->vertexCount * stride;
+        bool bAlone = (pP->strideBytes == stride) && (pP->dataOffsetBytes == 0);
+        for(int a=1; bAlone && (a<pMesh->pAttributes->n); a++)
+            bAlone = pMesh->pAttributes->p[a]->slot != pP->slot;
+        if(bAlone)
+        {
+            ps.slot = pP->slot;
+            numInPlace++;
+            continue;
+        }
+        m_vertexData.push_back(std::vector<char>((size_t)ps.sizeBytes, 0));
+        char* pDst = &m_vertexData.back()[0];
+        const char* pSrc = (const char*)pS->pVtxBufferData + pP->dataOffsetBytes;
+        for(unsigned int v=0; v<pS->vertexCount; v++)
+            memcpy(pDst + v * stride, pSrc + v * pP->strideBytes, eltSz);
+        ps.pData = pDst;
+        bytes += ps.sizeBytes;
+        numCopied++;
+    }
+    LOGI("%s: position streams for %d meshes (%.2f Mb), %d more use their slot of positions\n",
+        m_name.c_str(), numCopied, (float)bytes/(1024.0f*1024.0f), numInPlace);
+}
+
+//------------------------------------------------------------------------------
+// transform of a mesh. Quantized positions also get mapped back from [0,1] to
+// the bounding box of the mesh (see quantizeVertices)
+//------------------------------------------------------------------------------
+static mat4f meshObjectMatrix(const bk3d::Mesh* pMesh, const MatrixBufferObject* pMatrices, bool bQuantized)
+{
+    mat4f m(array16_id);
+    if(pMesh->pTransforms && (pMesh->pTransforms->n > 0) && pMatrices)
+        m = pMatrices[pMesh->pTransforms->p[0]->ID].mO;
+    if(bQuantized)
+    {
+        mat4f box(array16_id);
+        box.mat_array[0]  = pMesh->aabbox.max.x - pMesh->aabbox.min.x;
+        box.mat_array[5]  = pMesh->aabbox.max.y - pMesh->aabbox.min.y;
+        box.mat_array[10] = pMesh->aabbox.max.z - pMesh->aabbox.min.z;
+        box.mat_array[12] = pMesh->aabbox.min.x;
+        box.mat_array[13] = pMesh->aabbox.min.y;
+        box.mat_array[14] = pMesh->aabbox.min.z;
+        m = m * box;
+    }
+    return m;
+}
+
+//------------------------------------------------------------------------------
+// table of the transforms given per mesh rather than per transform:
+// - for the instances found by findInstances(): each prototype has its own
+//   transform then the ones of its copies
+// - for each quantized or flattened mesh, drawn alone. Flattened ones are
+//   in the model space already: identity, but for the box of quantized ones
+// Each of them starts 256 bytes aligned, as offsets of UBOs must be
+//------------------------------------------------------------------------------
+void Bk3dModel::initMeshTransforms()
+{
+    m_instances.clear();
+    m_meshMatrix.clear();
+    if(m_meshPrototype.empty() && m_quantizedMeshes.empty() && m_flatMeshes.empty())
+        return;
+    int n = m_meshFile->pMeshes->n;
+    std::map<int, std::vector<int> > copies;
+    for(int i=0; !m_meshPrototype.empty() && (i<n); i++)
+    {
+        int proto = m_meshPrototype[i];
+        if(proto == i)
+            continue;
+        std::vector<int> &meshes = copies[proto];
+        if(meshes.empty())
+            meshes.push_back(proto);
+        meshes.push_back(i);
+    }
+    std::vector<float> matrices;
+    int numInstances = 0;
+    for(std::map<int, std::vector<int> >::iterator iC = copies.begin(); iC != copies.end(); ++iC)
+    {
+        Instances inst = { (GLuint)(matrices.size() / 16), (GLuint)iC->second.size() };
+        for(size_t c=0; c<iC->second.size(); c++)
+        {
+            const bk3d::Mesh* pMesh = m_meshFile->pMeshes->p[iC->second[c]];
+            mat4f m = meshObjectMatrix(pMesh, m_objectMatrices, m_quantizedMeshes.count(pMesh) > 0);
+            matrices.insert(matrices.end(), m.mat_array, m.mat_array + 16);
+        }
+        matrices.resize((matrices.size() + 63) & ~(size_t)63, 0.0f);
+        m_instances[iC->first] = inst;
+        numInstances += inst.count;
+    }
+    m_meshMatrix.assign(n, ~0u);
+    for(int i=0; i<n; i++)
+    {
+        const bk3d::Mesh* pMesh = m_meshFile->pMeshes->p[i];
+        bool bQuantized = m_quantizedMeshes.count(pMesh) > 0;
+        bool bFlat = m_flatMeshes.count(pMesh) > 0;
+        if(!bQuantized && !bFlat)
+            continue;
+        m_meshMatrix[i] = (GLuint)(matrices.size() / 16);
+        mat4f m = meshObjectMatrix(pMesh, bFlat ? NULL : m_objectMatrices, bQuantized);
+        matrices.insert(matrices.end(), m.mat_array, m.mat_array + 16);
+        matrices.resize(matrices.size() + 48, 0.0f);
+    }
+    if(m_uboMeshMatrices.Id == 0)
+        glGenBuffers(1, &m_uboMeshMatrices.Id);
+    m_uboMeshMatrices.Sz = matrices.size() * sizeof(float);
+    glNamedBufferDataEXT(m_uboMeshMatrices.Id, m_uboMeshMatrices.Sz, &matrices[0], GL_STATIC_DRAW);
+    glGetNamedBufferParameterui64vNV(m_uboMeshMatrices.Id, GL_BUFFER_GPU_ADDRESS_NV, (GLuint64EXT*)&m_uboMeshMatrices.Addr);
+    glMakeNamedBufferResidentNV(m_uboMeshMatrices.Id, GL_READ_ONLY);
+    LOGI("%d meshes drawn as instances of %d, %d quantized, %d flattened: transforms stored in %d Kb\n", numInstances, (int)m_instances.size(),
+        (int)m_quantizedMeshes.size(), (int)m_flatMeshes.size(), (int)((m_uboMeshMatrices.Sz + 512)/1024));
+}
+
+//------------------------------------------------------------------------------
+// Upload of a buffer area that is still in the file (see bk3d::loadHeader):
+// the loader thread inflates it straight into the segments of a persistently
+// mapped staging ring (see inflateBufferArea) and the GL thread has the GPU copy
+// each slot and primitive group to its place in the VBOs/EBOs, frame after
+// frame within the upload budget (see streamStep).
+// The vertex and index data are never copied in a CPU-side buffer
+//------------------------------------------------------------------------------
+#define STAGING_SEGMENTS    4
+#define STAGING_SEGMENTSZ   (4*1024*1024)
+struct StagingCopy {
+    GLuint64    srcOffset;  // in the buffer area
+    GLsizeiptr  size;
+    GLuint      dstBO;
+    GLintptr    dstOffset;
+    const bk3d::PrimGroup* pRunPG; // NULL: copied as-is. Else source of an index run to build (see processPrimGroups)
+    GLuint      source;
+};
+static bool stagingCopyLess(const StagingCopy &a, const StagingCopy &b) { return a.srcOffset < b.srcOffset; }
+
+struct StagingRun {
+    std::vector< std::vector<char> > sources;
+    int         pending;
+    GLuint      bo;
+    GLintptr    offset;
+};
+enum StagingSegment {
+    SEGMENT_FREE,       // the loader thread can inflate in it
+    SEGMENT_FILLED,     // the GL thread can copy from it
+    SEGMENT_INFLIGHT,   // copies issued: free again once their fence is signaled
+};
+struct StreamUpload {
+    // shared by the loader thread and the GL thread
+    std::mutex              mutex;
+    std::condition_variable cond;
+    char*                   pStaging;   // NULL until the GL thread created the ring
+    StagingSegment          state[STAGING_SEGMENTS];
+    int                     filled[STAGING_SEGMENTS];
+    bool                    bAbort;     // the GL thread gave up: the loader thread stops
+    bool                    bDone;      // the loader thread is done with the file
+    bool                    bFailed;    // read error
+    // GL thread only
+    GLuint                  staging;
+    GLsync                  fences[STAGING_SEGMENTS];
+    int                     nextSeg;    // segment to copy from next
+    GLuint64                streamOffset; // where the next segment starts in the buffer area
+    size_t                  c;          // copies before this one are done
+    std::vector<StagingCopy> copies;
+    std::map<const bk3d::PrimGroup*, StagingRun> runs;
+
+    StreamUpload() : pStaging(NULL), bAbort(false), bDone(false), bFailed(false),
+        staging(0), nextSeg(0), streamOffset(0), c(0)
+    {
+        for(int i=0; i<STAGING_SEGMENTS; i++)
+        {
+            state[i] = SEGMENT_FREE;
+            filled[i] = 0;
+            fences[i] = 0;
+        }
+    }
+};
+
+//------------------------------------------------------------------------------
+// builds the index data of a run of processPrimGroups() from the data of its
+// sources and puts it in the EBO
+//------------------------------------------------------------------------------
+void Bk3dModel::uploadIndexRun(const bk3d::PrimGroup* pPG, const std::vector< std::vector<char> > &sourceData, GLuint bo, GLintptr offset)
+{
+    const IndexRun &run = m_indexRuns[pPG];
+    std::vector<GLuint> indices;
+    for(size_t s=0; s<run.sources.size(); s++)
+        appendListIndices(run.sources[s], run.sources[s].pData ? &sourceData[s][0] : NULL, indices);
+    // the file may not tell the truth about restarts
+    indices.resize(pPG->indexCount, indices.empty() ? 0 : indices.back());
+    std::vector<char> data(pPG->indexArrayByteSize);
+    storeIndices(indices, pPG, m_narrowedPGs.count(pPG) ? pPG->minIndex : 0, &data[0]);
+    glNamedBufferSubDataEXT(bo, offset, data.size(), &data[0]);
+}
 
-        LOGI("%d matrices stored in %d Kb\n", m_meshFile->pTransforms->nBones, (m_uboObjectMatrices.Sz + 512)/1024);
-        LOGFLUSH();
+//------------------------------------------------------------------------------
+// loader thread side: waits for the ring, then inflates the buffer area in its
+// free segments until the end of the stream. No OpenGL in here. The file gets
+// closed before bDone is set: the GL thread may release everything right after
+//------------------------------------------------------------------------------
+void Bk3dModel::inflateBufferArea()
+{
+    StreamUpload &su = *m_streamUpload;
+    std::unique_lock<std::mutex> lock(su.mutex);
+    for(int seg=0; !su.bAbort; seg = (seg+1) % STAGING_SEGMENTS)
+    {
+        while(!su.bAbort && (!su.pStaging || (su.state[seg] != SEGMENT_FREE)))
+            su.cond.wait(lock);
+        if(su.bAbort)
+            break;
+        char* pDst = su.pStaging + seg * STAGING_SEGMENTSZ;
+        lock.unlock();
+        int n = GREAD(m_streamFile, pDst, STAGING_SEGMENTSZ);
+        lock.lock();
+        if(n < 0)
+            su.bFailed = true;
+        if(n <= 0)
+            break;
+        su.filled[seg] = n;
+        su.state[seg] = SEGMENT_FILLED;
+        su.cond.notify_all();
     }
+    lock.unlock();
+    GCLOSE(m_streamFile);
+    m_streamFile = NULL;
+    lock.lock();
+    su.bDone = true;
+    su.cond.notify_all();
+}
 
-    //
-    // First pass: evaluate the size of the single VBO
-    // and store offset to where we'll find data back
-    //
-    bk3d::Mesh *pMesh = NULL;
+//------------------------------------------------------------------------------
+// GL thread side: what goes where, in the order of the file, and the staging
+// ring handed to the loader thread
+//------------------------------------------------------------------------------
+bool Bk3dModel::beginStreamUpload()
+{
+    StreamUpload &su = *m_streamUpload;
     for(int i=0; i< m_meshFile->pMeshes->n; i++)
-	{
-		pMesh = m_meshFile->pMeshes->p[i];
-        pMesh->userPtr = (void*)m_ObjVBOs.size(); // keep track of the VBO
-        //
-        // When we reached the arbitrary limit: switch to another VBO
-        //
-        if(curVBO.Sz > (g_MaxBOSz * 1024*1024))
-        {
-	        glGenBuffers(1, &curVBO.Id);
-        #if 1
-            glNamedBufferDataEXT(curVBO.Id, curVBO.Sz, NULL, GL_STATIC_DRAW);
-        #else
-            glNamedBufferStorageEXT(curVBO.Id, curVBO.Sz, NULL, 0); // Not working with NSight !!! https://www.opengl.org/registry/specs/ARB/buffer_storage.txt
-        #endif
-            glGetNamedBufferParameterui64vNV(curVBO.Id, GL_BUFFER_GPU_ADDRESS_NV, &curVBO.Addr);
-            glMakeNamedBufferResidentNV(curVBO.Id, GL_READ_ONLY);
-            //
-            // push this VBO and create a new one
-            //
-            totalVBOSz += curVBO.Sz;
-            m_ObjVBOs.push_back(curVBO);
-            memset(&curVBO, 0, sizeof(curVBO));
-            //
-            // At the same time, create a new EBO... good enough for now
-            //
-            glGenBuffers(1, &curEBO.Id); // store directly to a user-space dedicated to this kind of things
-        #if 1
-            glNamedBufferDataEXT(curEBO.Id, curEBO.Sz, NULL, GL_STATIC_DRAW);
-        #else
-            glNamedBufferStorageEXT(curEBO.Id, curEBO.Sz, NULL, 0); // Not working with NSight !!! https://www.opengl.org/registry/specs/ARB/buffer_storage.txt
-        #endif
-            glGetNamedBufferParameterui64vNV(curEBO.Id, GL_BUFFER_GPU_ADDRESS_NV, &curEBO.Addr);
-            glMakeNamedBufferResidentNV(curEBO.Id, GL_READ_ONLY);
-            //
-            // push this VBO and create a new one
-            //
-            totalEBOSz += curEBO.Sz;
-            m_ObjEBOs.push_back(curEBO);
-            memset(&curEBO, 0, sizeof(curEBO));
-        }
-        //
-        // Slots: buffers for vertices
-        //
-        int n = pMesh->pSlots->n;
-        for(int s=0; s<n; s++)
+    {
+        bk3d::Mesh *pMesh = m_meshFile->pMeshes->p[i];
+        int idx = (int)(size_t)pMesh->userPtr;
+        for(int s=0; s<pMesh->pSlots->n; s++)
         {
             bk3d::Slot* pS = pMesh->pSlots->p[s];
-            pS->userData = 0;
-            pS->userPtr = (int*)curVBO.Sz;
-            GLuint alignedSz = (pS->vtxBufferSizeBytes >> 8);
-            alignedSz = alignedSz << 8;
-            if(pS->vtxBufferSizeBytes & 0xFF) alignedSz += 256;
-            curVBO.Sz += alignedSz;
+            StagingCopy c = { (GLuint64)((char*)pS->pVtxBufferData - DETACHEDBUFFERAREA), pS->vtxBufferSizeBytes, m_ObjVBOs[idx].Id, m_ObjVBOs[idx].Offset + (GLintptr)(size_t)pS->userPtr.p, NULL, 0 };
+            su.copies.push_back(c);
         }
-        //
-        // Primitive groups
-        //
         for(int pg=0; pg<pMesh->pPrimGroups->n; pg++)
         {
             bk3d::PrimGroup* pPG = pMesh->pPrimGroups->p[pg];
-            if(pPG->indexArrayByteSize > 0)
+            if(pPG->indexArrayByteSize == 0)
+                continue;
+            std::map<const bk3d::PrimGroup*, IndexRun>::iterator iR = m_indexRuns.find(pPG);
+            if(iR == m_indexRuns.end())
             {
-                GLuint alignedSz = (pPG->indexArrayByteSize >> 8);
-                alignedSz += pPG->indexArrayByteSize & 0xFF ? 1 : 0;
-                alignedSz = alignedSz << 8;
-                pPG->userPtr = (void*)curEBO.Sz;
-                curEBO.Sz += alignedSz;
-            } else {
-                pPG->userPtr = (void*)~0;
+                StagingCopy c = { (GLuint64)((char*)pPG->pIndexBufferData - DETACHEDBUFFERAREA), pPG->indexArrayByteSize, m_ObjEBOs[m_meshEBO[i]].Id, m_ObjEBOs[m_meshEBO[i]].Offset + (GLintptr)(size_t)pPG->userPtr, NULL, 0 };
+                su.copies.push_back(c);
+                continue;
             }
+            // index data rebuilt from what the file holds for each source
+            StagingRun &rd = su.runs[pPG];
+            rd.sources.resize(iR->second.sources.size());
+            rd.pending = 0;
+            rd.bo = m_ObjEBOs[m_meshEBO[i]].Id;
+            rd.offset = m_ObjEBOs[m_meshEBO[i]].Offset + (GLintptr)(size_t)pPG->userPtr;
+            for(size_t r=0; r<iR->second.sources.size(); r++)
+            {
+                const IndexSource &src = iR->second.sources[r];
+                if(src.pData == NULL)
+                    continue;
+                GLsizeiptr sz = src.count * (src.format == GL_UNSIGNED_INT ? sizeof(GLuint) : sizeof(GLushort));
+                rd.sources[r].resize(sz);
+                rd.pending++;
+                StagingCopy c = { (GLuint64)((const char*)src.pData - DETACHEDBUFFERAREA), sz, rd.bo, 0, pPG, (GLuint)r };
+                su.copies.push_back(c);
+            }
+            // nothing to wait for when no source is indexed
+            if(rd.pending == 0)
+                uploadIndexRun(pPG, rd.sources, rd.bo, rd.offset);
         }
-	}
+    }
+    std::sort(su.copies.begin(), su.copies.end(), stagingCopyLess);
     //
-    // Finalize the last set of data
+    // the staging ring. Client storage and read access: inflate reads back what it wrote,
+    // which must not happen in write-combined memory
     //
+    glGenBuffers(1, &su.staging);
+    glNamedBufferStorageEXT(su.staging, STAGING_SEGMENTS*STAGING_SEGMENTSZ, NULL, 
+        GL_MAP_WRITE_BIT|GL_MAP_READ_BIT|GL_MAP_PERSISTENT_BIT|GL_CLIENT_STORAGE_BIT);
+    char* pStaging = (char*)glMapNamedBufferRangeEXT(su.staging, 0, STAGING_SEGMENTS*STAGING_SEGMENTSZ, 
+        GL_MAP_WRITE_BIT|GL_MAP_READ_BIT|GL_MAP_PERSISTENT_BIT|GL_MAP_FLUSH_EXPLICIT_BIT);
+    if(!pStaging)
     {
-	    glGenBuffers(1, &curVBO.Id);
-    #if 1
-        glNamedBufferDataEXT(curVBO.Id, curVBO.Sz, NULL, GL_STATIC_DRAW);
-    #else
-        glNamedBufferStorageEXT(curVBO.Id, curVBO.Sz, NULL, 0); // Not working with NSight !!! https://www.opengl.org/registry/specs/ARB/buffer_storage.txt
-    #endif
-        glGetNamedBufferParameterui64vNV(curVBO.Id, GL_BUFFER_GPU_ADDRESS_NV, &curVBO.Addr);
-        glMakeNamedBufferResidentNV(curVBO.Id, GL_READ_ONLY);
-        //
-        // push this VBO and create a new one
-        //
-        totalVBOSz += curVBO.Sz;
-        m_ObjVBOs.push_back(curVBO);
-        memset(&curVBO, 0, sizeof(curVBO));
-        //
-        // At the same time, create a new EBO... good enough for now
-        //
-        glGenBuffers(1, &curEBO.Id); // store directly to a user-space dedicated to this kind of things
-    #if 1
-        glNamedBufferDataEXT(curEBO.Id, curEBO.Sz, NULL, GL_STATIC_DRAW);
-    #else
-        glNamedBufferStorageEXT(curEBO.Id, curEBO.Sz, NULL, 0); // Not working with NSight !!! https://www.opengl.org/registry/specs/ARB/buffer_storage.txt
-    #endif
-        glGetNamedBufferParameterui64vNV(curEBO.Id, GL_BUFFER_GPU_ADDRESS_NV, &curEBO.Addr);
-        glMakeNamedBufferResidentNV(curEBO.Id, GL_READ_ONLY);
-        //
-        // push this VBO and create a new one
-        //
-        totalEBOSz += curEBO.Sz;
-        m_ObjEBOs.push_back(curEBO);
-        memset(&curVBO, 0, sizeof(curVBO));
+        LOGE("couldn't map the staging ring of %s\n", m_name.c_str());
+        return false;
     }
-    //
-    // second pass: put stuff in the buffer and store offsets
-    //
+    std::lock_guard<std::mutex> lock(su.mutex);
+    su.pStaging = pStaging;
+    su.cond.notify_all();
+    return true;
+}
 
-    for(int i=0; i< m_meshFile->pMeshes->n; i++)
-	{
-		bk3d::Mesh *pMesh = m_meshFile->pMeshes->p[i];
-        int idx = (int)pMesh->userPtr;
-        curVBO = m_ObjVBOs[idx];
-        curEBO = m_ObjEBOs[idx];
-        int n = pMesh->pSlots->n;
-        for(int s=0; s<n; s++)
+//------------------------------------------------------------------------------
+// GL thread side, once per frame: segments the GPU is done with go back to the
+// loader thread, filled ones get copied until tEnd (see sysGetTime).
+// Returns 0 while the upload goes on, 1 once all the data is in the buffer
+// objects and -1 if the stream ended early or failed. The ring is released
+// in both cases (see endStream)
+//------------------------------------------------------------------------------
+int Bk3dModel::streamStep(double tEnd)
+{
+    StreamUpload &su = *m_streamUpload;
+    for(int seg=0; seg<STAGING_SEGMENTS; seg++)
+    {
+        if(!su.fences[seg] || (glClientWaitSync(su.fences[seg], GL_SYNC_FLUSH_COMMANDS_BIT, 0) == GL_TIMEOUT_EXPIRED))
+            continue;
+        glDeleteSync(su.fences[seg]);
+        su.fences[seg] = 0;
+        std::lock_guard<std::mutex> lock(su.mutex);
+        su.state[seg] = SEGMENT_FREE;
+        su.cond.notify_all();
+    }
+    while(su.c < su.copies.size())
+    {
+        int seg = su.nextSeg;
+        int n = 0;
         {
-            bk3d::Slot* pS = pMesh->pSlots->p[s];
-            glNamedBufferSubDataEXT(curVBO.Id, (GLuint)(char*)pS->userPtr, pS->vtxBufferSizeBytes, pS->pVtxBufferData);
+            std::lock_guard<std::mutex> lock(su.mutex);
+            if(su.state[seg] == SEGMENT_FILLED)
+                n = su.filled[seg];
+            else if(su.bDone)
+                break; // nothing more will come
+            else
+                return 0; // the loader thread is behind
         }
-        for(int pg=0; pg<pMesh->pPrimGroups->n; pg++)
+        GLintptr segOffset = seg * STAGING_SEGMENTSZ;
+        glFlushMappedNamedBufferRangeEXT(su.staging, segOffset, n);
+        GLuint64 segEnd = su.streamOffset + n;
+        for(size_t i=su.c; (i<su.copies.size()) && (su.copies[i].srcOffset < segEnd); i++)
         {
-            bk3d::PrimGroup* pPG = pMesh->pPrimGroups->p[pg];
-            if(pPG->indexArrayByteSize > 0)
-                glNamedBufferSubDataEXT(curEBO.Id, (GLuint)(char*)pPG->userPtr, pPG->indexArrayByteSize, pPG->pIndexBufferData);
+            const StagingCopy &cp = su.copies[i];
+            GLuint64 b = cp.srcOffset > su.streamOffset ? cp.srcOffset : su.streamOffset;
+            GLuint64 e = cp.srcOffset + cp.size < segEnd ? cp.srcOffset + cp.size : segEnd;
+            if((b < e) && cp.pRunPG)
+            {
+                // sources may straddle segments: the run is built once all of them are there
+                StagingRun &rd = su.runs[cp.pRunPG];
+                memcpy(&rd.sources[cp.source][(size_t)(b - cp.srcOffset)], su.pStaging + segOffset + (b - su.streamOffset), (size_t)(e - b));
+                if((e == cp.srcOffset + cp.size) && (--rd.pending == 0))
+                    uploadIndexRun(cp.pRunPG, rd.sources, rd.bo, rd.offset);
+            }
+            else if(b < e)
+                glNamedCopyBufferSubDataEXT(su.staging, cp.dstBO, segOffset + (b - su.streamOffset), cp.dstOffset + (b - cp.srcOffset), e - b);
         }
-        //glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-	}
-    LOGI("meshes: %d in :%d VBOs (%f Mb) and %d EBOs (%f Mb) \n", m_meshFile->pMeshes->n, m_ObjVBOs.size(), (float)totalVBOSz/(float)(1024*1024), m_ObjEBOs.size(), (float)totalEBOSz/(float)(1024*1024));
-    LOGFLUSH();
-    return true;
+        while((su.c < su.copies.size()) && (su.copies[su.c].srcOffset + su.copies[su.c].size <= segEnd))
+            su.c++;
+        su.fences[seg] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        {
+            std::lock_guard<std::mutex> lock(su.mutex);
+            su.state[seg] = SEGMENT_INFLIGHT;
+        }
+        su.streamOffset = segEnd;
+        su.nextSeg = (seg+1) % STAGING_SEGMENTS;
+        if((su.c < su.copies.size()) && (sysGetTime() >= tEnd))
+            return 0;
+    }
+    bool bFailed = su.c < su.copies.size();
+    {
+        std::lock_guard<std::mutex> lock(su.mutex);
+        bFailed = bFailed || su.bFailed;
+    }
+    abortStream(); // the loader thread may still be waiting for a free segment
+    endStream();
+    if(bFailed)
+    {
+        LOGE("error in streaming the data of %s\n", m_name.c_str());
+        return -1;
+    }
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+// any thread: the loader thread stops inflating
+//------------------------------------------------------------------------------
+void Bk3dModel::abortStream()
+{
+    if(!m_streamUpload)
+        return;
+    std::lock_guard<std::mutex> lock(m_streamUpload->mutex);
+    m_streamUpload->bAbort = true;
+    m_streamUpload->cond.notify_all();
+}
+
+//------------------------------------------------------------------------------
+// GL thread side: waits for the loader thread to leave the file, then for the
+// GPU to be done with the ring, and releases it
+//------------------------------------------------------------------------------
+void Bk3dModel::endStream()
+{
+    if(!m_streamUpload)
+        return;
+    StreamUpload &su = *m_streamUpload;
+    {
+        std::unique_lock<std::mutex> lock(su.mutex);
+        while(!su.bDone)
+            su.cond.wait(lock);
+    }
+    for(int seg=0; seg<STAGING_SEGMENTS; seg++)
+        if(su.fences[seg])
+        {
+            glClientWaitSync(su.fences[seg], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+            glDeleteSync(su.fences[seg]);
+        }
+    if(su.pStaging)
+        glUnmapNamedBufferEXT(su.staging);
+    if(su.staging)
+        glDeleteBuffers(1, &su.staging);
+    delete m_streamUpload;
+    m_streamUpload = NULL;
 }
 
 //------------------------------------------------------------------------------
 //
 //------------------------------------------------------------------------------
 bool Bk3dModel::loadModel(const char *name)
+{
+    LOGFLUSH();
+    if(!loadFile(name))
+        return false;
+    if(!m_streamUpload)
+        return uploadModel();
+    // a thread of its own inflates the buffer area while this one copies it
+    std::thread inflater(&Bk3dModel::inflateBufferArea, this);
+    int r = uploadModel() ? 0 : -1;
+    while(r == 0)
+    {
+        r = streamStep(DBL_MAX);
+        if(r == 0)
+            std::this_thread::yield();
+    }
+    inflater.join();
+    return (r > 0) && finishUpload();
+}
+
+//------------------------------------------------------------------------------
+// true when nothing but vertex and index data lives in the buffer area of the
+// file: the relocation table tells which pointers lead there
+//------------------------------------------------------------------------------
+static bool geometryOnlyBufferArea(bk3d::FileHeader *pHeader, size_t bufferMemorySz)
+{
+    std::set<unsigned long long> geometryPtrs; // where these pointers are, in the header area
+    for(int i=0; i<pHeader->pMeshes->n; i++)
+    {
+        bk3d::Mesh *pMesh = pHeader->pMeshes->p[i];
+        for(int a=0; pMesh->pAttributes && (a<pMesh->pAttributes->n); a++)
+            geometryPtrs.insert((char*)&pMesh->pAttributes->p[a]->pAttributeBufferData - (char*)pHeader);
+        for(int a=0; pMesh->pBSAttributes && (a<pMesh->pBSAttributes->n); a++)
+            geometryPtrs.insert((char*)&pMesh->pBSAttributes->p[a]->pAttributeBufferData - (char*)pHeader);
+        for(int s=0; s<pMesh->pSlots->n; s++)
+            geometryPtrs.insert((char*)&pMesh->pSlots->p[s]->pVtxBufferData - (char*)pHeader);
+        for(int s=0; pMesh->pBSSlots && (s<pMesh->pBSSlots->n); s++)
+            geometryPtrs.insert((char*)&pMesh->pBSSlots->p[s]->pVtxBufferData - (char*)pHeader);
+        for(int pg=0; pg<pMesh->pPrimGroups->n; pg++)
+            geometryPtrs.insert((char*)&pMesh->pPrimGroups->p[pg]->pIndexBufferData - (char*)pHeader);
+    }
+    bk3d::RelocationTable *pTable = pHeader->pRelocationTable;
+    for(int i=0; i<pTable->numRelocationOffsets; i++)
+    {
+        const bk3d::RelocationTable::Offsets &o = pTable->pRelocationOffsets[i];
+        if(o.ptrOffset && (o.offset >= pHeader->nodeByteSize) && (o.offset - pHeader->nodeByteSize < bufferMemorySz)
+          && !geometryPtrs.count(o.ptrOffset))
+            return false;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// table of contents of the pack archive (see -P): read once, by whichever
+// loader thread gets there first, for all the models
+//------------------------------------------------------------------------------
+static const bk3d::PackFile* packFile()
+{
+    static bk3d::PackFile s_pack;
+    static bool s_packOpen = bk3d::openPack(g_PackFile.c_str(), &s_pack);
+    return s_packOpen ? &s_pack : NULL;
+}
+
+//------------------------------------------------------------------------------
+// CPU side of the loading: find, read and resolve the file. No OpenGL in here
+// so that it can run on a loader thread (see startAsyncLoading)
+//------------------------------------------------------------------------------
+bool Bk3dModel::loadFile(const char *name)
 {
     if(name && name[0] != '\0')
         m_name = std::string(name);
     LOGI("Loading Mesh %s..\n", m_name.c_str());
-    LOGFLUSH();
     std::vector<std::string> modelPaths;
     modelPaths.push_back(m_name); // for when models with binaries
     modelPaths.push_back(std::string("../../../downloaded_resources/") + m_name); // for when in build_all/build folder
@@ -901,9 +3705,57 @@ bool Bk3dModel::loadModel(const char *name)
     modelPaths.push_back(std::string(PROJECT_RELDIRECTORY) + m_name);
     modelPaths.push_back(std::string(PROJECT_ABSDIRECTORY) + m_name);
 
-    for(int i=0; i<modelPaths.size();i++)
+    //
+    // models of a pack archive are found from its table of contents: no probing of folders
+    //
+    if(!g_PackFile.empty())
+    {
+        const bk3d::PackFile* pPack = packFile();
+        if(g_bUseFileMapping)
+            m_meshFile = bk3d::mapFromPack(pPack, m_name.c_str(), &m_meshFileMapping);
+#ifndef NOGZLIB
+        if(!m_meshFile)
+            m_meshFile = bk3d::loadFromPack(pPack, m_name.c_str(), &m_bufferMemory, &m_bufferMemorySz);
+#endif
+        if(!m_meshFile)
+            LOGI("%s not in %s: looking for the file itself\n", m_name.c_str(), g_PackFile.c_str());
+    }
+    for(int i=0; !m_meshFile && (i<modelPaths.size());i++)
     {
-        if(m_meshFile = bk3d::load(modelPaths[i].c_str()))
+        // a previous run may have processed this file already
+        // (out-of-core needs the data of every mesh at hand: no cache nor streamed upload.
+        // Flattened meshes get new tables of primitive groups that the cache can't tell)
+        std::vector<char> source;
+        if(!g_CacheDir.empty() && (g_StreamingBudgetMb == 0) && !g_bFlattenStatic && openCache(modelPaths[i].c_str(), &source))
+            break; // found
+#ifndef NOGZLIB
+        // a cache miss read the whole file already: no need to read it again
+        // (chunked containers and prelinked images go their own way below)
+        if(!source.empty() && (m_meshFile = bk3d::loadFromMemory(&source[0], source.size(), &m_bufferMemory, &m_bufferMemorySz)))
+            break; // found
+#endif
+        std::vector<char>().swap(source);
+        // uncompressed files can be mapped: vertex and index data are then used in place
+        if(g_bUseFileMapping && (m_meshFile = bk3d::mapFile(modelPaths[i].c_str(), &m_meshFileMapping)))
+        {
+            if(m_meshFileMapping.rebased)
+                LOGI("prelinked %s not mapped at its preferred address: pointers were rebased\n", m_name.c_str());
+            break; // found
+        }
+#ifndef NOGZLIB
+        // chunked containers are inflated on many threads
+        if(m_meshFile = bk3d::loadChunked(modelPaths[i].c_str(), &m_bufferMemory, &m_bufferMemorySz, g_LoadThreads))
+            break; // found
+#endif
+        // the buffer area stays in the file until uploadModel() streams it to the buffer objects
+        // (flattening, instancing, quantization and position streams need it in memory)
+        if(g_bStreamUpload && (g_StreamingBudgetMb == 0) && !g_bFlattenStatic && !g_bInstancing && (g_QuantizeVertices == VTXQUANT_NONE)
+          && !g_bDepthStream && (m_meshFile = bk3d::loadHeader(modelPaths[i].c_str(), &m_streamFile)))
+        {
+            m_streamUpload = new StreamUpload;
+            break; // found
+        }
+        if(m_meshFile = bk3d::load(modelPaths[i].c_str(), &m_bufferMemory, &m_bufferMemorySz))
             break; // found
     }
     //if(!(m_meshFile = bk3d::load(m_name.c_str() )))
@@ -925,13 +3777,69 @@ bool Bk3dModel::loadModel(const char *name)
     //        }
     //    }
     //}
+    if(!m_meshFile)
+    {
+        LOGE("error in loading mesh %s\n", m_name.c_str());
+        return false;
+    }
+    // to tell before processing changes the pointers to vertex and index data
+    if(g_bReleaseGeometry && m_bufferMemory && !geometryOnlyBufferArea(m_meshFile, m_bufferMemorySz))
+    {
+        LOGI("%s: the buffer area holds more than vertex and index data. It will stay in memory\n", m_name.c_str());
+        m_bKeepBufferArea = true;
+    }
+    // cache hits already have the layout they were processed with
+    if((g_bMergePrimGroups || g_bCompactIndices) && !m_cacheFile)
+        processPrimGroups();
+    // out-of-core meshes have buffer objects of their own
+    if(g_bFlattenStatic && !m_streamFile && (g_StreamingBudgetMb == 0))
+        flattenStatic();
+    if((g_QuantizeVertices != VTXQUANT_NONE) && !m_cacheFile && !m_streamFile)
+        quantizeVertices();
+    // out-of-core meshes have buffer objects of their own
+    if(g_bInstancing && !m_cacheFile && !m_streamFile && (g_StreamingBudgetMb == 0))
+        findInstances();
+    // the cache has them already
+    if(g_bDepthStream && !m_cacheFile)
+        extractPositions();
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// OpenGL side of the loading: buffer objects for a file loadFile() got
+//------------------------------------------------------------------------------
+bool Bk3dModel::uploadModel()
+{
+    if(!m_meshFile)
+        return false;
+    //
+    // Creation of the buffer objects
+    // will make them resident
+    //
+    if(!initBuffersObject())
+    {
+        // no model rather than one with partially filled buffer objects
+        LOGE("error in uploading mesh %s\n", m_name.c_str());
+        abortStream();
+        endStream();
+        return false;
+    }
+    // streamed buffer area: finishUpload() once streamStep() got it all
+    if(m_streamUpload)
+        return true;
+    return finishUpload();
+}
+
+//------------------------------------------------------------------------------
+// the rest of the upload, once the data is in the buffer objects
+//------------------------------------------------------------------------------
+bool Bk3dModel::finishUpload()
+{
     if(m_meshFile)
     {
-        //
-        // Creation of the buffer objects
-        // will make them resident
-        //
-        initBuffersObject();
+        bool bAutoScale = m_scale <= 0.0;
+        // copies of a geometry get drawn at once: see findInstances()
+        initMeshTransforms();
 	    //
 	    // Some adjustment for the display
 	    //
@@ -963,18 +3871,236 @@ bool Bk3dModel::loadModel(const char *name)
 	        }
             m_posOffset *= m_scale;
         }
+        // (a cache hit cleared m_cacheName: see initBuffersFromCache)
+        if(!m_cacheName.empty())
+            writeCache(bAutoScale);
+        // out-of-core meshes need their data each time they get resident
+        if(g_bReleaseGeometry && (g_StreamingBudgetMb == 0))
+            releaseGeometry();
+        m_bReady = true;
     } else {
-        LOGE("error in loading mesh %s\n", m_name.c_str());
         return false;
     }
     return true;
 }
 
+//------------------------------------------------------------------------------
+// once in the buffer objects, vertex and index data are of no use on the CPU:
+// only the node structures stay, for the recording of the commands and the
+// culling. Pointers to the data get NULL
+//------------------------------------------------------------------------------
+void Bk3dModel::releaseGeometry()
+{
+    size_t released = 0;
+    for(int i=0; i<m_meshFile->pMeshes->n; i++)
+    {
+        bk3d::Mesh *pMesh = m_meshFile->pMeshes->p[i];
+        for(int a=0; pMesh->pAttributes && (a<pMesh->pAttributes->n); a++)
+            pMesh->pAttributes->p[a]->pAttributeBufferData = NULL;
+        for(int a=0; pMesh->pBSAttributes && (a<pMesh->pBSAttributes->n); a++)
+            pMesh->pBSAttributes->p[a]->pAttributeBufferData = NULL;
+        for(int s=0; s<pMesh->pSlots->n; s++)
+            pMesh->pSlots->p[s]->pVtxBufferData = NULL;
+        for(int s=0; pMesh->pBSSlots && (s<pMesh->pBSSlots->n); s++)
+            pMesh->pBSSlots->p[s]->pVtxBufferData = NULL;
+        for(int pg=0; pg<pMesh->pPrimGroups->n; pg++)
+            pMesh->pPrimGroups->p[pg]->pIndexBufferData = NULL;
+    }
+    for(size_t i=0; i<m_posStreams.size(); i++)
+        m_posStreams[i].pData = NULL; // in m_vertexData
+    for(size_t i=0; i<m_vertexData.size(); i++)
+        released += m_vertexData[i].size();
+    for(size_t i=0; i<m_indexData.size(); i++)
+        released += m_indexData[i].size();
+    std::deque< std::vector<char> >().swap(m_vertexData);
+    std::deque< std::vector<char> >().swap(m_indexData);
+    m_indexRuns.clear();
+    if(m_bufferMemory && !m_bKeepBufferArea)
+    {
+        free(m_bufferMemory);
+        released += m_bufferMemorySz;
+        m_bufferMemory = NULL;
+        m_bufferMemorySz = 0;
+    }
+    if(m_streamFile)
+    {
+        GCLOSE(m_streamFile);
+        m_streamFile = NULL;
+    }
+    LOGI("%s: %.2f Mb of vertex and index data released\n", m_name.c_str(), (float)released/(float)(1024*1024));
+}
+
+//------------------------------------------------------------------------------
+// what the model takes in memory, added to stats
+//------------------------------------------------------------------------------
+void Bk3dModel::addMemoryStats(MemoryStats &stats)
+{
+    if(!m_meshFile)
+        return;
+    if(m_meshFileMapping.base)
+        stats.hostMapped += m_meshFileMapping.size;
+    else
+        stats.hostNodes += m_meshFile->nodeByteSize;
+    stats.hostNodes += m_objectMatricesNItems * sizeof(MatrixBufferObject) + m_materialNItems * sizeof(MaterialBuffer);
+    stats.hostNodes += m_flatPrimGroups.size() * sizeof(bk3d::PrimGroup);
+    for(size_t i=0; i<m_flatPools.size(); i++)
+        stats.hostNodes += m_flatPools[i].size();
+    stats.hostGeometry += m_bufferMemorySz;
+    for(size_t i=0; i<m_vertexData.size(); i++)
+        stats.hostGeometry += m_vertexData[i].size();
+    for(size_t i=0; i<m_indexData.size(); i++)
+        stats.hostGeometry += m_indexData[i].size();
+    stats.hostCommands += m_tokenBufferModel.data.size();
+    for(size_t i=0; i<m_ObjVBOs.size(); i++)
+        stats.gpuVertices += m_ObjVBOs[i].Id ? m_ObjVBOs[i].Sz : 0; // out-of-core: not resident
+    for(size_t i=0; i<m_ObjEBOs.size(); i++)
+        stats.gpuIndices += m_ObjEBOs[i].Id ? m_ObjEBOs[i].Sz : 0;
+    stats.gpuUniforms += m_uboObjectMatrices.Sz + m_uboMeshMatrices.Sz + m_uboMaterial.Sz;
+    stats.gpuCommands += m_tokenBufferModel.bufferID ? m_tokenBufferModel.data.size() : 0;
+}
+
+//------------------------------------------------------------------------------
+// Asynchronous loading of many models:
+// loader threads run loadFile() and push the models to s_readyModels;
+// the GL thread drains this queue with uploadReadyModels() within a time budget
+// so that the window keeps on rendering what is already there.
+// Streamed buffer areas keep their loader thread: it inflates the file in the
+// staging ring while the GL thread copies it (s_streamingModels)
+//------------------------------------------------------------------------------
+static std::mutex               s_loadMutex;
+static std::deque<Bk3dModel*>   s_modelsToLoad;
+static std::deque<Bk3dModel*>   s_readyModels;
+static std::deque<Bk3dModel*>   s_streamingModels; // GL thread only
+static std::vector<std::thread> s_loaderThreads;
+static int                      s_modelsPending = 0; // loaded or not, but not yet uploaded
+static bool                     s_stopping = false;  // stopAsyncLoading() began: no more streams
+
+static void loaderThread()
+{
+    while(1)
+    {
+        Bk3dModel* pModel;
+        {
+            std::lock_guard<std::mutex> lock(s_loadMutex);
+            if(s_modelsToLoad.empty())
+                return;
+            pModel = s_modelsToLoad.front();
+            s_modelsToLoad.pop_front();
+        }
+        pModel->loadFile();
+        {
+            std::lock_guard<std::mutex> lock(s_loadMutex);
+            // stopAsyncLoading() may have swept s_readyModels already: the ring
+            // would never come, don't wait for it
+            if(s_stopping)
+                pModel->abortStream();
+            s_readyModels.push_back(pModel);
+        }
+        if(pModel->streaming())
+            pModel->inflateBufferArea();
+    }
+}
+
+void Bk3dModel::startAsyncLoading(const std::vector<Bk3dModel*> &models, int numThreads)
+{
+    stopAsyncLoading();
+    s_stopping = false;
+    s_modelsToLoad.assign(models.begin(), models.end());
+    s_modelsPending = (int)models.size();
+    if(numThreads <= 0)
+        numThreads = (int)std::thread::hardware_concurrency();
+    if(numThreads > (int)models.size())
+        numThreads = (int)models.size();
+    for(int i=0; i<numThreads; i++)
+        s_loaderThreads.push_back(std::thread(loaderThread));
+}
+
+//------------------------------------------------------------------------------
+// to call from the GL thread, once per frame. At least one model gets uploaded
+// each time so that a small budget can't starve the loading.
+// returns the amount of models still being loaded or waiting for their upload
+//------------------------------------------------------------------------------
+int Bk3dModel::uploadReadyModels(float budgetMs)
+{
+    double tStart = sysGetTime();
+    double tEnd = tStart + budgetMs/1000.0;
+    for(size_t i=0; i<s_streamingModels.size(); )
+    {
+        Bk3dModel* pModel = s_streamingModels[i];
+        int r = pModel->streamStep(tEnd);
+        if(r == 0)
+        {
+            i++;
+        } else {
+            s_streamingModels.erase(s_streamingModels.begin() + i);
+            s_modelsPending--;
+            if(r > 0)
+                pModel->finishUpload();
+        }
+        if(sysGetTime() >= tEnd)
+            break;
+    }
+    while(s_modelsPending > (int)s_streamingModels.size())
+    {
+        Bk3dModel* pModel = NULL;
+        {
+            std::lock_guard<std::mutex> lock(s_loadMutex);
+            if(s_readyModels.empty())
+                break;
+            pModel = s_readyModels.front();
+            s_readyModels.pop_front();
+        }
+        if(pModel->uploadModel() && pModel->streaming())
+            s_streamingModels.push_back(pModel);
+        else
+            s_modelsPending--;
+        if(sysGetTime() >= tEnd)
+            break;
+    }
+    if(s_modelsPending == 0)
+        stopAsyncLoading();
+    return s_modelsPending;
+}
+
+bool Bk3dModel::asyncLoadingPending()
+{
+    return s_modelsPending > 0;
+}
+
+//------------------------------------------------------------------------------
+// models that weren't picked-up yet stay unloaded. Ready ones get dropped, as
+// well as the ones being streamed: their loader threads stop inflating
+//------------------------------------------------------------------------------
+void Bk3dModel::stopAsyncLoading()
+{
+    {
+        std::lock_guard<std::mutex> lock(s_loadMutex);
+        s_stopping = true;
+        s_modelsToLoad.clear();
+        for(size_t i=0; i<s_readyModels.size(); i++)
+            s_readyModels[i]->abortStream();
+    }
+    for(size_t i=0; i<s_streamingModels.size(); i++)
+        s_streamingModels[i]->abortStream();
+    for(int i=0; i<s_loaderThreads.size(); i++)
+        s_loaderThreads[i].join();
+    s_loaderThreads.clear();
+    for(size_t i=0; i<s_readyModels.size(); i++)
+        s_readyModels[i]->endStream();
+    for(size_t i=0; i<s_streamingModels.size(); i++)
+        s_streamingModels[i]->endStream();
+    s_readyModels.clear();
+    s_streamingModels.clear();
+    s_modelsPending = 0;
+}
+
 //------------------------------------------------------------------------------
 //
 //------------------------------------------------------------------------------
 void Bk3dModel::displayObject(const mat4f& cameraView, const mat4f projection, GLuint fboMSAA8x, int maxItems)
 {
+    if(!m_bReady)
+        return; // still loading
     NXPROFILEFUNC(__FUNCTION__);
     PROFILE_SECTION(__FUNCTION__);
 
@@ -987,6 +4113,12 @@ void Bk3dModel::displayObject(const mat4f& cameraView, const mat4f projection, G
 	g_globalMatrices.mW.translate(-m_posOffset);
     g_globalMatrices.mW.scale(m_scale);
     glNamedBufferSubDataEXT(g_uboMatrix.Id, 0, sizeof(g_globalMatrices), &g_globalMatrices);
+    //
+    // out-of-core: fetch what gets visible, evict what's too old
+    // a change of the resident set means another recording of the commands
+    //
+    if((g_StreamingBudgetMb > 0) && updateResidency(g_globalMatrices.mVP * g_globalMatrices.mW))
+        m_bRecordObject = true;
 
     // wireframe mode ?
     if(g_bWireframe)
@@ -999,6 +4131,8 @@ void Bk3dModel::displayObject(const mat4f& cameraView, const mat4f projection, G
         //
         if(m_bRecordObject)
             recordTokenBufferObject(fboMSAA8x);
+        else if(m_bRecaptureStates)
+            recaptureStates();
         //
         // execute the commands from the token buffer
         //
@@ -1007,6 +4141,9 @@ void Bk3dModel::displayObject(const mat4f& cameraView, const mat4f projection, G
             //
             // an emulation of what got captured
             //
+            if(g_bDepthPrepass && (m_commandDepth.numItems > 0))
+                emucmdlist::nvtokenRenderStatesSW(&m_commandDepth.dataPtrs[0], &m_commandDepth.sizes[0],
+                    &m_commandDepth.stateGroups[0], &m_commandDepth.fbos[0], int(m_commandDepth.numItems) );
             emucmdlist::nvtokenRenderStatesSW(&m_commandModel.dataPtrs[0], &m_commandModel.sizes[0], 
                 &m_commandModel.stateGroups[0], &m_commandModel.fbos[0], int(m_commandModel.numItems) );
         } else {
@@ -1023,6 +4160,8 @@ void Bk3dModel::displayObject(const mat4f& cameraView, const mat4f projection, G
                 int nitems = int(m_commandModel.numItems);
                 if((maxItems > 0)&&(nitems > maxItems))
                     nitems = maxItems;
+                if(g_bDepthPrepass && (m_commandDepth.numItems > 0))
+                    glDrawCommandsStatesAddressNV(&m_commandDepth.dataGPUPtrs[0], &m_commandDepth.sizes[0], &m_commandDepth.stateGroups[0], &m_commandDepth.fbos[0], int(m_commandDepth.numItems));
                 if(nitems)
                     glDrawCommandsStatesAddressNV(&m_commandModel.dataGPUPtrs[0], &m_commandModel.sizes[0], &m_commandModel.stateGroups[0], &m_commandModel.fbos[0], nitems); 
             }
@@ -1046,10 +4185,20 @@ void Bk3dModel::displayObject(const mat4f& cameraView, const mat4f projection, G
 	    for(int i=g_firstMesh; i< m_meshFile->pMeshes->n; i++)
 	    {
 		    bk3d::Mesh *pMesh = m_meshFile->pMeshes->p[i];
-            int idx = (int)pMesh->userPtr;
-            curVBO = m_ObjVBOs[idx];
-            curEBO = m_ObjEBOs[idx];
-            if(pMesh->pTransforms && (pMesh->pTransforms->n>0))
+            curVBO = m_ObjVBOs[(int)(size_t)pMesh->userPtr];
+            curEBO = m_ObjEBOs[m_meshEBO[i]];
+            if(curVBO.Id == 0)
+                continue; // out-of-core: not resident
+            if(!hasDraws(pMesh))
+                continue; // merged in another mesh (see flattenStatic)
+            int variant = vertexFormat(pMesh) ? MESHSHADER_OCTNORMALS : 0;
+            if(!m_meshMatrix.empty() && (m_meshMatrix[i] != ~0u))
+            {
+                // a matrix of its own (see initMeshTransforms)
+                curTransf = ~0;
+                glBufferAddressRangeNV(GL_UNIFORM_BUFFER_ADDRESS_NV, UBO_MATRIXOBJ, m_uboMeshMatrices.Addr + m_meshMatrix[i] * sizeof(mat4f), sizeof(mat4f));
+            }
+            else if(pMesh->pTransforms && (pMesh->pTransforms->n>0))
             {
 			    bk3d::Bone *pTransf = pMesh->pTransforms->p[0];
                 if(pTransf && (curTransf != pTransf->ID))
@@ -1058,10 +4207,16 @@ void Bk3dModel::displayObject(const mat4f& cameraView, const mat4f projection, G
                     glBufferAddressRangeNV(GL_UNIFORM_BUFFER_ADDRESS_NV, UBO_MATRIXOBJ, m_uboObjectMatrices.Addr + (curTransf * sizeof(MatrixBufferObject)), sizeof(MatrixBufferObject));
                 }
             }
+            else if(curTransf != 0)
+            {
+                // no transformation: the first one of the table, not the one of the previous mesh
+                curTransf = 0;
+                glBufferAddressRangeNV(GL_UNIFORM_BUFFER_ADDRESS_NV, UBO_MATRIXOBJ, m_uboObjectMatrices.Addr, sizeof(MatrixBufferObject));
+            }
             //====> Pos
             bk3d::Attribute* pAttrPos = pMesh->pAttributes->p[0];
             glBindVertexBuffer(0, curVBO.Id, 0, pAttrPos->strideBytes); // essentially for the stride. curVBO.Id shouldn't matter (but solves a low-pri warning in Linux)
-            glVertexAttribFormat(0,pAttrPos->numComp, pAttrPos->formatGL, GL_FALSE, pAttrPos->dataOffsetBytes);
+            glVertexAttribFormat(0,pAttrPos->numComp, pAttrPos->formatGL, variant ? GL_TRUE : GL_FALSE, pAttrPos->dataOffsetBytes);
             glBufferAddressRangeNV(GL_VERTEX_ATTRIB_ARRAY_ADDRESS_NV, 0, 
                 curVBO.Addr + (GLuint64EXT)pMesh->pSlots->p[pAttrPos->slot]->userPtr.p, 
                 pMesh->pSlots->p[pAttrPos->slot]->vtxBufferSizeBytes);
@@ -1081,6 +4236,9 @@ void Bk3dModel::displayObject(const mat4f& cameraView, const mat4f projection, G
             //====> render primitive groups
 		    for(int pg=0; pg<pMesh->pPrimGroups->n; pg++)
 		    {
+                // merged in another group (see processPrimGroups)
+                if(pMesh->pPrimGroups->p[pg]->indexCount == 0)
+                    continue;
                 //
                 // Material: point to the right one in the table
                 //
@@ -1102,24 +4260,17 @@ void Bk3dModel::displayObject(const mat4f& cameraView, const mat4f projection, G
                 //
                 // Set the right shader
                 //
-                if(pMesh->pPrimGroups->p[pg]->topologyGL == GL_LINES) {
-                    glDisable(GL_POLYGON_OFFSET_FILL);
-                    s_shaderMeshLine.bindShader();
-                } else {
-                    glEnable(GL_POLYGON_OFFSET_FILL);
-                    glPolygonOffset(1.0, 1.0); // no issue with redundant call here: the state capture will just deal with simplifying things
-                    s_shaderMesh.bindShader();
-                }
-                if(pMesh->pPrimGroups->p[pg]->pIndexBufferData)
+                bindMeshShader(pMesh->pPrimGroups->p[pg]->topologyGL, variant);
+                if(pMesh->pPrimGroups->p[pg]->indexArrayByteSize > 0)
                 {
 			        glBufferAddressRangeNV(GL_ELEMENT_ARRAY_ADDRESS_NV, 0,
                         curEBO.Addr + (GLuint64EXT)pMesh->pPrimGroups->p[pg]->userPtr,
                         pMesh->pPrimGroups->p[pg]->indexArrayByteSize - pMesh->pPrimGroups->p[pg]->indexArrayByteOffset);
-			        glDrawElements(
+			        glDrawElementsBaseVertex(
 				        pMesh->pPrimGroups->p[pg]->topologyGL,
 				        pMesh->pPrimGroups->p[pg]->indexCount,
 				        pMesh->pPrimGroups->p[pg]->indexFormatGL,
-				        NULL);
+				        NULL, baseVertex(pMesh->pPrimGroups->p[pg]));
                 } else {
 			        glDrawArrays(
 				        pMesh->pPrimGroups->p[pg]->topologyGL,
@@ -1144,18 +4295,32 @@ bool Bk3dModel::initGraphics_bk3d()
     //
     // Shader compilation
     //
-    if(!s_shaderMesh.addVertexShaderFromString(s_glslv_mesh))
-        return false;
-    if(!s_shaderMesh.addFragmentShaderFromString(s_glslf_mesh))
-        return false;
-    if(!s_shaderMesh.link())
-        return false;
-    if(!s_shaderMeshLine.addVertexShaderFromString(s_glslv_mesh))
-        return false;
-    if(!s_shaderMeshLine.addFragmentShaderFromString(s_glslf_mesh_line))
-        return false;
-    if(!s_shaderMeshLine.link())
-        return false;
+    for(int v=0; v<4; v++)
+    {
+        std::string vs = meshVertexShader(v);
+        if(!s_shaderMesh[v].addVertexShaderFromString(vs.c_str()))
+            return false;
+        if(!s_shaderMesh[v].addFragmentShaderFromString(s_glslf_mesh))
+            return false;
+        if(!s_shaderMesh[v].link())
+            return false;
+        if(!s_shaderMeshLine[v].addVertexShaderFromString(vs.c_str()))
+            return false;
+        if(!s_shaderMeshLine[v].addFragmentShaderFromString(s_glslf_mesh_line))
+            return false;
+        if(!s_shaderMeshLine[v].link())
+            return false;
+    }
+    for(int v=0; v<2; v++)
+    {
+        std::string vs = meshVertexShader(v, true);
+        if(!s_shaderMeshDepth[v].addVertexShaderFromString(vs.c_str()))
+            return false;
+        if(!s_shaderMeshDepth[v].addFragmentShaderFromString(s_glslf_mesh_depth))
+            return false;
+        if(!s_shaderMeshDepth[v].link())
+            return false;
+    }
     return true;
 }
 
@@ -121,6 +121,7 @@ static const char* s_sampleHelp =
 static const char* s_sampleHelpCmdLine = 
     "---------- Cmd-line arguments ----------\n"
     "-v <VBO max Size>\n-m <bk3d model>\n"
+    "-e <EBO max Size>\n"
     "-c 0 or 1 : use command-lists\n"
     "-b 0 or 1 : use bindless when no cmd list\n"
     "-o 0 or 1 : display meshes\n"
@@ -134,6 +135,27 @@ static const char* s_sampleHelpCmdLine =
     "<bk3d>    : load a specific model\n"
     "-q <msaa> : MSAA\n"
     "-r <ss_val> : supersampling (1.0,1.5,2.0)\n"
+    "-f 0 or 1 : memory-map uncompressed bk3d files\n"
+    "-t <n> : threads inflating chunked (.bk3dc) files (0: all)\n"
+    "-L 0 or 1 : load models in the background\n"
+    "-B <ms> : time per frame for uploading loaded models\n"
+    "-S 0 or 1 : stream vertex/index data to the GPU through a staging ring\n"
+    "-C <folder> : cache of processed models\n"
+    "-O <Mb> : out-of-core meshes, with this GPU memory budget per model\n"
+    "-P <file.bk3dp> : pack archive to take the models from\n"
+    "-I 0 or 1 : narrow 32 bits indices to 16 bits when possible\n"
+    "-M 0 or 1 : convert strips/fans/loops to lists and merge primitive groups of a mesh\n"
+    "-N 0 or 1 : store meshes with the same geometry once and draw them as instances\n"
+    "-Q 0, 1 or 2 : compact vertices. 1: 16 bits positions and normals (12 bytes); 2: 8 bits normals (8 bytes)\n"
+    "-F 0 or 1 : flatten static meshes in the model space and merge them by material\n"
+    "-H <Mb> : buffer objects of all models taken from a shared heap of buffers of this size (0: off)\n"
+    "-D 0 or 1 : compact the geometry heap rather than growing it when fragmented\n"
+    "-R 0 or 1 : free the vertex and index data of the models once uploaded\n"
+    "-z 0 or 1 : tightly packed position-only stream of the meshes and depth-only commands\n"
+    "-Z 0 or 1 : depth prepass before the shaded pass, with command-lists (implies -z 1)\n"
+    "-T <n> : threads recording the token buffers (0: all)\n"
+    "-p 0 or 1 : drop redundant tokens once recorded\n"
+    "-K <fields> : sort key of the draws when sorting, most significant first (default tsfmx)\n"
     "----------------------------------------\n"
 ;
 
@@ -497,51 +519,28 @@ void initTokenInternals()
 }
 
 //------------------------------------------------------------------------------
-// build 
+// token writers: each token is made in place, at the end of the stream
 //------------------------------------------------------------------------------
-std::string buildLineWidthCommand(float w)
+void TokenStream::lineWidth(float w)
 {
-    std::string cmd;
-    Token_LineWidth lw;
-    lw.cmd.lineWidth = w;
-    cmd = std::string((const char*)&lw,sizeof(Token_LineWidth));
-
-    return cmd;
+    emit<Token_LineWidth>().cmd.lineWidth = w;
 }
-//------------------------------------------------------------------------------
-// build 
-//------------------------------------------------------------------------------
-std::string buildUniformAddressCommand(int idx, GLuint64 p, GLsizeiptr sizeBytes, ShaderStages stage)
+void TokenStream::uniformAddress(int idx, GLuint64 p, GLsizeiptr sizeBytes, ShaderStages stage)
 {
-    std::string cmd;
-    Token_UniformAddress attr;
+    Token_UniformAddress &attr = emit<Token_UniformAddress>();
     attr.cmd.stage = s_stages[stage];
     attr.cmd.index = idx;
     ((GLuint64EXT*)&attr.cmd.addressLo)[0] = p;
-    cmd = std::string((const char*)&attr,sizeof(Token_UniformAddress));
-
-    return cmd;
 }
-//------------------------------------------------------------------------------
-// build 
-//------------------------------------------------------------------------------
-std::string buildAttributeAddressCommand(int idx, GLuint64 p, GLsizeiptr sizeBytes)
+void TokenStream::attributeAddress(int idx, GLuint64 p, GLsizeiptr sizeBytes)
 {
-    std::string cmd;
-    Token_AttributeAddress attr;
+    Token_AttributeAddress &attr = emit<Token_AttributeAddress>();
     attr.cmd.index = idx;
     ((GLuint64EXT*)&attr.cmd.addressLo)[0] = p;
-    cmd = std::string((const char*)&attr,sizeof(Token_AttributeAddress));
-
-    return cmd;
 }
-//------------------------------------------------------------------------------
-// build 
-//------------------------------------------------------------------------------
-std::string buildElementAddressCommand(GLuint64 ptr, GLenum indexFormatGL)
+void TokenStream::elementAddress(GLuint64 ptr, GLenum indexFormatGL)
 {
-    std::string cmd;
-    Token_ElementAddress attr;
+    Token_ElementAddress &attr = emit<Token_ElementAddress>();
     ((GLuint64EXT*)&attr.cmd.addressLo)[0] = ptr;
     switch(indexFormatGL)
     {
@@ -552,132 +551,320 @@ std::string buildElementAddressCommand(GLuint64 ptr, GLenum indexFormatGL)
         attr.cmd.typeSizeInByte = 2;
         break;
     }
-    cmd = std::string((const char*)&attr,sizeof(Token_AttributeAddress));
-
-    return cmd;
 }
-//------------------------------------------------------------------------------
-// 
-//------------------------------------------------------------------------------
-std::string buildDrawElementsCommand(GLenum topologyGL, GLuint indexCount)
+void TokenStream::drawElements(GLenum topologyGL, GLuint indexCount, GLuint baseVertex)
 {
-    std::string cmd;
-    Token_DrawElements dc;
-    Token_DrawElementsStrip dcstrip;
     switch(topologyGL)
     {
     case GL_TRIANGLE_STRIP:
     case GL_QUAD_STRIP:
     case GL_LINE_STRIP:
-        dcstrip.cmd.baseVertex = 0;
-        dcstrip.cmd.firstIndex = 0;
-        dcstrip.cmd.count = indexCount;
-        cmd = std::string((const char*)&dcstrip,sizeof(Token_DrawElementsStrip));
+        {
+            Token_DrawElementsStrip &dcstrip = emit<Token_DrawElementsStrip>();
+            dcstrip.cmd.baseVertex = baseVertex;
+            dcstrip.cmd.count = indexCount;
+        }
         break;
     default:
-        dc.cmd.baseVertex = 0;
-        dc.cmd.firstIndex = 0;
-        dc.cmd.count = indexCount;
-        cmd = std::string((const char*)&dc,sizeof(Token_DrawElements));
+        {
+            Token_DrawElements &dc = emit<Token_DrawElements>();
+            dc.cmd.baseVertex = baseVertex;
+            dc.cmd.count = indexCount;
+        }
         break;
     }
-    return cmd;
 }
-//------------------------------------------------------------------------------
-// 
-//------------------------------------------------------------------------------
-std::string buildDrawArraysCommand(GLenum topologyGL, GLuint indexCount)
+void TokenStream::drawArrays(GLenum topologyGL, GLuint indexCount)
 {
-    std::string cmd;
-    Token_DrawArrays dc;
-    Token_DrawArraysStrip dcstrip;
     switch(topologyGL)
     {
     case GL_TRIANGLE_STRIP:
     case GL_QUAD_STRIP:
     case GL_LINE_STRIP:
-        dcstrip.cmd.first = 0;
-        dcstrip.cmd.count = indexCount;
-        cmd = std::string((const char*)&dcstrip,sizeof(Token_DrawArraysStrip));
+        emit<Token_DrawArraysStrip>().cmd.count = indexCount;
         break;
     default:
-        dc.cmd.first = 0;
-        dc.cmd.count = indexCount;
-        cmd = std::string((const char*)&dc,sizeof(Token_DrawArrays));
+        emit<Token_DrawArrays>().cmd.count = indexCount;
         break;
     }
-    return cmd;
 }
-
-//------------------------------------------------------------------------------
-// 
-//------------------------------------------------------------------------------
-std::string buildViewportCommand(GLint x, GLint y, GLsizei width, GLsizei height)
+// instanceCount copies of the same primitive group: gl_InstanceID tells which
+void TokenStream::drawElementsInstanced(GLenum topologyGL, GLuint indexCount, GLuint instanceCount, GLuint baseVertex)
 {
-    std::string cmd;
-    Token_Viewport dc;
+    Token_DrawElemsInstanced &dc = emit<Token_DrawElemsInstanced>();
+    dc.cmd.mode = topologyGL;
+    dc.cmd.count = indexCount;
+    dc.cmd.instanceCount = instanceCount;
+    dc.cmd.baseVertex = baseVertex;
+}
+void TokenStream::drawArraysInstanced(GLenum topologyGL, GLuint indexCount, GLuint instanceCount)
+{
+    Token_DrawArraysInstanced &dc = emit<Token_DrawArraysInstanced>();
+    dc.cmd.mode = topologyGL;
+    dc.cmd.count = indexCount;
+    dc.cmd.instanceCount = instanceCount;
+}
+void TokenStream::viewport(GLint x, GLint y, GLsizei width, GLsizei height)
+{
+    Token_Viewport &dc = emit<Token_Viewport>();
     dc.cmd.x = x;
     dc.cmd.y = y;
     dc.cmd.width = width;
     dc.cmd.height = height;
-    cmd = std::string((const char*)&dc,sizeof(Token_Viewport));
-    return cmd;
 }
-
-//------------------------------------------------------------------------------
-// 
-//------------------------------------------------------------------------------
-std::string buildBlendColorCommand(GLclampf red,GLclampf green,GLclampf blue,GLclampf alpha)
+void TokenStream::blendColor(GLclampf red,GLclampf green,GLclampf blue,GLclampf alpha)
 {
-    std::string cmd;
-    Token_BlendColor dc;
+    Token_BlendColor &dc = emit<Token_BlendColor>();
     dc.cmd.red = red;
     dc.cmd.green = green;
     dc.cmd.blue = blue;
     dc.cmd.alpha = alpha;
-    cmd = std::string((const char*)&dc,sizeof(Token_BlendColor));
-    return cmd;
 }
-
-//------------------------------------------------------------------------------
-// 
-//------------------------------------------------------------------------------
-std::string buildStencilRefCommand(GLuint frontStencilRef, GLuint backStencilRef)
+void TokenStream::stencilRef(GLuint frontStencilRef, GLuint backStencilRef)
 {
-    std::string cmd;
-    Token_StencilRef dc;
+    Token_StencilRef &dc = emit<Token_StencilRef>();
     dc.cmd.frontStencilRef = frontStencilRef;
     dc.cmd.backStencilRef = backStencilRef;
-    cmd = std::string((const char*)&dc,sizeof(Token_StencilRef));
-    return cmd;
 }
-
-//------------------------------------------------------------------------------
-// 
-//------------------------------------------------------------------------------
-std::string buildPolygonOffsetCommand(GLfloat scale, GLfloat bias)
+void TokenStream::polygonOffset(GLfloat scale, GLfloat bias)
 {
-    std::string cmd;
-    Token_PolygonOffset dc;
+    Token_PolygonOffset &dc = emit<Token_PolygonOffset>();
     dc.cmd.bias = bias;
     dc.cmd.scale = scale;
-    cmd = std::string((const char*)&dc,sizeof(Token_PolygonOffset));
-    return cmd;
 }
-
-//------------------------------------------------------------------------------
-// 
-//------------------------------------------------------------------------------
-std::string buildScissorCommand(GLint x, GLint y, GLsizei width, GLsizei height)
+void TokenStream::scissor(GLint x, GLint y, GLsizei width, GLsizei height)
 {
-    std::string cmd;
-    Token_Scissor dc;
+    Token_Scissor &dc = emit<Token_Scissor>();
     dc.cmd.x = x;
     dc.cmd.y = y;
     dc.cmd.width = width;
     dc.cmd.height = height;
-    cmd = std::string((const char*)&dc,sizeof(Token_Scissor));
-    return cmd;
+}
+
+//------------------------------------------------------------------------------
+// build: one token in a string. The writers above, on the stack
+//------------------------------------------------------------------------------
+#define BUILD_TOKEN(call) \
+    char buf[64]; \
+    TokenStream ts(buf, sizeof(buf)); \
+    ts.call; \
+    return std::string(buf, ts.size());
+
+std::string buildLineWidthCommand(float w)
+{ BUILD_TOKEN(lineWidth(w)) }
+std::string buildUniformAddressCommand(int idx, GLuint64 p, GLsizeiptr sizeBytes, ShaderStages stage)
+{ BUILD_TOKEN(uniformAddress(idx, p, sizeBytes, stage)) }
+std::string buildAttributeAddressCommand(int idx, GLuint64 p, GLsizeiptr sizeBytes)
+{ BUILD_TOKEN(attributeAddress(idx, p, sizeBytes)) }
+std::string buildElementAddressCommand(GLuint64 ptr, GLenum indexFormatGL)
+{ BUILD_TOKEN(elementAddress(ptr, indexFormatGL)) }
+std::string buildDrawElementsCommand(GLenum topologyGL, GLuint indexCount, GLuint baseVertex)
+{ BUILD_TOKEN(drawElements(topologyGL, indexCount, baseVertex)) }
+std::string buildDrawArraysCommand(GLenum topologyGL, GLuint indexCount)
+{ BUILD_TOKEN(drawArrays(topologyGL, indexCount)) }
+std::string buildDrawElementsInstancedCommand(GLenum topologyGL, GLuint indexCount, GLuint instanceCount, GLuint baseVertex)
+{ BUILD_TOKEN(drawElementsInstanced(topologyGL, indexCount, instanceCount, baseVertex)) }
+std::string buildDrawArraysInstancedCommand(GLenum topologyGL, GLuint indexCount, GLuint instanceCount)
+{ BUILD_TOKEN(drawArraysInstanced(topologyGL, indexCount, instanceCount)) }
+std::string buildViewportCommand(GLint x, GLint y, GLsizei width, GLsizei height)
+{ BUILD_TOKEN(viewport(x, y, width, height)) }
+std::string buildBlendColorCommand(GLclampf red,GLclampf green,GLclampf blue,GLclampf alpha)
+{ BUILD_TOKEN(blendColor(red, green, blue, alpha)) }
+std::string buildStencilRefCommand(GLuint frontStencilRef, GLuint backStencilRef)
+{ BUILD_TOKEN(stencilRef(frontStencilRef, backStencilRef)) }
+std::string buildPolygonOffsetCommand(GLfloat scale, GLfloat bias)
+{ BUILD_TOKEN(polygonOffset(scale, bias)) }
+std::string buildScissorCommand(GLint x, GLint y, GLsizei width, GLsizei height)
+{ BUILD_TOKEN(scissor(x, y, width, height)) }
+#undef BUILD_TOKEN
+
+//------------------------------------------------------------------------------
+// token of a header. GL_MAX_COMMANDS_NV if unknown
+//------------------------------------------------------------------------------
+static GLuint tokenID(GLuint header)
+{
+    for(GLuint i=0; i<GL_MAX_COMMANDS_NV; i++)
+        if(s_header[i] == header)
+            return i;
+    return GL_MAX_COMMANDS_NV;
+}
+//------------------------------------------------------------------------------
+// bytes from addr to the end of the buffer object holding it. 0 if none does
+//------------------------------------------------------------------------------
+static GLuint64 rangeAfter(const std::vector<BO> &ranges, GLuint64 addr)
+{
+    for(size_t i=0; i<ranges.size(); i++)
+        if((addr >= ranges[i].Addr) && (addr < ranges[i].Addr + (GLuint64)ranges[i].Sz))
+            return ranges[i].Addr + (GLuint64)ranges[i].Sz - addr;
+    return 0;
+}
+//------------------------------------------------------------------------------
+// Peephole pass over recorded tokens, batch by batch: what a batch sets isn't
+// assumed to be there in the next one
+// - attribute and uniform addresses already set get dropped
+// - an element address further in the index buffer already set, with the same
+//   index size and within the same buffer object of elementRanges, gets dropped:
+//   the draws after it get the difference in firstIndex. Element address tokens
+//   have no size: the range bound is the rest of the buffer object the address
+//   set is in. A draw which indices would go past it gets its element address
+//   back. Addresses out of elementRanges never get folded
+// - NOPs get dropped
+// offsets and sizes: of the batches, updated. Tokens out of them are dropped.
+// marks: offsets of tokens to follow (see Bk3dModel::m_tokenPatches)
+// baseVertex isn't used: strides of the vertices aren't in the tokens but in
+// the state objects
+//------------------------------------------------------------------------------
+TokenOptStats optimizeTokens(TokenStream &ts, std::vector<int> &offsets, GLsizei* sizes, std::vector<size_t> &marks, const std::vector<BO> &elementRanges)
+{
+    TokenOptStats stats;
+    memset(&stats, 0, sizeof(TokenOptStats));
+    stats.bytesIn = ts.size();
+    TokenStream out;
+    out.reserve(ts.size());
+    std::vector<size_t> newMarks(marks);
+    for(size_t b=0; b<offsets.size(); b++)
+    {
+        size_t cur = offsets[b];
+        size_t end = cur + sizes[b];
+        size_t newOffset = out.size();
+        GLuint64    attribs[16];
+        bool        attribSet[16] = { false };
+        std::vector< std::pair<GLuint, GLuint64> > uniforms; // (stage << 16 | index), address
+        GLuint64    elements = 0;
+        GLuint64    elementRange = 0;   // bytes of the buffer object from elements on
+        GLuint      elementSz = 0;      // 0: no element address set
+        GLuint      firstIndex = 0;     // to add to the draws
+        const GLuint* folded = NULL;    // element address token dropped for firstIndex
+        while(cur < end)
+        {
+            const GLuint* header = (const GLuint*)&ts[cur];
+            GLuint id = tokenID(*header);
+            if(id == GL_MAX_COMMANDS_NV)
+            {
+                // don't know what it is: the rest stays as it is
+                out.append(&ts[cur], end - cur);
+                break;
+            }
+            size_t sz = s_headerSizes[id];
+            stats.tokensIn++;
+            bool bKeep = true;
+            switch(id)
+            {
+            case GL_NOP_COMMAND_NV:
+                bKeep = false;
+                break;
+            case GL_ATTRIBUTE_ADDRESS_COMMAND_NV:
+                {
+                    const AttributeAddressCommandNV* cmd = (const AttributeAddressCommandNV*)header;
+                    GLuint64 addr = *(const GLuint64*)&cmd->addressLo;
+                    if((cmd->index < 16) && attribSet[cmd->index] && (attribs[cmd->index] == addr))
+                    {
+                        bKeep = false;
+                        stats.attrDropped++;
+                    }
+                    else if(cmd->index < 16)
+                    {
+                        attribSet[cmd->index] = true;
+                        attribs[cmd->index] = addr;
+                    }
+                }
+                break;
+            case GL_UNIFORM_ADDRESS_COMMAND_NV:
+                {
+                    const UniformAddressCommandNV* cmd = (const UniformAddressCommandNV*)header;
+                    GLuint key = ((GLuint)cmd->stage << 16) | cmd->index;
+                    GLuint64 addr = *(const GLuint64*)&cmd->addressLo;
+                    size_t u = 0;
+                    while((u < uniforms.size()) && (uniforms[u].first != key))
+                        u++;
+                    if(u == uniforms.size())
+                        uniforms.push_back(std::pair<GLuint, GLuint64>(key, addr));
+                    else if(uniforms[u].second == addr)
+                    {
+                        bKeep = false;
+                        stats.uniformDropped++;
+                    }
+                    else
+                        uniforms[u].second = addr;
+                }
+                break;
+            case GL_ELEMENT_ADDRESS_COMMAND_NV:
+                {
+                    const ElementAddressCommandNV* cmd = (const ElementAddressCommandNV*)header;
+                    GLuint64 addr = *(const GLuint64*)&cmd->addressLo;
+                    GLuint64 d = addr - elements;
+                    if(elementSz && (cmd->typeSizeInByte == elementSz) && (addr >= elements) && (d < elementRange)
+                      && ((d % elementSz) == 0) && (d / elementSz < 0x80000000ULL))
+                    {
+                        bKeep = false;
+                        folded = header;
+                        firstIndex = (GLuint)(d / elementSz);
+                        if(firstIndex)
+                            stats.elementsFolded++;
+                    } else {
+                        elements = addr;
+                        elementRange = rangeAfter(elementRanges, addr);
+                        elementSz = cmd->typeSizeInByte;
+                        firstIndex = 0;
+                        folded = NULL;
+                    }
+                }
+                break;
+            case GL_DRAW_ELEMENTS_COMMAND_NV:
+            case GL_DRAW_ELEMENTS_STRIP_COMMAND_NV:
+            case GL_DRAW_ELEMENTS_INSTANCED_COMMAND_NV:
+                {
+                    GLuint count = id == GL_DRAW_ELEMENTS_INSTANCED_COMMAND_NV ?
+                        ((const DrawElementsInstancedCommandNV*)header)->count : ((const DrawElementsCommandNV*)header)->count;
+                    if(folded && (((GLuint64)firstIndex + count) * elementSz > elementRange))
+                    {
+                        // past the range the element address was set for: set it again
+                        const ElementAddressCommandNV* cmd = (const ElementAddressCommandNV*)folded;
+                        out.append(folded, s_headerSizes[GL_ELEMENT_ADDRESS_COMMAND_NV]);
+                        stats.tokensOut++;
+                        if(firstIndex)
+                            stats.elementsFolded--;
+                        elements = *(const GLuint64*)&cmd->addressLo;
+                        elementRange = rangeAfter(elementRanges, elements);
+                        firstIndex = 0;
+                        folded = NULL;
+                    }
+                }
+                break;
+            }
+            if(!bKeep)
+            {
+                cur += sz;
+                continue;
+            }
+            for(size_t m=0; m<marks.size(); m++)
+                if(marks[m] == cur)
+                    newMarks[m] = out.size();
+            char* p = (char*)out.alloc(sz);
+            memcpy(p, header, sz);
+            if(firstIndex)
+            {
+                switch(id)
+                {
+                case GL_DRAW_ELEMENTS_COMMAND_NV:
+                case GL_DRAW_ELEMENTS_STRIP_COMMAND_NV:
+                    ((DrawElementsCommandNV*)p)->firstIndex += firstIndex;
+                    break;
+                case GL_DRAW_ELEMENTS_INSTANCED_COMMAND_NV:
+                    ((DrawElementsInstancedCommandNV*)p)->firstIndex += firstIndex;
+                    break;
+                }
+            }
+            stats.tokensOut++;
+            cur += sz;
+        }
+        offsets[b] = (int)newOffset;
+        sizes[b] = (GLsizei)(out.size() - newOffset);
+    }
+    marks = newMarks;
+    ts.swap(out);
+    stats.bytesOut = ts.size();
+    return stats;
 }
 
 //------------------------------------------------------------------------------
@@ -769,17 +956,17 @@ bool recordTokenBufferGrid(GLuint fbo)
     // - assign a VBO address to attribute 0 (only one needed here)
     // - issue draw commands
     //
-    std::string data = buildUniformAddressCommand(UBO_MATRIX, g_uboMatrix.Addr, g_uboMatrix.Sz, STAGE_VERTEX);
-    data            += buildUniformAddressCommand(UBO_LIGHT, g_uboLight.Addr, g_uboLight.Sz, STAGE_FRAGMENT);
-    data            += buildAttributeAddressCommand(0, s_vboGridAddr, s_vboGridSz);
-    data            += buildDrawArraysCommand(GL_LINES, GRIDDEF*4);
+    TokenStream &data = s_tokenBufferGrid.data;         // token buffer containing commands
+    data.uniformAddress(UBO_MATRIX, g_uboMatrix.Addr, g_uboMatrix.Sz, STAGE_VERTEX);
+    data.uniformAddress(UBO_LIGHT, g_uboLight.Addr, g_uboLight.Sz, STAGE_FRAGMENT);
+    data.attributeAddress(0, s_vboGridAddr, s_vboGridSz);
+    data.drawArrays(GL_LINES, GRIDDEF*4);
     //
     // build another drawcall for the target cross
     //
-    data            += buildLineWidthCommand(4.0);
-    data            += buildAttributeAddressCommand(0, s_vboCrossAddr, s_vboCrossSz);
-    data            += buildDrawArraysCommand(GL_LINES, 6);
-    s_tokenBufferGrid.data = data;                      // token buffer containing commands
+    data.lineWidth(4.0);
+    data.attributeAddress(0, s_vboCrossAddr, s_vboCrossSz);
+    data.drawArrays(GL_LINES, 6);
     //
     // Create a state and capture the state-machine of OpenGL
     // *ALL* previously declared states will be taken, plus the topology passed as argument
@@ -966,14 +1153,9 @@ void TW_CALL setMSAAModeCB(const void *value, void * clientData)
     MyWindow* p = reinterpret_cast<MyWindow*>(clientData);
     p->m_fboBox.resize(p->m_winSz[0], p->m_winSz[1], g_Supersampling, s_MSAA);
     p->m_fboBox.MakeResourcesResident();
-    FOREACHMODEL(update_fbo_target(p->m_fboBox.GetFBO()));
-    // the comman-list needs to be rebuilt when FBO's resources changed
-    #if 1
-    FOREACHMODEL(invalidateCmdList());
+    // the tokens depending on the FBO get patched and the states get captured again
+    FOREACHMODEL(patchTargets(p->m_fboBox.GetFBO(), g_Supersampling));
     s_bRecordGrid = true;
-    #else
-    init_command_list();
-    #endif
 }
 void TW_CALL getMSAAModeCB(void *value, void * /*clientData*/)
 {
@@ -992,14 +1174,9 @@ void TW_CALL setSSModeCB(const void *value, void * clientData)
     //
     // remember that commands must know which FBO is targeted
     //
-    FOREACHMODEL(update_fbo_target(p->m_fboBox.GetFBO()));
-    // the comman-list needs to be rebuilt when FBO's resources changed
-    #if 1
-    FOREACHMODEL(invalidateCmdList());
+    // the tokens depending on the FBO get patched and the states get captured again
+    FOREACHMODEL(patchTargets(p->m_fboBox.GetFBO(), g_Supersampling));
     s_bRecordGrid = true;
-    #else
-    init_command_list();
-    #endif
 }
 void TW_CALL getSSModeCB(void *value, void * /*clientData*/)
 {
@@ -1147,7 +1324,7 @@ bool MyWindow::init()
              contained=true", m_winSz[0]-320, m_winSz[1]-320);
     TwDefine(strDef);
 
-    TwEnumVal clModes[2] = {{0, "Unsorted primitive types"},{1, "Sort on primitive types"}};
+    TwEnumVal clModes[2] = {{0, "Unsorted primitive types"},{1, "Sort on states"}};
     TwType clModesEnum = TwDefineEnum("clModesEnum", &(clModes[0]), 2 );
     TwAddVarCB(tweakBar, "CLMode", clModesEnum, setCLModeCB, getCLModeCB, NULL, "label='command-list mode'");
 
@@ -1196,8 +1373,9 @@ void updateViewportTokenBufferAndLineWidth(GLint x, GLint y, GLsizei width, GLsi
     if(g_tokenBufferViewport.bufferAddr == NULL)
     {
         // first time: create
-        g_tokenBufferViewport.data  = buildViewportCommand(x,y,width, height);
-        g_tokenBufferViewport.data  += buildLineWidthCommand(lineW);
+        g_tokenBufferViewport.data.clear();
+        g_tokenBufferViewport.data.viewport(x,y,width, height);
+        g_tokenBufferViewport.data.lineWidth(lineW);
         glGenBuffers(1, &g_tokenBufferViewport.bufferID);
         glNamedBufferDataEXT(
             g_tokenBufferViewport.bufferID, 
@@ -1231,6 +1409,33 @@ void updateViewportTokenBufferAndLineWidth(GLint x, GLint y, GLsizei width, GLsi
     }
 }
 //------------------------------------------------------------------------------
+// check if the first model failed and try a last trick
+//------------------------------------------------------------------------------
+void loadBackupModel()
+{
+    if(!s_bk3dModels[0]->loaded())
+    {
+        LOGW("Note: couldn't find " MODELNAME ". You can get models by *UN-checking* cmake option 'MODELS_DOWNLOAD_DISABLED'\n");
+        LOGW("This will wget some big models for more testing, such as "MODELNAME"\n");
+        g_myWindow.m_camera.focusPos = vec3f(0,0,-0.6); // to adjust to Smobby_134.bk3d.gz
+        s_bk3dModels[0]->loadModel(MODELNAMEBACKUP);
+    }
+}
+//------------------------------------------------------------------------------
+// memory taken by all the models, by category
+//------------------------------------------------------------------------------
+void printMemoryStats()
+{
+    Bk3dModel::MemoryStats ms;
+    memset(&ms, 0, sizeof(ms));
+    FOREACHMODEL(addMemoryStats(ms));
+    const float Mb = 1024.0f*1024.0f;
+    LOGI("Host memory: %.2f Mb of nodes, %.2f Mb of geometry, %.2f Mb mapped, %.2f Mb of commands\n",
+        ms.hostNodes/Mb, ms.hostGeometry/Mb, ms.hostMapped/Mb, ms.hostCommands/Mb);
+    LOGI("GPU memory: %.2f Mb of vertices, %.2f Mb of indices, %.2f Mb of uniforms, %.2f Mb of commands\n",
+        ms.gpuVertices/Mb, ms.gpuIndices/Mb, ms.gpuUniforms/Mb, ms.gpuCommands/Mb);
+}
+//------------------------------------------------------------------------------
 //
 //------------------------------------------------------------------------------
 bool initGraphics()
@@ -1271,14 +1476,14 @@ bool initGraphics()
     // 3D Model shared stuff (shaders)
     //
     Bk3dModel::initGraphics_bk3d();
-    FOREACHMODEL(loadModel());
-    // check if the first one failed and try a last trick
-    if(!s_bk3dModels[0]->loaded())
+    if(g_bAsyncLoading)
     {
-        LOGW("Note: couldn't find " MODELNAME ". You can get models by *UN-checking* cmake option 'MODELS_DOWNLOAD_DISABLED'\n");
-        LOGW("This will wget some big models for more testing, such as "MODELNAME"\n");
-        g_myWindow.m_camera.focusPos = vec3f(0,0,-0.6); // to adjust to Smobby_134.bk3d.gz
-        s_bk3dModels[0]->loadModel(MODELNAMEBACKUP);
+        // models will show-up as they get ready (see MyWindow::display())
+        Bk3dModel::startAsyncLoading(s_bk3dModels);
+    } else {
+        FOREACHMODEL(loadModel());
+        loadBackupModel();
+        printMemoryStats();
     }
     //
     // Creation of the buffer object for the Grid
@@ -1299,6 +1504,7 @@ void MyWindow::shutdown()
 
 	m_fboBox.Finish();
 
+    Bk3dModel::stopAsyncLoading();
     for(int i=0; i<s_bk3dModels.size(); i++)
     {
         delete s_bk3dModels[i];
@@ -1441,6 +1647,9 @@ void MyWindow::keyboardchar( unsigned char key, int mods, int x, int y )
             break;
         s_bk3dModels[s_curObject]->printPosition();
     break;
+    case '3': // memory taken by the models
+        printMemoryStats();
+    break;
     case '0':
         m_bAdjustTimeScale = true;
     case 'h':
@@ -1461,6 +1670,19 @@ void MyWindow::display()
   WindowInertiaCamera::display();
   float dt = (float)m_realtime.getTiming();
   //
+  // models loaded in the background: upload the ones that are ready
+  //
+  if(Bk3dModel::asyncLoadingPending())
+  {
+      if(Bk3dModel::uploadReadyModels(g_LoadBudgetMs) == 0)
+      {
+          loadBackupModel();
+          printMemoryStats();
+      }
+      else
+          postRedisplay(); // keep on draining the queue
+  }
+  //
   // Simple camera change for animation
   //
   if(s_bCameraAnim)
@@ -1689,6 +1911,12 @@ int sample_main(int argc, const char** argv)
             g_MaxBOSz = atoi(argv[++i]);
             LOGI("VBO max Size set to %dMb\n", g_MaxBOSz);
             break;
+        case 'e':
+            if(i == argc-1)
+                return false;
+            g_MaxEBOSz = atoi(argv[++i]);
+            LOGI("EBO max Size set to %dMb\n", g_MaxEBOSz);
+            break;
         case 'm':
             if(i == argc-1)
                 return false;
@@ -1744,6 +1972,130 @@ int sample_main(int argc, const char** argv)
 #endif
             LOGI("g_Supersampling set to %.2f\n", g_Supersampling);
             break;
+        case 'f':
+            g_bUseFileMapping = atoi(argv[++i]) ? true : false;
+            LOGI("g_bUseFileMapping set to %s\n", g_bUseFileMapping ? "true":"false");
+            break;
+        case 't':
+            if(i == argc-1)
+                return false;
+            g_LoadThreads = atoi(argv[++i]);
+            LOGI("g_LoadThreads set to %d\n", g_LoadThreads);
+            break;
+        case 'L':
+            g_bAsyncLoading = atoi(argv[++i]) ? true : false;
+            LOGI("g_bAsyncLoading set to %s\n", g_bAsyncLoading ? "true":"false");
+            break;
+        case 'S':
+            g_bStreamUpload = atoi(argv[++i]) ? true : false;
+            LOGI("g_bStreamUpload set to %s\n", g_bStreamUpload ? "true":"false");
+            break;
+        case 'C':
+            if(i == argc-1)
+                return false;
+            g_CacheDir = std::string(argv[++i]);
+            LOGI("g_CacheDir set to %s\n", g_CacheDir.c_str());
+            break;
+        case 'O':
+            if(i == argc-1)
+                return false;
+            g_StreamingBudgetMb = atoi(argv[++i]);
+            LOGI("g_StreamingBudgetMb set to %d\n", g_StreamingBudgetMb);
+            break;
+        case 'P':
+            if(i == argc-1)
+                return false;
+            g_PackFile = std::string(argv[++i]);
+            LOGI("g_PackFile set to %s\n", g_PackFile.c_str());
+            break;
+        case 'I':
+            if(i == argc-1)
+                return false;
+            g_bCompactIndices = atoi(argv[++i]) ? true : false;
+            LOGI("g_bCompactIndices set to %s\n", g_bCompactIndices ? "true":"false");
+            break;
+        case 'M':
+            if(i == argc-1)
+                return false;
+            g_bMergePrimGroups = atoi(argv[++i]) ? true : false;
+            LOGI("g_bMergePrimGroups set to %s\n", g_bMergePrimGroups ? "true":"false");
+            break;
+        case 'N':
+            if(i == argc-1)
+                return false;
+            g_bInstancing = atoi(argv[++i]) ? true : false;
+            LOGI("g_bInstancing set to %s\n", g_bInstancing ? "true":"false");
+            break;
+        case 'Q':
+            if(i == argc-1)
+                return false;
+            g_QuantizeVertices = atoi(argv[++i]);
+            if((g_QuantizeVertices < VTXQUANT_NONE) || (g_QuantizeVertices > VTXQUANT_OCT8))
+                g_QuantizeVertices = VTXQUANT_NONE;
+            LOGI("g_QuantizeVertices set to %d\n", g_QuantizeVertices);
+            break;
+        case 'F':
+            if(i == argc-1)
+                return false;
+            g_bFlattenStatic = atoi(argv[++i]) ? true : false;
+            LOGI("g_bFlattenStatic set to %s\n", g_bFlattenStatic ? "true":"false");
+            break;
+        case 'H':
+            if(i == argc-1)
+                return false;
+            g_GeometryHeapMb = atoi(argv[++i]);
+            LOGI("g_GeometryHeapMb set to %d\n", g_GeometryHeapMb);
+            break;
+        case 'D':
+            if(i == argc-1)
+                return false;
+            g_bHeapCompaction = atoi(argv[++i]) ? true : false;
+            LOGI("g_bHeapCompaction set to %s\n", g_bHeapCompaction ? "true":"false");
+            break;
+        case 'R':
+            if(i == argc-1)
+                return false;
+            g_bReleaseGeometry = atoi(argv[++i]) ? true : false;
+            LOGI("g_bReleaseGeometry set to %s\n", g_bReleaseGeometry ? "true":"false");
+            break;
+        case 'z':
+            if(i == argc-1)
+                return false;
+            g_bDepthStream = atoi(argv[++i]) ? true : false;
+            LOGI("g_bDepthStream set to %s\n", g_bDepthStream ? "true":"false");
+            break;
+        case 'Z':
+            if(i == argc-1)
+                return false;
+            g_bDepthPrepass = atoi(argv[++i]) ? true : false;
+            if(g_bDepthPrepass)
+                g_bDepthStream = true; // the prepass draws from the position streams
+            LOGI("g_bDepthPrepass set to %s\n", g_bDepthPrepass ? "true":"false");
+            break;
+        case 'T':
+            if(i == argc-1)
+                return false;
+            g_RecordThreads = atoi(argv[++i]);
+            LOGI("g_RecordThreads set to %d\n", g_RecordThreads);
+            break;
+        case 'p':
+            if(i == argc-1)
+                return false;
+            g_bOptimizeTokens = atoi(argv[++i]) ? true : false;
+            LOGI("g_bOptimizeTokens set to %s\n", g_bOptimizeTokens ? "true":"false");
+            break;
+        case 'K':
+            if(i == argc-1)
+                return false;
+            g_SortKey = std::string(argv[++i]);
+            LOGI("g_SortKey set to %s\n", g_SortKey.c_str());
+            break;
+        case 'B':
+            if(i == argc-1)
+                return false;
+            g_LoadBudgetMs = (float)atof(argv[++i]);
+            LOGI("g_LoadBudgetMs set to %f\n", g_LoadBudgetMs);
+            break;
         case 'i':
             {
                 const char* name = argv[++i];
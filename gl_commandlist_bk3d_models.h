@@ -25,6 +25,9 @@
     feedback to tlorach@nvidia.com (Tristan Lorach)
 */ //--------------------------------------------------------------------
 #include <assert.h>
+#include <set>
+#include <deque>
+#include <new>
 #include "main.h"
 
 #include "nv_math/nv_math.h"
@@ -53,6 +56,7 @@ using namespace nv_math;
 #   include "zlib.h"
 #endif
 #include "bk3dEx.h" // a baked binary format for few models
+#include "bk3dFile.h" // memory mapping of bk3d files
 
 #if 1//SUPPORT_PROFILE
 #define PROFILE_SECTION(name)   nv_helpers::Profiler::Section _tempTimer(g_profiler ,name)
@@ -64,6 +68,11 @@ using namespace nv_math;
 
 #define UBO_MATRIX   1
 #define UBO_MATRIXOBJ 3
+#define INSTANCES_PER_DRAW 256 // transforms of an instanced draw: 16Kb, the minimal UBO size
+
+#define VTXQUANT_NONE   0
+#define VTXQUANT_OCT16  1 // 16 bits positions, normals in 2 snorm16: 12 bytes per vertex
+#define VTXQUANT_OCT8   2 // 16 bits positions, normals in 2 snorm8: 8 bytes per vertex
 #define UBO_MATERIAL 2
 #define UBO_LIGHT    0
 #define TOSTR_(x) #x
@@ -102,8 +111,9 @@ NV_ALIGN(256, struct LightBuffer
 
 struct BO {
     GLuint      Id;
-    GLuint      Sz;
+    GLsizeiptr  Sz;     // 64 bits: a model can exceed 4Gb
     GLuint64    Addr;
+    GLintptr    Offset; // where it starts in buffer Id: non-zero for ranges of the geometry heap
 };
 
 //
@@ -118,6 +128,112 @@ enum ShaderStages {
     STAGES,
 };
 
+//
+// Writer of token commands: tokens are constructed in place at the end of an
+// arena that grows geometrically (reserve() it for no re-allocation at all) or
+// of some external memory, such as a mapped buffer (see attach()), which can't
+// grow: what doesn't fit gets dropped and overflow() tells it.
+// emit<Token_X>() is for gl_commandlist_bk3d_models.cpp, where the tokens are
+// declared. The others go through the writers (uniformAddress()...)
+//
+class TokenStream
+{
+public:
+    TokenStream() : m_begin(NULL), m_size(0), m_capacity(0), m_bOwned(true), m_bOverflow(false) {}
+    TokenStream(void* p, size_t capacity) : m_begin((char*)p), m_size(0), m_capacity(capacity), m_bOwned(false), m_bOverflow(false) {}
+    TokenStream(const TokenStream &ts) : m_begin(NULL), m_size(0), m_capacity(0), m_bOwned(true), m_bOverflow(false) { append(ts); }
+    ~TokenStream() { if(m_bOwned) free(m_begin); }
+    TokenStream& operator=(const TokenStream &ts) { if(&ts != this) { clear(); append(ts); } return *this; }
+
+    void attach(void* p, size_t capacity)
+    {
+        if(m_bOwned)
+            free(m_begin);
+        m_begin = (char*)p;
+        m_capacity = capacity;
+        m_size = 0;
+        m_bOwned = false;
+        m_bOverflow = false;
+    }
+    void reserve(size_t n)
+    {
+        if(!m_bOwned || (n <= m_capacity))
+            return;
+        m_begin = (char*)realloc(m_begin, n);
+        m_capacity = n;
+    }
+    void clear()            { m_size = 0; m_bOverflow = false; }
+    size_t size() const     { return m_size; }
+    bool empty() const      { return m_size == 0; }
+    bool overflow() const   { return m_bOverflow; }
+    char* data()            { return m_begin; }
+    const char* data() const { return m_begin; }
+    char& operator[](size_t i) { return m_begin[i]; }
+    const char& operator[](size_t i) const { return m_begin[i]; }
+
+    // room for sz more bytes
+    void* alloc(size_t sz)
+    {
+        if(m_size + sz > m_capacity)
+        {
+            if(!m_bOwned)
+            {
+                m_bOverflow = true;
+                return m_scratch;
+            }
+            reserve(std::max(m_capacity * 2, m_size + std::max(sz, (size_t)4096)));
+        }
+        void* p = m_begin + m_size;
+        m_size += sz;
+        return p;
+    }
+    void append(const void* p, size_t sz)
+    {
+        if(!m_bOwned && (m_size + sz > m_capacity))
+        {
+            m_bOverflow = true;
+            return;
+        }
+        memcpy(alloc(sz), p, sz);
+    }
+    void append(const TokenStream &ts)  { append(ts.data(), ts.size()); }
+    void swap(TokenStream &ts)
+    {
+        std::swap(m_begin, ts.m_begin);
+        std::swap(m_size, ts.m_size);
+        std::swap(m_capacity, ts.m_capacity);
+        std::swap(m_bOwned, ts.m_bOwned);
+        std::swap(m_bOverflow, ts.m_bOverflow);
+    }
+    TokenStream& operator+=(const std::string &s) { append(s.data(), s.size()); return *this; }
+
+    // sizeof(T) is the size of the token: no look-up
+    template<class T> T& emit()
+    {
+        return *new(alloc(sizeof(T))) T();
+    }
+
+    void lineWidth(float w);
+    void uniformAddress(int idx, GLuint64 p, GLsizeiptr sizeBytes, ShaderStages stage);
+    void attributeAddress(int idx, GLuint64 p, GLsizeiptr sizeBytes);
+    void elementAddress(GLuint64 ptr, GLenum indexFormatGL);
+    void drawElements(GLenum topologyGL, GLuint indexCount, GLuint baseVertex=0);
+    void drawArrays(GLenum topologyGL, GLuint indexCount);
+    void drawElementsInstanced(GLenum topologyGL, GLuint indexCount, GLuint instanceCount, GLuint baseVertex=0);
+    void drawArraysInstanced(GLenum topologyGL, GLuint indexCount, GLuint instanceCount);
+    void viewport(GLint x, GLint y, GLsizei width, GLsizei height);
+    void blendColor(GLclampf red, GLclampf green, GLclampf blue, GLclampf alpha);
+    void stencilRef(GLuint frontStencilRef, GLuint backStencilRef);
+    void polygonOffset(GLfloat scale, GLfloat bias);
+    void scissor(GLint x, GLint y, GLsizei width, GLsizei height);
+private:
+    char*   m_begin;
+    size_t  m_size;
+    size_t  m_capacity;
+    bool    m_bOwned;
+    bool    m_bOverflow;
+    char    m_scratch[64];  // where tokens past the end of external memory go
+};
 //
 // Put together all what is needed to give to the extension function
 // for a token buffer
@@ -126,7 +242,7 @@ struct TokenBuffer
 {
     GLuint                  bufferID;   // buffer containing all
     GLuint64EXT             bufferAddr; // buffer GPU-pointer
-    std::string             data;       // bytes of data containing the structures to send to the driver
+    TokenStream             data;       // bytes of data containing the structures to send to the driver
 };
 //
 // Grouping together what is needed to issue a single command made of many states, fbos and Token Buffer pointers
@@ -180,6 +296,29 @@ extern bool         g_bWireframe;
 
 extern int          g_TokenBufferGrouping;
 extern int          g_MaxBOSz;
+extern int          g_MaxEBOSz;
+extern bool         g_bUseFileMapping;
+extern int          g_LoadThreads;
+extern bool         g_bAsyncLoading;
+extern float        g_LoadBudgetMs;
+extern bool         g_bStreamUpload;
+extern std::string  g_CacheDir;
+extern int          g_StreamingBudgetMb;
+extern int          g_StreamingUploadMb;
+extern std::string  g_PackFile;
+extern bool         g_bCompactIndices;
+extern bool         g_bMergePrimGroups;
+extern bool         g_bInstancing;
+extern int          g_QuantizeVertices;
+extern bool         g_bFlattenStatic;
+extern int          g_GeometryHeapMb;
+extern bool         g_bHeapCompaction;
+extern bool         g_bReleaseGeometry;
+extern bool         g_bDepthStream;
+extern bool         g_bDepthPrepass;
+extern int          g_RecordThreads;
+extern bool         g_bOptimizeTokens;
+extern std::string  g_SortKey;
 extern float        g_Supersampling;
 
 extern int          g_firstMesh;
@@ -193,8 +332,21 @@ extern std::string buildLineWidthCommand(float w);
 extern std::string buildUniformAddressCommand(int idx, GLuint64 p, GLsizeiptr sizeBytes, ShaderStages stage);
 extern std::string buildAttributeAddressCommand(int idx, GLuint64 p, GLsizeiptr sizeBytes);
 extern std::string buildElementAddressCommand(GLuint64 ptr, GLenum indexFormatGL);
-extern std::string buildDrawElementsCommand(GLenum topologyGL, GLuint indexCount);
+extern std::string buildDrawElementsCommand(GLenum topologyGL, GLuint indexCount, GLuint baseVertex=0);
 extern std::string buildDrawArraysCommand(GLenum topologyGL, GLuint indexCount);
+extern std::string buildDrawElementsInstancedCommand(GLenum topologyGL, GLuint indexCount, GLuint instanceCount, GLuint baseVertex=0);
+extern std::string buildDrawArraysInstancedCommand(GLenum topologyGL, GLuint indexCount, GLuint instanceCount);
+
+// what optimizeTokens() did
+struct TokenOptStats
+{
+    size_t  bytesIn, bytesOut;
+    int     tokensIn, tokensOut;
+    int     attrDropped;        // attribute addresses already set
+    int     uniformDropped;     // uniform addresses already set
+    int     elementsFolded;     // element addresses turned into the firstIndex of the draws
+};
+extern TokenOptStats optimizeTokens(TokenStream &ts, std::vector<int> &offsets, GLsizei* sizes, std::vector<size_t> &marks, const std::vector<BO> &elementRanges);
 
 //------------------------------------------------------------------------------
 // Class for Object (made of 1 to N meshes)
@@ -214,13 +366,48 @@ public:
         unsigned int    attr_update;
         unsigned int    uniform_update;
     };
+    // bytes held by a model, by category (see addMemoryStats)
+    struct MemoryStats {
+        size_t          hostNodes;      // meshes, primitive groups, transforms, matrices, materials
+        size_t          hostGeometry;   // vertex and index data: buffer area of the file and data rebuilt at load time
+        size_t          hostMapped;     // file mapped in memory: pages of the system cache, not of the process
+        size_t          hostCommands;   // token buffer, as recorded
+        size_t          gpuVertices;
+        size_t          gpuIndices;
+        size_t          gpuUniforms;    // matrices and materials
+        size_t          gpuCommands;
+    };
+    // index data of a primitive group, as in the file (see processPrimGroups)
+    struct IndexSource {
+        const void*     pData;      // NULL: not indexed
+        GLuint          count;
+        GLenum          format;
+        GLenum          topology;
+        GLuint          restart;
+        GLuint          minIndex;
+        GLuint          maxIndex;
+    };
+    // groups merged into one draw
+    struct IndexRun {
+        std::vector<IndexSource> sources;
+    };
+    // positions of a mesh alone, for depth passes (see extractPositions)
+    struct PositionStream {
+        const void*     pData;      // tightly packed copy of attribute 0. NULL once uploaded and released
+        GLsizeiptr      sizeBytes;  // 0: no stream for this mesh
+        GLuint          strideBytes;
+        int             slot;       // slot already holding nothing but the positions: no copy. -1: pData
+        GLuint64        offset;     // in the VBO of the mesh
+    };
 private:
     bool                m_bRecordObject;
 
     std::vector<BO>     m_ObjVBOs;
     std::vector<BO>     m_ObjEBOs;
+    std::vector<int>    m_meshEBO;          // EBO of each mesh, in m_ObjEBOs (the userPtr of a mesh tells its VBO)
 
     BO                  m_uboObjectMatrices;
+    BO                  m_uboMeshMatrices;  // transforms given per mesh: instances, quantized meshes
     BO                  m_uboMaterial;
 
     MatrixBufferObject* m_objectMatrices;
@@ -231,9 +418,44 @@ private:
 
     TokenBuffer         m_tokenBufferModel; // contains the commands to send to the GPU for setup and draw
     CommandStatesBatch  m_commandModel;     // used to gather the GPU pointers of a single batch and where states/fbos do change
+    TokenBuffer         m_tokenBufferDepth; // same, for a depth-only pass from the position streams
+    CommandStatesBatch  m_commandDepth;
     GLuint              m_commandList;      // the list containing the command buffer(s)
 
     bk3d::FileHeader*   m_meshFile;
+    bk3d::FileMapping   m_meshFileMapping;  // when m_meshFile comes from a mapped file (no copy of the buffer area)
+    void*               m_bufferMemory;     // buffer area of m_meshFile, when allocated apart from it
+    size_t              m_bufferMemorySz;
+    bool                m_bKeepBufferArea;  // more than vertex and index data in the buffer area: see releaseGeometry()
+    GFILE               m_streamFile;       // buffer area still in the file: see inflateBufferArea()
+    struct StreamUpload* m_streamUpload;    // staging ring between the loader thread and the GL thread
+    std::string         m_cacheName;        // entry of the processed-model cache (empty: no cache)
+    FILE*               m_cacheFile;        // cache hit: buffer objects still to read by initBuffersObject()
+    unsigned long long  m_cacheHash;        // hash of the source file
+    unsigned long long  m_cacheStamp[2];    // size and modification time of the source file
+    std::vector<GLsizeiptr> m_cacheSizes;   // cache hit: sizes of the VBOs then of the EBOs (see readCacheLayout)
+    int                 m_cacheNumVBOs;
+    std::vector<unsigned int> m_meshLastUsed; // out-of-core: last frame each mesh was visible
+    GLuint64            m_residentBytes;    // out-of-core: size of the buffer objects of resident meshes
+    unsigned int        m_frame;
+    bool                m_bReady;           // buffer objects are created: the model can be displayed
+    std::set<const bk3d::PrimGroup*> m_narrowedPGs; // indices rebased against minIndex and narrowed to 16 bits
+    std::map<const bk3d::PrimGroup*, IndexRun> m_indexRuns; // index data to build while streaming from the file
+    std::deque< std::vector<char> > m_indexData; // index data rebuilt by processPrimGroups() and flattenStatic()
+    std::vector<int>    m_meshPrototype;    // mesh which geometry each mesh uses (itself when unique). Empty: no instancing
+    struct Instances {
+        GLuint          first;              // in m_uboMeshMatrices
+        GLuint          count;
+    };
+    std::map<int, Instances> m_instances;   // prototypes and their copies, drawn at once
+    std::deque< std::vector<char> > m_vertexData; // vertex data rebuilt by flattenStatic() and quantizeVertices()
+    std::set<const bk3d::Mesh*> m_quantizedMeshes;
+    int                 m_quantizeMode;     // VTXQUANT_* format of m_quantizedMeshes
+    std::vector<GLuint> m_meshMatrix;       // matrix of each mesh in m_uboMeshMatrices. ~0: the one of its transform
+    std::set<const bk3d::Mesh*> m_flatMeshes; // vertices in the model space: static meshes merged by flattenStatic()
+    std::deque<bk3d::PrimGroup> m_flatPrimGroups; // primitive groups of m_flatMeshes
+    std::deque< std::vector<char> > m_flatPools;  // and their tables
+    std::vector<PositionStream> m_posStreams; // for each mesh. Empty: no depth stream (see -z)
 
     Stats m_stats;
     
@@ -243,6 +465,8 @@ private:
     //-----------------------------------------------------------------------------
     struct States {
         GLenum topology;
+        int    variant;     // MESHSHADER_* flags of the program
+        int    vertexFormat;// VTXQUANT_* format of the attributes
         //GLuint primRestartIndex;
         // we should have more comparison on attribute stride, offset...
     };
@@ -251,29 +475,128 @@ private:
         bool operator()(const States& _Left, const States& _Right) const
 	    {
             // check primRestartIndex, too
-	        return (_Left.topology < _Right.topology);
+	        if(_Left.topology != _Right.topology)
+	            return (_Left.topology < _Right.topology);
+	        if(_Left.variant != _Right.variant)
+	            return (_Left.variant < _Right.variant);
+	        return (_Left.vertexFormat < _Right.vertexFormat);
 	    }
     };
     std::map<States, GLuint, StateLess > m_glStates;
+    // what each state object got captured from, to capture it again (see recaptureStates)
+    struct StateSource {
+        bk3d::Mesh*         pMesh;
+        bk3d::PrimGroup*    pPG;
+    };
+    std::map<States, StateSource, StateLess > m_stateSources;
+    //
+    // tokens depending on the render target, to patch in place rather than
+    // recording again (see patchTargets). The FBO is in the batches and the
+    // viewport in g_tokenBufferViewport: only the line width is in the tokens
+    //
+    enum TokenPatchType {
+        PATCH_LINEWIDTH,
+    };
+    struct TokenPatch {
+        size_t  offset;     // in m_tokenBufferModel
+        int     type;       // TokenPatchType
+    };
+    std::vector<TokenPatch> m_tokenPatches;
+    bool                m_bRecaptureStates;
 
 public:
     void invalidateCmdList() { m_bRecordObject = true; }
+    void patchTargets(GLuint fbo, float lineWidth);
+    void recaptureStates();
+    void captureState(GLuint id, const States &sl, bk3d::Mesh *pMesh, bk3d::PrimGroup* pPG);
     void releaseState(GLuint s);
     void deleteCommandListData();
     GLenum topologyWithoutStrips(GLenum topologyGL);
-    GLuint findStateOrCreate(bk3d::Mesh *pMesh, bk3d::PrimGroup* pPG);
+    GLuint findStateOrCreate(bk3d::Mesh *pMesh, bk3d::PrimGroup* pPG, int variant=0);
+    int vertexFormat(const bk3d::Mesh *pMesh) { return m_quantizedMeshes.count(pMesh) ? m_quantizeMode : 0; }
+    void bindVertexFormat(bk3d::Mesh *pMesh);
+    void bindPositionFormat(bk3d::Mesh *pMesh);
     bool comparePG(const bk3d::PrimGroup* pPrevPG, const bk3d::PrimGroup* pPG);
     bool compareAttribs(bk3d::Mesh* pPrevMesh, bk3d::Mesh* pMesh);
-    int recordMeshes(GLenum topology, std::vector<int> &offsets, GLsizei &tokenTableOffset, int &totalDCs, GLuint m_fboMSAA8x);
+    //
+    // one record per primitive group to draw, in the order of the tokens. When
+    // grouping, they get sorted on a key made of the fields of g_SortKey
+    //
+    struct DrawRecord {
+        GLuint64            key;
+        int                 mesh;
+        int                 pg;
+    };
+    GLuint64 drawKey(int i, const bk3d::PrimGroup* pPG, int &bits);
+    int buildDrawRecords(std::vector<DrawRecord> &records, bool bSort);
+    //
+    // recording runs in two phases: workers make the tokens of ranges of draw
+    // records (recordJob: no OpenGL) then the GL thread gets the state objects
+    // of their segments and puts the tokens together (stitchJobs)
+    //
+    struct TokenSegment {
+        size_t              end;        // in the tokens of the job. Starts where the previous one ends
+        bk3d::Mesh*         pMesh;      // what the state object gets captured from
+        bk3d::PrimGroup*    pPG;
+        int                 variant;
+    };
+    struct RecordJob {
+        bool                        bDepth;     // depth-only, from the position streams
+        int                         first, last;// range of draw records
+        TokenStream                 tokens;
+        std::vector<TokenSegment>   segments;
+        Stats                       stats;
+        int                         nDCs;
+    };
+    size_t tokenBytesBound(const std::vector<DrawRecord> &records, int first, int last);
+    void recordJob(RecordJob &job, const std::vector<DrawRecord> &records);
+    int stitchJobs(std::vector<RecordJob> &jobs, bool bDepth, TokenBuffer &tb, CommandStatesBatch &batches, std::vector<int> &offsets, GLuint fbo);
     void init_command_list();
     void update_fbo_target(GLuint fbo);
     bool recordTokenBufferObject(GLuint m_fboMSAA8x);
+    void allocateBO(BO &bo);
+    void releaseBO(BO &bo);
+    void relocateBO(GLuint id, GLintptr from, GLintptr to, GLuint64 bufferAddr);
     bool initBuffersObject();
+    void inflateBufferArea();
+    bool beginStreamUpload();
+    int  streamStep(double tEnd);
+    void abortStream();
+    void endStream();
+    void processPrimGroups();
+    void findInstances();
+    void flattenStatic();
+    void quantizeVertices();
+    void extractPositions();
+    void initMeshTransforms();
+    void uploadIndexRun(const bk3d::PrimGroup* pPG, const std::vector< std::vector<char> > &sourceData, GLuint bo, GLintptr offset);
+    GLuint baseVertex(const bk3d::PrimGroup* pPG) { return m_narrowedPGs.count(pPG) ? pPG->minIndex : 0; }
+    bool openCache(const char *path, std::vector<char> *pSource);
+    bool readCacheLayout(FILE *fp, int numVBOs, int numEBOs);
+    void clearCacheLayout();
+    bool initBuffersFromCache();
+    bool writeCache(bool bAutoScale);
+    bool initBuffersOutOfCore();
+    void makeMeshResident(int i);
+    void evictMesh(int i);
+    bool updateResidency(const mat4f &mvp);
     bool loadModel(const char *name=NULL);
+    bool loadFile(const char *name=NULL);
+    bool uploadModel();
+    bool finishUpload();
+    void releaseGeometry();
     bool loaded() { return m_meshFile ? true:false; }
+    bool ready() { return m_bReady; }
+    bool streaming() { return m_streamUpload ? true:false; } // buffer area on its way from the file (see streamStep)
     void displayObject(const mat4f& cameraView, const mat4f projection, GLuint fboMSAA8x, int maxItems=-1);
     void printPosition();
     void addStats(Stats &stats);
+    void addMemoryStats(MemoryStats &stats);
 
     static bool initGraphics_bk3d();
+    static void startAsyncLoading(const std::vector<Bk3dModel*> &models, int numThreads=0);
+    static int  uploadReadyModels(float budgetMs);
+    static bool asyncLoadingPending();
+    static void stopAsyncLoading();
+    static void compactGeometryHeap();
 }; //Class Bk3dModel
@@ -0,0 +1,156 @@
+/*-----------------------------------------------------------------------
+    Copyright (c) 2013, Tristan Lorach. All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+     * Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+     * Neither the name of its contributors may be used to endorse
+       or promote products derived from this software without specific
+       prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+    EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+    PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+    CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+    EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+    PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+    PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+    OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+    feedback to lorachnroll@gmail.com (Tristan Lorach)
+*/ //--------------------------------------------------------------------
+//
+// writes a synthetic .bk3d.gz file with a buffer area of many Gb and checks
+// that bk3d::load() gets all of it back: the gzip trailer only has the size
+// modulo 4Gb. The header area holds two pointers, one to the beginning of the
+// buffer area and one as far as the 32 bits offsets of the format can go
+//
+// bk3d_bigfile_test [buffer area size in Mb] [temporary file]
+//
+// returns 0 if the file loaded fine, 1 otherwise and 77 (skipped) if the
+// temporary file couldn't be written
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "bk3dEx.h"
+
+static const char s_begin[8]  = "BEGIN..";
+static const char s_target[8] = "TARGET.";
+static const char s_end[8]    = "END....";
+
+static size_t align8(size_t sz) { return (sz + 7) & ~(size_t)7; }
+
+int main(int argc, char** argv)
+{
+    unsigned long long bufferSz = (unsigned long long)(argc > 1 ? atoi(argv[1]) : 4160) << 20;
+    const char* fname = argc > 2 ? argv[2] : "bk3d_bigfile_test.bk3d.gz";
+    if(bufferSz < 64)
+    {
+        printf("Error : the buffer area must take at least 64 bytes\n");
+        return 1;
+    }
+    //
+    // header area : FileHeader | RelocationTable | 2 Offsets | 2 pointers
+    //
+    size_t offTable = align8(sizeof(bk3d::FileHeader));
+    size_t offOffsets = align8(offTable + sizeof(bk3d::RelocationTable));
+    size_t offPtrs = align8(offOffsets + 2 * sizeof(bk3d::RelocationTable::Offsets));
+    size_t nodeByteSize = offPtrs + 2 * sizeof(unsigned long long);
+    // as far as a 32 bits offset can go, 8 bytes aligned
+    unsigned long long target = bufferSz - 16;
+    if(nodeByteSize + target > 0xFFFFFFF0ULL)
+        target = (0xFFFFFFF0ULL - nodeByteSize) & ~7ULL;
+    std::vector<char> header(nodeByteSize, 0);
+    bk3d::FileHeader* pHeader = new(&header[0]) bk3d::FileHeader();
+    pHeader->nodeByteSize = (unsigned int)nodeByteSize;
+    pHeader->pRelocationTable = (bk3d::RelocationTable*)offTable;
+    bk3d::RelocationTable* pTable = new(&header[offTable]) bk3d::RelocationTable();
+    pTable->numRelocationOffsets = 2;
+    pTable->pRelocationOffsets = (bk3d::RelocationTable::Offsets*)offOffsets;
+    bk3d::RelocationTable::Offsets* pOffsets = (bk3d::RelocationTable::Offsets*)&header[offOffsets];
+    unsigned long long* pPtrs = (unsigned long long*)&header[offPtrs];
+    pOffsets[0].ptrOffset = (unsigned int)offPtrs;
+    pOffsets[0].offset = (unsigned int)nodeByteSize;
+    pOffsets[1].ptrOffset = (unsigned int)(offPtrs + sizeof(unsigned long long));
+    pOffsets[1].offset = (unsigned int)(nodeByteSize + target);
+    pPtrs[0] = pOffsets[0].offset;
+    pPtrs[1] = pOffsets[1].offset;
+    //
+    // buffer area : zeros (they compress well) and the markers
+    //
+    gzFile gzout = gzopen(fname, "wb1");
+    if(!gzout)
+    {
+        printf("Skipped : couldn't create %s\n", fname);
+        return 77;
+    }
+    printf("writing %s : %lld Mb of buffer area\n", fname, bufferSz >> 20);
+    bool ok = gzwrite(gzout, &header[0], (unsigned int)nodeByteSize) == (int)nodeByteSize;
+    std::vector<char> block(64<<20, 0);
+    for(unsigned long long o=0; ok && (o<bufferSz); o += block.size())
+    {
+        size_t n = (size_t)(bufferSz - o < block.size() ? bufferSz - o : block.size());
+        memset(&block[0], 0, n);
+        if(o == 0)
+            memcpy(&block[0], s_begin, 8);
+        if((target >= o) && (target < o + n))
+            memcpy(&block[(size_t)(target - o)], s_target, 8);
+        if(o + n == bufferSz)
+            memcpy(&block[n - 8], s_end, 8);
+        ok = gzwrite(gzout, &block[0], (unsigned int)n) == (int)n;
+    }
+    if((gzclose(gzout) != Z_OK) || !ok)
+    {
+        printf("Skipped : couldn't write %s\n", fname);
+        remove(fname);
+        return 77;
+    }
+    block.clear();
+    block.shrink_to_fit();
+    //
+    // load it back
+    //
+    void* pBufferMemory = NULL;
+    size_t bufferMemorySz = 0;
+    bk3d::FileHeader* pLoaded = bk3d::load(fname, &pBufferMemory, &bufferMemorySz);
+    remove(fname);
+    int errors = 0;
+    if(!pLoaded)
+    {
+        printf("Error : bk3d::load() failed\n");
+        return 1;
+    }
+    char* pBuffer = (char*)pBufferMemory;
+    unsigned long long* pLoadedPtrs = (unsigned long long*)((char*)pLoaded + offPtrs);
+    if(bufferMemorySz != bufferSz)
+    {
+        printf("Error : buffer area of %lld bytes instead of %lld\n", (long long)bufferMemorySz, bufferSz);
+        errors++;
+    }
+    else if(memcmp(pBuffer + bufferSz - 8, s_end, 8))
+    {
+        printf("Error : wrong end of the buffer area\n");
+        errors++;
+    }
+    if((pLoadedPtrs[0] != (unsigned long long)pBuffer) || memcmp(pBuffer, s_begin, 8))
+    {
+        printf("Error : the pointer to the beginning of the buffer area isn't resolved\n");
+        errors++;
+    }
+    if((pLoadedPtrs[1] != (unsigned long long)(pBuffer + target)) || memcmp(pBuffer + target, s_target, 8))
+    {
+        printf("Error : the pointer at offset %lld of the buffer area isn't resolved\n", target);
+        errors++;
+    }
+    free(pBufferMemory);
+    free(pLoaded);
+    printf("%s : %lld bytes loaded, %d error(s)\n", fname, (long long)bufferMemorySz, errors);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,147 @@
+/*-----------------------------------------------------------------------
+    Copyright (c) 2013, Tristan Lorach. All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+     * Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+     * Neither the name of its contributors may be used to endorse
+       or promote products derived from this software without specific
+       prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+    EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+    PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+    CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+    EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+    PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+    PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+    OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+    feedback to lorachnroll@gmail.com (Tristan Lorach)
+*/ //--------------------------------------------------------------------
+//
+// converts a .bk3d or .bk3d.gz file into a chunked container (see bk3dFile.h)
+// that bk3d::loadChunked() can inflate on many threads
+//
+// bk3d_chunk <in.bk3d.gz> <out.bk3dc> [chunk size in Kb] [compression level]
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bk3dEx.h"
+#include "bk3dFile.h"
+
+int main(int argc, char** argv)
+{
+    if(argc < 3)
+    {
+        printf("bk3d_chunk <in.bk3d.gz> <out.bk3dc> [chunk size in Kb] [compression level]\n");
+        return 1;
+    }
+    unsigned int chunkSize = argc > 3 ? atoi(argv[3])*1024 : CHUNKEDFILE_CHUNKSZ;
+    int level = argc > 4 ? atoi(argv[4]) : Z_DEFAULT_COMPRESSION;
+    if(chunkSize == 0)
+        chunkSize = CHUNKEDFILE_CHUNKSZ;
+    //
+    // get the raw bytes of the original file : gzread() also reads uncompressed files
+    //
+    gzFile fd = gzopen(argv[1], "rb");
+    if(!fd)
+    {
+        printf("Error : couldn't open %s\n", argv[1]);
+        return 1;
+    }
+    std::vector<unsigned char> raw;
+    unsigned char buf[1<<16];
+    int n;
+    while((n = gzread(fd, buf, sizeof(buf))) > 0)
+        raw.insert(raw.end(), buf, buf + n);
+    gzclose(fd);
+    bk3d::FileHeader* pHeader = raw.empty() ? NULL : (bk3d::FileHeader*)&raw[0];
+    if((raw.size() < sizeof(bk3d::FileHeader)) || (pHeader->version != RAWMESHVERSION) || (pHeader->nodeByteSize > raw.size()))
+    {
+        printf("Error : %s isn't a bk3d file of version %x\n", argv[1], RAWMESHVERSION);
+        return 1;
+    }
+    //
+    // cut the header area and the buffer area separately
+    //
+    bk3d::ChunkedFileHeader ch;
+    memset(&ch, 0, sizeof(ch));
+    ch.magic        = CHUNKEDFILE_MAGIC;
+    ch.version      = CHUNKEDFILE_VERSION;
+    ch.chunkSize    = chunkSize;
+    ch.nodeByteSize = pHeader->nodeByteSize;
+    ch.rawSize      = raw.size();
+    std::vector<unsigned long long> rawOffsets;
+    std::vector<bk3d::ChunkEntry> chunks;
+    unsigned long long areas[3] = { 0, ch.nodeByteSize, ch.rawSize };
+    for(int a=0; a<2; a++)
+        for(unsigned long long o = areas[a]; o < areas[a+1]; o += chunkSize)
+        {
+            bk3d::ChunkEntry c;
+            c.fileOffset = 0;
+            c.compressedSize = 0;
+            c.rawSize = (unsigned int)(areas[a+1] - o < chunkSize ? areas[a+1] - o : chunkSize);
+            chunks.push_back(c);
+            rawOffsets.push_back(o);
+        }
+    ch.numChunks = (unsigned int)chunks.size();
+    //
+    // compress the blocks in parallel
+    //
+    std::vector< std::vector<unsigned char> > compressed(ch.numChunks);
+    std::atomic<unsigned int> nextChunk(0);
+    std::atomic<bool> failed(false);
+    auto compressChunks = [&]()
+    {
+        unsigned int i;
+        while((i = nextChunk++) < ch.numChunks)
+        {
+            uLongf sz = compressBound(chunks[i].rawSize);
+            compressed[i].resize(sz);
+            if(compress2(&compressed[i][0], &sz, &raw[(size_t)rawOffsets[i]], chunks[i].rawSize, level) != Z_OK)
+                failed = true;
+            compressed[i].resize(sz);
+        }
+    };
+    std::vector<std::thread> workers;
+    for(unsigned int t=1; (t<std::thread::hardware_concurrency()) && (t<ch.numChunks); t++)
+        workers.push_back(std::thread(compressChunks));
+    compressChunks();
+    for(size_t t=0; t<workers.size(); t++)
+        workers[t].join();
+    if(failed)
+    {
+        printf("Error : compression failed\n");
+        return 1;
+    }
+    unsigned long long offset = sizeof(bk3d::ChunkedFileHeader) + ch.numChunks * sizeof(bk3d::ChunkEntry);
+    for(unsigned int i=0; i<ch.numChunks; i++)
+    {
+        chunks[i].fileOffset = offset;
+        chunks[i].compressedSize = (unsigned int)compressed[i].size();
+        offset += chunks[i].compressedSize;
+    }
+    //
+    // write
+    //
+    FILE* fout = fopen(argv[2], "wb");
+    if(!fout)
+    {
+        printf("Error : couldn't create %s\n", argv[2]);
+        return 1;
+    }
+    fwrite(&ch, sizeof(ch), 1, fout);
+    fwrite(&chunks[0], sizeof(bk3d::ChunkEntry), chunks.size(), fout);
+    for(unsigned int i=0; i<ch.numChunks; i++)
+        fwrite(&compressed[i][0], 1, compressed[i].size(), fout);
+    fclose(fout);
+    printf("%s : %d chunks of %dKb, %lld bytes -> %lld bytes\n", argv[2], ch.numChunks, chunkSize/1024, ch.rawSize, offset);
+    return 0;
+}
@@ -0,0 +1,508 @@
+/*-----------------------------------------------------------------------
+    Copyright (c) 2013, Tristan Lorach. All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+     * Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+     * Neither the name of its contributors may be used to endorse
+       or promote products derived from this software without specific
+       prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+    EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+    PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+    CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+    EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+    PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+    PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+    OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+    feedback to lorachnroll@gmail.com (Tristan Lorach)
+*/ //--------------------------------------------------------------------
+//
+// reorders the triangles of the GL_TRIANGLES primitive groups for the post-transform
+// vertex cache (Forsyth's "Linear-Speed Vertex Cache Optimisation"), then the vertices
+// of each mesh in the order they get fetched. Optionally (-d), clusters of triangles
+// (cut where the cache starts over anyway) get sorted so that the ones facing outward
+// are drawn first, to lower overdraw.
+// Data is rewritten in place : sizes and layout of the file don't change.
+// The ACMR (cache misses per triangle) and ATVR (cache misses per vertex) of the model
+// are reported before and after, for a FIFO cache of CACHE_SIZE entries.
+//
+// bk3d_optimize <in.bk3d.gz> [out.bk3d[.gz]] [-d]
+// without an output file, only the report is done
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+#include "bk3dEx.h"
+#include "bk3dFile.h"
+
+#define CACHE_SIZE      32  // FIFO of the report
+#define FORSYTH_CACHE   32  // LRU cache of the optimizer
+
+struct CacheStats
+{
+    unsigned long long triangles;
+    unsigned long long vertices;
+    unsigned long long misses;
+};
+
+static bool isOptimizable(const bk3d::PrimGroup* pPG)
+{
+    return (pPG->topologyGL == GL_TRIANGLES) && (pPG->indexArrayByteSize > 0) && (pPG->indexCount >= 3)
+        && ((pPG->indexFormatGL == GL_UNSIGNED_INT) || (pPG->indexFormatGL == GL_UNSIGNED_SHORT))
+        && ((pPG->pOwnerOfIB == NULL) || (pPG->pOwnerOfIB == pPG));
+}
+static void readIndices(const bk3d::PrimGroup* pPG, std::vector<unsigned int> &indices)
+{
+    indices.resize(pPG->indexCount);
+    for(unsigned int i=0; i<pPG->indexCount; i++)
+        indices[i] = pPG->indexFormatGL == GL_UNSIGNED_INT ? ((unsigned int*)pPG->pIndexBufferData)[i] : ((unsigned short*)pPG->pIndexBufferData)[i];
+}
+static void writeIndices(bk3d::PrimGroup* pPG, const std::vector<unsigned int> &indices)
+{
+    pPG->minIndex = 0xFFFFFFFF;
+    pPG->maxIndex = 0;
+    for(unsigned int i=0; i<pPG->indexCount; i++)
+    {
+        if(pPG->indexFormatGL == GL_UNSIGNED_INT)
+            ((unsigned int*)pPG->pIndexBufferData)[i] = indices[i];
+        else
+            ((unsigned short*)pPG->pIndexBufferData)[i] = (unsigned short)indices[i];
+        pPG->minIndex = std::min(pPG->minIndex, indices[i]);
+        pPG->maxIndex = std::max(pPG->maxIndex, indices[i]);
+    }
+}
+
+//------------------------------------------------------------------------------
+// FIFO cache simulation over a triangle list
+//------------------------------------------------------------------------------
+static void simulateCache(const std::vector<unsigned int> &indices, CacheStats &stats)
+{
+    std::vector<unsigned int> fifo(CACHE_SIZE, 0xFFFFFFFF);
+    std::vector<unsigned int> unique(indices);
+    std::sort(unique.begin(), unique.end());
+    stats.vertices += std::unique(unique.begin(), unique.end()) - unique.begin();
+    stats.triangles += indices.size() / 3;
+    size_t head = 0;
+    for(size_t i=0; i<(indices.size()/3)*3; i++)
+        if(std::find(fifo.begin(), fifo.end(), indices[i]) == fifo.end())
+        {
+            fifo[head] = indices[i];
+            head = (head + 1) % CACHE_SIZE;
+            stats.misses++;
+        }
+}
+
+//------------------------------------------------------------------------------
+// Forsyth : each vertex has a score from its position in a LRU cache and from the
+// number of triangles still using it. The triangle of highest score goes next
+//------------------------------------------------------------------------------
+static float vertexScore(int cachePos, int remaining)
+{
+    if(remaining == 0)
+        return -1.0f;
+    float score = 0.0f;
+    if(cachePos >= 0)
+        score = cachePos < 3 ? 0.75f : powf(1.0f - (float)(cachePos - 3) / (float)(FORSYTH_CACHE - 3), 1.5f);
+    return score + 2.0f / sqrtf((float)remaining);
+}
+
+static void optimizeVertexCache(std::vector<unsigned int> &indices)
+{
+    size_t numTris = indices.size() / 3;
+    // dense vertex ids and triangles using each of them
+    std::vector<unsigned int> sorted(indices.begin(), indices.begin() + numTris*3);
+    std::sort(sorted.begin(), sorted.end());
+    sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+    std::vector<unsigned int> local(numTris*3);
+    for(size_t i=0; i<local.size(); i++)
+        local[i] = (unsigned int)(std::lower_bound(sorted.begin(), sorted.end(), indices[i]) - sorted.begin());
+    size_t numVerts = sorted.size();
+    std::vector<unsigned int> triStart(numVerts + 1, 0);
+    for(size_t i=0; i<local.size(); i++)
+        triStart[local[i] + 1]++;
+    for(size_t v=0; v<numVerts; v++)
+        triStart[v + 1] += triStart[v];
+    std::vector<unsigned int> vtxTris(local.size());
+    std::vector<unsigned int> fill(triStart.begin(), triStart.end() - 1);
+    for(size_t i=0; i<local.size(); i++)
+        vtxTris[fill[local[i]]++] = (unsigned int)(i / 3);
+    std::vector<int> remaining(numVerts), cachePos(numVerts, -1);
+    std::vector<float> vScore(numVerts), tScore(numTris, 0.0f);
+    for(size_t v=0; v<numVerts; v++)
+    {
+        remaining[v] = triStart[v + 1] - triStart[v];
+        vScore[v] = vertexScore(-1, remaining[v]);
+    }
+    for(size_t t=0; t<numTris; t++)
+        tScore[t] = vScore[local[t*3]] + vScore[local[t*3+1]] + vScore[local[t*3+2]];
+    std::vector<bool> emitted(numTris, false);
+    std::vector<unsigned int> cache, newCache;
+    std::vector<unsigned int> result;
+    result.reserve(numTris*3);
+    size_t scan = 0; // triangles before this one are all emitted
+    int best = -1;
+    for(size_t n=0; n<numTris; n++)
+    {
+        // nothing in the cache to go on with : best of the remaining triangles
+        if(best < 0)
+        {
+            while(emitted[scan])
+                scan++;
+            best = (int)scan;
+            for(size_t t=scan; t<numTris; t++)
+                if(!emitted[t] && (tScore[t] > tScore[best]))
+                    best = (int)t;
+        }
+        emitted[best] = true;
+        for(int k=0; k<3; k++)
+        {
+            unsigned int v = local[best*3 + k];
+            result.push_back(sorted[v]);
+            // this triangle doesn't use the vertex anymore
+            unsigned int* b = &vtxTris[triStart[v]];
+            unsigned int* e = b + remaining[v];
+            *std::find(b, e, (unsigned int)best) = *(e - 1);
+            remaining[v]--;
+        }
+        // the 3 vertices go in front of the LRU cache
+        newCache.clear();
+        for(int k=0; k<3; k++)
+            newCache.push_back(local[best*3 + k]);
+        for(size_t c=0; c<cache.size(); c++)
+            if(std::find(newCache.begin(), newCache.begin() + 3, cache[c]) == newCache.begin() + 3)
+                newCache.push_back(cache[c]);
+        for(size_t c=FORSYTH_CACHE; c<newCache.size(); c++)
+            cachePos[newCache[c]] = -1;
+        if(newCache.size() > FORSYTH_CACHE)
+            newCache.resize(FORSYTH_CACHE);
+        cache.swap(newCache);
+        // new scores of what is in the cache, or just left it
+        for(size_t c=0; c<cache.size(); c++)
+            cachePos[cache[c]] = (int)c;
+        for(size_t c=0; c<newCache.size(); c++)
+            vScore[newCache[c]] = vertexScore(cachePos[newCache[c]], remaining[newCache[c]]);
+        for(size_t c=0; c<cache.size(); c++)
+            vScore[cache[c]] = vertexScore((int)c, remaining[cache[c]]);
+        // triangles of the vertices that left: their score is the one the scan for the
+        // best remaining triangle goes by
+        for(size_t c=0; c<newCache.size(); c++)
+        {
+            unsigned int v = newCache[c];
+            if(cachePos[v] >= 0)
+                continue;
+            for(int i=0; i<remaining[v]; i++)
+            {
+                unsigned int t = vtxTris[triStart[v] + i];
+                tScore[t] = vScore[local[t*3]] + vScore[local[t*3+1]] + vScore[local[t*3+2]];
+            }
+        }
+        best = -1;
+        for(size_t c=0; c<cache.size(); c++)
+        {
+            unsigned int v = cache[c];
+            for(int i=0; i<remaining[v]; i++)
+            {
+                unsigned int t = vtxTris[triStart[v] + i];
+                tScore[t] = vScore[local[t*3]] + vScore[local[t*3+1]] + vScore[local[t*3+2]];
+                if((best < 0) || (tScore[t] > tScore[best]))
+                    best = (int)t;
+            }
+        }
+    }
+    std::copy(result.begin(), result.end(), indices.begin());
+}
+
+//------------------------------------------------------------------------------
+// overdraw : the triangle list is cut where the FIFO cache misses all 3 vertices
+// (no loss for the cache), then clusters facing outward go first
+//------------------------------------------------------------------------------
+static const float* position(const bk3d::Attribute* pPos, unsigned int v)
+{
+    return (const float*)((const char*)pPos->pAttributeBufferData + (size_t)v * pPos->strideBytes);
+}
+
+static void optimizeOverdraw(std::vector<unsigned int> &indices, const bk3d::Attribute* pPos)
+{
+    size_t numTris = indices.size() / 3;
+    std::vector<size_t> clusterStart;
+    std::vector<unsigned int> fifo(CACHE_SIZE, 0xFFFFFFFF);
+    size_t head = 0;
+    for(size_t t=0; t<numTris; t++)
+    {
+        int misses = 0;
+        for(int k=0; k<3; k++)
+            if(std::find(fifo.begin(), fifo.end(), indices[t*3+k]) == fifo.end())
+            {
+                fifo[head] = indices[t*3+k];
+                head = (head + 1) % CACHE_SIZE;
+                misses++;
+            }
+        if((t == 0) || (misses == 3))
+            clusterStart.push_back(t);
+    }
+    clusterStart.push_back(numTris);
+    size_t numClusters = clusterStart.size() - 1;
+    if(numClusters < 2)
+        return;
+    // area weighted centroids and normals
+    std::vector<float> clusterData(numClusters * 7, 0.0f); // centroid, normal, area
+    float center[3] = { 0, 0, 0 };
+    float totalArea = 0.0f;
+    for(size_t c=0; c<numClusters; c++)
+    {
+        float* d = &clusterData[c*7];
+        for(size_t t=clusterStart[c]; t<clusterStart[c+1]; t++)
+        {
+            const float* p0 = position(pPos, indices[t*3]);
+            const float* p1 = position(pPos, indices[t*3+1]);
+            const float* p2 = position(pPos, indices[t*3+2]);
+            float e1[3] = { p1[0]-p0[0], p1[1]-p0[1], p1[2]-p0[2] };
+            float e2[3] = { p2[0]-p0[0], p2[1]-p0[1], p2[2]-p0[2] };
+            float n[3] = { e1[1]*e2[2]-e1[2]*e2[1], e1[2]*e2[0]-e1[0]*e2[2], e1[0]*e2[1]-e1[1]*e2[0] };
+            float area = 0.5f * sqrtf(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+            for(int k=0; k<3; k++)
+            {
+                d[k] += area * (p0[k] + p1[k] + p2[k]) / 3.0f;
+                d[3+k] += n[k];
+            }
+            d[6] += area;
+        }
+        for(int k=0; k<3; k++)
+            center[k] += d[k];
+        totalArea += d[6];
+        if(d[6] > 0.0f)
+            for(int k=0; k<3; k++)
+                d[k] /= d[6];
+    }
+    if(totalArea <= 0.0f)
+        return;
+    for(int k=0; k<3; k++)
+        center[k] /= totalArea;
+    std::vector<std::pair<float, size_t> > order(numClusters);
+    for(size_t c=0; c<numClusters; c++)
+    {
+        const float* d = &clusterData[c*7];
+        float len = sqrtf(d[3]*d[3] + d[4]*d[4] + d[5]*d[5]);
+        float dp = 0.0f;
+        if(len > 0.0f)
+            for(int k=0; k<3; k++)
+                dp += (d[k] - center[k]) * d[3+k] / len;
+        order[c] = std::make_pair(-dp, c);
+    }
+    std::stable_sort(order.begin(), order.end());
+    std::vector<unsigned int> result;
+    result.reserve(indices.size());
+    for(size_t c=0; c<numClusters; c++)
+        result.insert(result.end(), indices.begin() + clusterStart[order[c].second]*3, indices.begin() + clusterStart[order[c].second + 1]*3);
+    std::copy(result.begin(), result.end(), indices.begin());
+}
+
+//------------------------------------------------------------------------------
+// vertices in the order the primitive groups fetch them. Every group of the mesh must
+// be indexed and own its index buffer, all slots must have the same vertex count
+//------------------------------------------------------------------------------
+static bool optimizeVertexFetch(bk3d::Mesh* pMesh)
+{
+    if((pMesh->pSlots->n == 0) || (pMesh->pBSSlots && (pMesh->pBSSlots->n > 0)))
+        return false;
+    unsigned int vertexCount = pMesh->pSlots->p[0]->vertexCount;
+    for(int s=0; s<pMesh->pSlots->n; s++)
+    {
+        bk3d::Slot* pS = pMesh->pSlots->p[s];
+        if((pS->vertexCount != vertexCount) || ((unsigned long long)pS->vtxBufferStrideBytes * vertexCount > pS->vtxBufferSizeBytes))
+            return false;
+    }
+    std::vector<std::vector<unsigned int> > pgIndices(pMesh->pPrimGroups->n);
+    std::vector<unsigned int> remap(vertexCount, 0xFFFFFFFF);
+    unsigned int next = 0;
+    for(int pg=0; pg<pMesh->pPrimGroups->n; pg++)
+    {
+        bk3d::PrimGroup* pPG = pMesh->pPrimGroups->p[pg];
+        if((pPG->indexArrayByteSize == 0) || (pPG->pOwnerOfIB && (pPG->pOwnerOfIB != pPG))
+          || ((pPG->indexFormatGL != GL_UNSIGNED_INT) && (pPG->indexFormatGL != GL_UNSIGNED_SHORT)))
+            return false;
+        readIndices(pPG, pgIndices[pg]);
+        for(size_t i=0; i<pgIndices[pg].size(); i++)
+        {
+            unsigned int v = pgIndices[pg][i];
+            if(v >= vertexCount)
+                return false; // primitive restart or broken data
+            if(remap[v] == 0xFFFFFFFF)
+                remap[v] = next++;
+        }
+    }
+    // 16 bits groups must still fit
+    for(int pg=0; pg<pMesh->pPrimGroups->n; pg++)
+        if(pMesh->pPrimGroups->p[pg]->indexFormatGL == GL_UNSIGNED_SHORT)
+            for(size_t i=0; i<pgIndices[pg].size(); i++)
+                if(remap[pgIndices[pg][i]] >= 0xFFFF)
+                    return false;
+    for(unsigned int v=0; v<vertexCount; v++)
+        if(remap[v] == 0xFFFFFFFF)
+            remap[v] = next++;
+    for(int s=0; s<pMesh->pSlots->n; s++)
+    {
+        bk3d::Slot* pS = pMesh->pSlots->p[s];
+        unsigned int stride = pS->vtxBufferStrideBytes;
+        std::vector<char> vertices((size_t)stride * vertexCount);
+        for(unsigned int v=0; v<vertexCount; v++)
+            memcpy(&vertices[(size_t)remap[v] * stride], (char*)pS->pVtxBufferData + (size_t)v * stride, stride);
+        memcpy(pS->pVtxBufferData, &vertices[0], vertices.size());
+    }
+    for(int pg=0; pg<pMesh->pPrimGroups->n; pg++)
+    {
+        for(size_t i=0; i<pgIndices[pg].size(); i++)
+            pgIndices[pg][i] = remap[pgIndices[pg][i]];
+        writeIndices(pMesh->pPrimGroups->p[pg], pgIndices[pg]);
+    }
+    return true;
+}
+
+static CacheStats modelStats(bk3d::FileHeader* pHeader)
+{
+    CacheStats stats = { 0, 0, 0 };
+    std::vector<unsigned int> indices;
+    for(int i=0; i<pHeader->pMeshes->n; i++)
+    {
+        bk3d::Mesh* pMesh = pHeader->pMeshes->p[i];
+        for(int pg=0; pg<pMesh->pPrimGroups->n; pg++)
+            if(isOptimizable(pMesh->pPrimGroups->p[pg]))
+            {
+                readIndices(pMesh->pPrimGroups->p[pg], indices);
+                simulateCache(indices, stats);
+            }
+    }
+    return stats;
+}
+static void printStats(const char* what, const CacheStats &stats)
+{
+    printf("%s : %lld triangles, ACMR %.3f, ATVR %.3f (FIFO of %d)\n", what, stats.triangles,
+        stats.triangles ? (double)stats.misses / (double)stats.triangles : 0.0,
+        stats.vertices ? (double)stats.misses / (double)stats.vertices : 0.0, CACHE_SIZE);
+}
+
+int main(int argc, char** argv)
+{
+    const char* inName = NULL;
+    const char* outName = NULL;
+    bool bOverdraw = false;
+    for(int i=1; i<argc; i++)
+    {
+        if(!strcmp(argv[i], "-d"))
+            bOverdraw = true;
+        else if(!inName)
+            inName = argv[i];
+        else
+            outName = argv[i];
+    }
+    if(!inName)
+    {
+        printf("bk3d_optimize <in.bk3d.gz> [out.bk3d[.gz]] [-d]\n");
+        return 1;
+    }
+    //
+    // get the raw bytes of the original file : gzread() also reads uncompressed files.
+    // Work on a resolved copy; the changes go back to the raw bytes at the same offsets
+    //
+    gzFile fd = gzopen(inName, "rb");
+    if(!fd)
+    {
+        printf("Error : couldn't open %s\n", inName);
+        return 1;
+    }
+    std::vector<char> raw;
+    char buf[1<<16];
+    int n;
+    while((n = gzread(fd, buf, sizeof(buf))) > 0)
+        raw.insert(raw.end(), buf, buf + n);
+    gzclose(fd);
+    bk3d::FileHeader* pRawHeader = raw.empty() ? NULL : (bk3d::FileHeader*)&raw[0];
+    if((raw.size() < sizeof(bk3d::FileHeader)) || (pRawHeader->version != RAWMESHVERSION) || (pRawHeader->nodeByteSize > raw.size()))
+    {
+        printf("Error : %s isn't a bk3d file of version %x\n", inName, RAWMESHVERSION);
+        return 1;
+    }
+    std::vector<char> work(raw);
+    bk3d::FileHeader* pHeader = (bk3d::FileHeader*)&work[0];
+    pHeader->resolvePointers(&work[0] + pHeader->nodeByteSize);
+    printStats("before", modelStats(pHeader));
+    if(!outName)
+        return 0;
+    int numPGs = 0, numMeshes = 0;
+    std::vector<unsigned int> indices;
+    for(int i=0; i<pHeader->pMeshes->n; i++)
+    {
+        bk3d::Mesh* pMesh = pHeader->pMeshes->p[i];
+        bk3d::Attribute* pPos = pMesh->pAttributes->n ? (bk3d::Attribute*)pMesh->pAttributes->p[0] : NULL;
+        bool bPositions = bOverdraw && pPos && (pPos->formatGL == GL_FLOAT) && (pPos->numComp >= 3)
+            && (pPos->slot < (unsigned int)pMesh->pSlots->n);
+        for(int pg=0; pg<pMesh->pPrimGroups->n; pg++)
+        {
+            bk3d::PrimGroup* pPG = pMesh->pPrimGroups->p[pg];
+            if(!isOptimizable(pPG))
+                continue;
+            readIndices(pPG, indices);
+            optimizeVertexCache(indices);
+            if(bPositions && (pPG->maxIndex < pMesh->pSlots->p[pPos->slot]->vertexCount))
+                optimizeOverdraw(indices, pPos);
+            writeIndices(pPG, indices);
+            numPGs++;
+        }
+        if(optimizeVertexFetch(pMesh))
+            numMeshes++;
+        //
+        // back to the raw file : index and vertex data, min/max indices
+        //
+        char* pBufferArea = &work[0] + pHeader->nodeByteSize;
+        char* pRawBufferArea = &raw[0] + pHeader->nodeByteSize;
+        for(int s=0; s<pMesh->pSlots->n; s++)
+        {
+            bk3d::Slot* pS = pMesh->pSlots->p[s];
+            memcpy(pRawBufferArea + ((char*)pS->pVtxBufferData - pBufferArea), pS->pVtxBufferData, pS->vtxBufferSizeBytes);
+        }
+        for(int pg=0; pg<pMesh->pPrimGroups->n; pg++)
+        {
+            bk3d::PrimGroup* pPG = pMesh->pPrimGroups->p[pg];
+            if(pPG->indexArrayByteSize > 0)
+                memcpy(pRawBufferArea + ((char*)pPG->pIndexBufferData - pBufferArea), pPG->pIndexBufferData, pPG->indexArrayByteSize);
+            bk3d::PrimGroup* pRawPG = (bk3d::PrimGroup*)(&raw[0] + ((char*)pPG - &work[0]));
+            pRawPG->minIndex = pPG->minIndex;
+            pRawPG->maxIndex = pPG->maxIndex;
+        }
+    }
+    printStats("after ", modelStats(pHeader));
+    printf("%d primitive groups reordered, vertices of %d meshes reordered\n", numPGs, numMeshes);
+    //
+    // write
+    //
+    const char* ext = strrchr(outName, '.');
+    bool bGz = ext && !strcmp(ext, ".gz");
+    gzFile gzout = bGz ? gzopen(outName, "wb") : NULL;
+    FILE* fout = bGz ? NULL : fopen(outName, "wb");
+    if(!gzout && !fout)
+    {
+        printf("Error : couldn't create %s\n", outName);
+        return 1;
+    }
+    if(gzout)
+    {
+        for(size_t o=0; o<raw.size(); o += 1<<30)
+            gzwrite(gzout, &raw[o], (unsigned int)(raw.size() - o < (1<<30) ? raw.size() - o : (1<<30)));
+        gzclose(gzout);
+    } else {
+        fwrite(&raw[0], 1, raw.size(), fout);
+        fclose(fout);
+    }
+    return 0;
+}
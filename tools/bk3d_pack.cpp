@@ -0,0 +1,179 @@
+/*-----------------------------------------------------------------------
+    Copyright (c) 2013, Tristan Lorach. All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+     * Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+     * Neither the name of its contributors may be used to endorse
+       or promote products derived from this software without specific
+       prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+    EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+    PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+    CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+    EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+    PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+    PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+    OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+    feedback to lorachnroll@gmail.com (Tristan Lorach)
+*/ //--------------------------------------------------------------------
+//
+// gathers many .bk3d, .bk3d.gz or .bk3dr files in one pack archive (see bk3dFile.h).
+// Models are found back by their file name, without folders. Files of the same content
+// are only stored once.
+//
+// bk3d_pack [-z] <out.bk3dp> <in.bk3d.gz> [in2.bk3d.gz...]
+//
+// -z : compress each model in the pack. It can't be mapped anymore, but only one read is
+// needed to get it
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include "bk3dEx.h"
+#include "bk3dFile.h"
+
+static unsigned long long hashBytes(const std::vector<unsigned char> &data)
+{
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    for(size_t i=0; i<data.size(); i++)
+        h = (h ^ data[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+int main(int argc, char** argv)
+{
+    int arg = 1;
+    bool bCompress = (argc > 1) && !strcmp(argv[1], "-z");
+    if(bCompress)
+        arg++;
+    if(argc - arg < 2)
+    {
+        printf("bk3d_pack [-z] <out.bk3dp> <in.bk3d.gz> [in2.bk3d.gz...]\n");
+        return 1;
+    }
+    const char* outName = argv[arg++];
+    FILE* fout = fopen(outName, "wb");
+    if(!fout)
+    {
+        printf("Error : couldn't create %s\n", outName);
+        return 1;
+    }
+    //
+    // room for the table of contents, filled at the end
+    //
+    std::vector<bk3d::PackEntry> toc(argc - arg);
+    memset(&toc[0], 0, toc.size() * sizeof(bk3d::PackEntry));
+    bk3d::PackFileHeader ph = { PACKFILE_MAGIC, PACKFILE_VERSION, (unsigned int)toc.size(), 0 };
+    unsigned long long fileSz = sizeof(ph) + toc.size() * sizeof(bk3d::PackEntry);
+    std::vector<unsigned char> pad(PACKFILE_ALIGNMENT, 0);
+    fwrite(&ph, sizeof(ph), 1, fout);
+    fwrite(&toc[0], sizeof(bk3d::PackEntry), toc.size(), fout);
+    // images already in the pack, by content
+    std::multimap<unsigned long long, int> images;
+    int numShared = 0;
+    for(int i=0; i<(int)toc.size(); i++)
+    {
+        const char* inName = argv[arg + i];
+        const char* name = inName;
+        for(const char* c = inName; *c; c++)
+            if((*c == '/') || (*c == '\\'))
+                name = c + 1;
+        if(strlen(name) >= PACKFILE_NAMESZ)
+        {
+            printf("Error : name of %s too long\n", inName);
+            return 1;
+        }
+        for(int j=0; j<i; j++)
+            if(!strcmp(toc[j].name, name))
+            {
+                printf("Error : %s is in the pack twice\n", name);
+                return 1;
+            }
+        strcpy(toc[i].name, name);
+        //
+        // get the raw bytes of the original file : gzread() also reads uncompressed files
+        //
+        gzFile fd = gzopen(inName, "rb");
+        if(!fd)
+        {
+            printf("Error : couldn't open %s\n", inName);
+            return 1;
+        }
+        std::vector<unsigned char> raw;
+        unsigned char buf[1<<16];
+        int n;
+        while((n = gzread(fd, buf, sizeof(buf))) > 0)
+            raw.insert(raw.end(), buf, buf + n);
+        gzclose(fd);
+        bk3d::RelocatedFileHeader* pRH = raw.empty() ? NULL : (bk3d::RelocatedFileHeader*)&raw[0];
+        size_t headerOffset = (raw.size() >= RELOCATEDFILE_HEADERSZ) && (pRH->magic == RELOCATEDFILE_MAGIC) ? RELOCATEDFILE_HEADERSZ : 0;
+        bk3d::FileHeader* pHeader = raw.size() > headerOffset ? (bk3d::FileHeader*)&raw[headerOffset] : NULL;
+        if((raw.size() < headerOffset + sizeof(bk3d::FileHeader)) || (pHeader->version != RAWMESHVERSION) || (headerOffset + pHeader->nodeByteSize > raw.size()))
+        {
+            printf("Error : %s isn't a bk3d file of version %x\n", inName, RAWMESHVERSION);
+            return 1;
+        }
+        //
+        // same content as a previous file : share its image
+        //
+        unsigned long long h = hashBytes(raw);
+        bool shared = false;
+        for(std::multimap<unsigned long long, int>::iterator it = images.lower_bound(h); (it != images.end()) && (it->first == h); ++it)
+            if(toc[it->second].rawSize == raw.size())
+            {
+                toc[i].fileOffset = toc[it->second].fileOffset;
+                toc[i].size = toc[it->second].size;
+                toc[i].rawSize = toc[it->second].rawSize;
+                toc[i].flags = toc[it->second].flags;
+                shared = true;
+                numShared++;
+                break;
+            }
+        if(shared)
+        {
+            printf("%s : same as a previous file\n", name);
+            continue;
+        }
+        images.insert(std::make_pair(h, i));
+        //
+        // new image, aligned so that it can be mapped on its own
+        //
+        unsigned long long padSz = (PACKFILE_ALIGNMENT - (fileSz % PACKFILE_ALIGNMENT)) % PACKFILE_ALIGNMENT;
+        fwrite(&pad[0], 1, (size_t)padSz, fout);
+        fileSz += padSz;
+        toc[i].fileOffset = fileSz;
+        toc[i].rawSize = raw.size();
+        if(bCompress)
+        {
+            std::vector<unsigned char> compressed(compressBound((uLong)raw.size()));
+            uLongf sz = (uLongf)compressed.size();
+            if(compress2(&compressed[0], &sz, &raw[0], (uLong)raw.size(), Z_BEST_COMPRESSION) != Z_OK)
+            {
+                printf("Error : couldn't compress %s\n", inName);
+                return 1;
+            }
+            fwrite(&compressed[0], 1, sz, fout);
+            toc[i].size = sz;
+            toc[i].flags = PACKENTRY_COMPRESSED;
+        } else {
+            fwrite(&raw[0], 1, raw.size(), fout);
+            toc[i].size = raw.size();
+        }
+        fileSz += toc[i].size;
+        printf("%s : %lld bytes at %lld\n", name, (long long)toc[i].size, (long long)toc[i].fileOffset);
+    }
+    fseek(fout, sizeof(ph), SEEK_SET);
+    fwrite(&toc[0], sizeof(bk3d::PackEntry), toc.size(), fout);
+    fclose(fout);
+    printf("%s : %d models, %d shared, %lld bytes\n", outName, (int)toc.size(), numShared, (long long)fileSz);
+    return 0;
+}
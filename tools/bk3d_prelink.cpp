@@ -0,0 +1,110 @@
+/*-----------------------------------------------------------------------
+    Copyright (c) 2013, Tristan Lorach. All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+     * Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+     * Neither the name of its contributors may be used to endorse
+       or promote products derived from this software without specific
+       prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+    EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+    PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+    CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+    EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+    PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+    PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+    OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+    feedback to lorachnroll@gmail.com (Tristan Lorach)
+*/ //--------------------------------------------------------------------
+//
+// converts a .bk3d or .bk3d.gz file into a prelinked image (see bk3dFile.h) that
+// bk3d::mapFile() can use without any relocation pass
+//
+// bk3d_prelink <in.bk3d.gz> <out.bk3dr> [preferred base address, in hexadecimal]
+//
+// When many models get loaded, each of them needs its own base address. By default
+// it is derived from the output file name
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bk3dEx.h"
+#include "bk3dFile.h"
+
+int main(int argc, char** argv)
+{
+    if(argc < 3)
+    {
+        printf("bk3d_prelink <in.bk3d.gz> <out.bk3dr> [preferred base address, in hexadecimal]\n");
+        return 1;
+    }
+    //
+    // default base : one 4Gb range above 32Tb for each file name
+    //
+    unsigned long long base;
+    if(argc > 3)
+        base = strtoull(argv[3], NULL, 16);
+    else {
+        const char* name = strrchr(argv[2], '/');
+        name = name ? name+1 : argv[2];
+        unsigned int h = 5381;
+        for(const char* c = name; *c; c++)
+            h = h*33 + *c;
+        base = 0x200000000000ULL + ((unsigned long long)(h & 0xFFF) << 32);
+    }
+    base &= ~(unsigned long long)(RELOCATEDFILE_HEADERSZ-1);
+    //
+    // get the raw bytes of the original file : gzread() also reads uncompressed files
+    //
+    gzFile fd = gzopen(argv[1], "rb");
+    if(!fd)
+    {
+        printf("Error : couldn't open %s\n", argv[1]);
+        return 1;
+    }
+    std::vector<unsigned char> raw;
+    unsigned char buf[1<<16];
+    int n;
+    while((n = gzread(fd, buf, sizeof(buf))) > 0)
+        raw.insert(raw.end(), buf, buf + n);
+    gzclose(fd);
+    bk3d::FileHeader* pHeader = raw.empty() ? NULL : (bk3d::FileHeader*)&raw[0];
+    if((raw.size() < sizeof(bk3d::FileHeader)) || (pHeader->version != RAWMESHVERSION) || (pHeader->nodeByteSize > raw.size()))
+    {
+        printf("Error : %s isn't a bk3d file of version %x\n", argv[1], RAWMESHVERSION);
+        return 1;
+    }
+    //
+    // resolve where we are, then move everything to where the image will be mapped
+    //
+    char* pBufferArea = (char*)pHeader + pHeader->nodeByteSize;
+    pHeader->resolvePointers(pBufferArea);
+    bk3d::rebasePointers(pHeader, pBufferArea, (unsigned long long)pHeader, base + RELOCATEDFILE_HEADERSZ);
+    //
+    // write
+    //
+    FILE* fout = fopen(argv[2], "wb");
+    if(!fout)
+    {
+        printf("Error : couldn't create %s\n", argv[2]);
+        return 1;
+    }
+    std::vector<unsigned char> header(RELOCATEDFILE_HEADERSZ, 0);
+    bk3d::RelocatedFileHeader* pRH = (bk3d::RelocatedFileHeader*)&header[0];
+    pRH->magic = RELOCATEDFILE_MAGIC;
+    pRH->version = RELOCATEDFILE_VERSION;
+    pRH->preferredBase = base;
+    fwrite(&header[0], 1, header.size(), fout);
+    fwrite(&raw[0], 1, raw.size(), fout);
+    fclose(fout);
+    printf("%s : %lld bytes prelinked at 0x%llx\n", argv[2], (long long)raw.size(), base);
+    return 0;
+}
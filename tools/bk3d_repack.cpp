@@ -0,0 +1,287 @@
+/*-----------------------------------------------------------------------
+    Copyright (c) 2013, Tristan Lorach. All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+     * Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+     * Neither the name of its contributors may be used to endorse
+       or promote products derived from this software without specific
+       prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+    EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+    PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+    CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+    EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+    PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+    PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+    OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+    feedback to lorachnroll@gmail.com (Tristan Lorach)
+*/ //--------------------------------------------------------------------
+//
+// rewrites a bk3d file so that its buffer area is the exact image of the
+// buffer objects the sample creates (see Bk3dModel::initBuffersObject()):
+// the 256 bytes aligned vertex data of each VBO, followed by the 256 bytes
+// aligned index data of each EBO.
+// Meshes are sorted by material and topology on the way.
+// The sample then uploads each buffer object with a single copy
+//
+// bk3d_repack <in.bk3d.gz> <out.bk3d[.gz]> [VBO max Size in Mb]
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <algorithm>
+#include "bk3dEx.h"
+#include "bk3dFile.h"
+
+//
+// where a range of the original buffer area went
+//
+struct Range
+{
+    unsigned long long oldOffset;
+    unsigned long long size;
+    unsigned long long newOffset;
+    bool operator<(const Range &r) const { return oldOffset < r.oldOffset; }
+};
+
+static unsigned long long remap(const std::vector<Range> &ranges, unsigned long long o)
+{
+    // ranges are sorted : the last one starting before o is the candidate. Overlapping
+    // ranges (shared index buffers) have the same content so the first found is fine
+    std::vector<Range>::const_iterator it = std::upper_bound(ranges.begin(), ranges.end(), Range { o, 0, 0 });
+    while(it != ranges.begin())
+    {
+        --it;
+        if((o >= it->oldOffset) && (o < it->oldOffset + it->size))
+            return it->newOffset + (o - it->oldOffset);
+    }
+    return o; // can't happen: the gaps are ranges, too
+}
+
+static unsigned long long align256(unsigned long long sz) { return (sz + 0xFF) & ~0xFFULL; }
+
+static bk3d::Material* firstMaterial(bk3d::Mesh* pMesh)
+{
+    for(int pg=0; pg<pMesh->pPrimGroups->n; pg++)
+        if(pMesh->pPrimGroups->p[pg]->pMaterial)
+            return pMesh->pPrimGroups->p[pg]->pMaterial;
+    return NULL;
+}
+static bool meshLess(bk3d::Mesh* a, bk3d::Mesh* b)
+{
+    bk3d::Material* ma = firstMaterial(a);
+    bk3d::Material* mb = firstMaterial(b);
+    int ida = ma ? (int)ma->ID : -1;
+    int idb = mb ? (int)mb->ID : -1;
+    if(ida != idb)
+        return ida < idb;
+    GLenum ta = a->pPrimGroups->n ? a->pPrimGroups->p[0]->topologyGL : 0;
+    GLenum tb = b->pPrimGroups->n ? b->pPrimGroups->p[0]->topologyGL : 0;
+    return ta < tb;
+}
+
+int main(int argc, char** argv)
+{
+    if(argc < 3)
+    {
+        printf("bk3d_repack <in.bk3d.gz> <out.bk3d[.gz]> [VBO max Size in Mb] [EBO max Size in Mb]\n");
+        return 1;
+    }
+    unsigned long long maxBOSz = (unsigned long long)(argc > 3 ? atoi(argv[3]) : 200000) * 1024*1024;
+    unsigned long long maxEBOSz = (unsigned long long)(argc > 4 ? atoi(argv[4]) : 200000) * 1024*1024;
+    //
+    // get the raw bytes of the original file : gzread() also reads uncompressed files
+    //
+    gzFile fd = gzopen(argv[1], "rb");
+    if(!fd)
+    {
+        printf("Error : couldn't open %s\n", argv[1]);
+        return 1;
+    }
+    std::vector<char> raw;
+    char buf[1<<16];
+    int n;
+    while((n = gzread(fd, buf, sizeof(buf))) > 0)
+        raw.insert(raw.end(), buf, buf + n);
+    gzclose(fd);
+    bk3d::FileHeader* pHeader = raw.empty() ? NULL : (bk3d::FileHeader*)&raw[0];
+    if((raw.size() < sizeof(bk3d::FileHeader)) || (pHeader->version != RAWMESHVERSION) || (pHeader->nodeByteSize > raw.size()))
+    {
+        printf("Error : %s isn't a bk3d file of version %x\n", argv[1], RAWMESHVERSION);
+        return 1;
+    }
+    unsigned long long nodeByteSize = pHeader->nodeByteSize;
+    char* pHeaderArea = &raw[0];
+    char* pOldBuffer = &raw[0] + nodeByteSize;
+    unsigned long long oldBufferSz = raw.size() - nodeByteSize;
+    pHeader->resolvePointers(pOldBuffer);
+    bk3d::RelocationTable* pTable = pHeader->pRelocationTable;
+    bk3d::RelocationTable::Offsets* pOffsets = pTable->pRelocationOffsets;
+    // relocation entries by the location of their pointer
+    std::map<unsigned long long, int> entries;
+    for(int i=0; i<pTable->numRelocationOffsets; i++)
+        if(pOffsets[i].ptrOffset)
+            entries[pOffsets[i].ptrOffset] = i;
+    #define OFFSETOF(p) ((unsigned long long)((char*)(p) - pHeaderArea))
+    //
+    // sort the meshes : the entries of the mesh pool follow their pointer
+    //
+    bk3d::MeshPool* pMeshes = pHeader->pMeshes;
+    std::vector<bk3d::Mesh*> meshes(pMeshes->n);
+    std::map<bk3d::Mesh*, unsigned int> meshTargets;
+    for(int i=0; i<pMeshes->n; i++)
+    {
+        meshes[i] = pMeshes->p[i];
+        meshTargets[meshes[i]] = pOffsets[entries[OFFSETOF(&pMeshes->p[i])]].offset;
+    }
+    std::stable_sort(meshes.begin(), meshes.end(), meshLess);
+    for(int i=0; i<pMeshes->n; i++)
+    {
+        pMeshes->p[i] = meshes[i];
+        pOffsets[entries[OFFSETOF(&pMeshes->p[i])]].offset = meshTargets[meshes[i]];
+    }
+    //
+    // same layout as Bk3dModel::initBuffersObject() : VBOs and EBOs planned separately
+    //
+    struct Item { char* pData; unsigned long long size; unsigned long long boOffset; unsigned long long ptrLocation; };
+    std::vector<unsigned long long> vtxSz(pMeshes->n, 0), idxSz(pMeshes->n, 0);
+    for(int i=0; i<pMeshes->n; i++)
+    {
+        bk3d::Mesh* pMesh = pMeshes->p[i];
+        for(int s=0; s<pMesh->pSlots->n; s++)
+            vtxSz[i] += align256(pMesh->pSlots->p[s]->vtxBufferSizeBytes);
+        for(int pg=0; pg<pMesh->pPrimGroups->n; pg++)
+            idxSz[i] += align256(pMesh->pPrimGroups->p[pg]->indexArrayByteSize);
+    }
+    std::vector<int> vboOf, eboOf;
+    std::vector< std::vector<Item> > vbos(bk3d::planBuffers(vtxSz, maxBOSz, vboOf)), ebos(bk3d::planBuffers(idxSz, maxEBOSz, eboOf));
+    std::vector<unsigned long long> vboSz(vbos.size(), 0), eboSz(ebos.size(), 0);
+    for(int i=0; i<pMeshes->n; i++)
+    {
+        bk3d::Mesh* pMesh = pMeshes->p[i];
+        for(int s=0; s<pMesh->pSlots->n; s++)
+        {
+            bk3d::Slot* pS = pMesh->pSlots->p[s];
+            Item it = { (char*)pS->pVtxBufferData, pS->vtxBufferSizeBytes, vboSz[vboOf[i]], OFFSETOF(&pS->pVtxBufferData) };
+            vbos[vboOf[i]].push_back(it);
+            vboSz[vboOf[i]] += align256(pS->vtxBufferSizeBytes);
+        }
+        for(int pg=0; pg<pMesh->pPrimGroups->n; pg++)
+        {
+            bk3d::PrimGroup* pPG = pMesh->pPrimGroups->p[pg];
+            if(pPG->indexArrayByteSize == 0)
+                continue;
+            Item it = { (char*)pPG->pIndexBufferData, pPG->indexArrayByteSize, eboSz[eboOf[i]], OFFSETOF(&pPG->pIndexBufferData) };
+            ebos[eboOf[i]].push_back(it);
+            eboSz[eboOf[i]] += align256(pPG->indexArrayByteSize);
+        }
+    }
+    //
+    // new buffer area : VBO0 VBO1... EBO0 EBO1... then whatever else was in the buffer area
+    //
+    std::vector<char> newBuffer;
+    std::vector<Range> ranges;
+    std::map<unsigned long long, unsigned long long> newTargets; // pointer location -> new offset in the buffer area
+    for(int k=0; k<2; k++)
+        for(size_t g=0; g<(k ? ebos.size() : vbos.size()); g++)
+        {
+            std::vector<Item> &items = k ? ebos[g] : vbos[g];
+            unsigned long long base = newBuffer.size();
+            newBuffer.resize(base + (k ? eboSz[g] : vboSz[g]), 0);
+            for(size_t i=0; i<items.size(); i++)
+            {
+                Item &it = items[i];
+                unsigned long long oldOffset = (unsigned long long)(it.pData - pOldBuffer);
+                memcpy(&newBuffer[base + it.boOffset], it.pData, it.size);
+                Range r = { oldOffset, it.size, base + it.boOffset };
+                ranges.push_back(r);
+                newTargets[it.ptrLocation] = base + it.boOffset;
+            }
+        }
+    unsigned long long payloadSz = newBuffer.size();
+    //
+    // gaps of the old buffer area not covered by vertex or index data go at the end
+    //
+    std::sort(ranges.begin(), ranges.end());
+    std::vector<Range> gaps;
+    unsigned long long covered = 0;
+    for(size_t i=0; i<=ranges.size(); i++)
+    {
+        unsigned long long start = i < ranges.size() ? ranges[i].oldOffset : oldBufferSz;
+        if(start > covered)
+        {
+            Range r = { covered, start - covered, newBuffer.size() };
+            newBuffer.insert(newBuffer.end(), pOldBuffer + covered, pOldBuffer + start);
+            gaps.push_back(r);
+        }
+        if((i < ranges.size()) && (ranges[i].oldOffset + ranges[i].size > covered))
+            covered = ranges[i].oldOffset + ranges[i].size;
+    }
+    ranges.insert(ranges.end(), gaps.begin(), gaps.end());
+    std::sort(ranges.begin(), ranges.end());
+    //
+    // relocation table : pointers to the buffer area, and pointers located in it
+    //
+    for(int i=0; i<pTable->numRelocationOffsets; i++)
+    {
+        bk3d::RelocationTable::Offsets &e = pOffsets[i];
+        if(e.ptrOffset == 0)
+            continue;
+        if(e.offset >= nodeByteSize)
+        {
+            std::map<unsigned long long, unsigned long long>::iterator it = newTargets.find(e.ptrOffset);
+            e.offset = (unsigned int)(nodeByteSize + (it != newTargets.end() ? it->second : remap(ranges, e.offset - nodeByteSize)));
+        }
+        if(e.ptrOffset >= nodeByteSize)
+            e.ptrOffset = (unsigned int)(nodeByteSize + remap(ranges, e.ptrOffset - nodeByteSize));
+    }
+    //
+    // back to offsets (64 bits wide), the way the file is stored
+    //
+    for(int i=0; i<pTable->numRelocationOffsets; i++)
+    {
+        bk3d::RelocationTable::Offsets &e = pOffsets[i];
+        if(e.ptrOffset == 0)
+            continue;
+        char* ptr = e.ptrOffset >= nodeByteSize ? &newBuffer[e.ptrOffset - nodeByteSize] : pHeaderArea + e.ptrOffset;
+        if(*(unsigned long long*)ptr)
+            *(unsigned long long*)ptr = e.offset;
+    }
+    pTable->pRelocationOffsets = (bk3d::RelocationTable::Offsets*)((char*)pTable->pRelocationOffsets - pHeaderArea);
+    pHeader->pRelocationTable = (bk3d::RelocationTable*)((char*)pHeader->pRelocationTable - pHeaderArea);
+    //
+    // write
+    //
+    const char* ext = strrchr(argv[2], '.');
+    bool bGz = ext && !strcmp(ext, ".gz");
+    gzFile gzout = bGz ? gzopen(argv[2], "wb") : NULL;
+    FILE* fout = bGz ? NULL : fopen(argv[2], "wb");
+    if(!gzout && !fout)
+    {
+        printf("Error : couldn't create %s\n", argv[2]);
+        return 1;
+    }
+    if(gzout)
+    {
+        gzwrite(gzout, pHeaderArea, (unsigned int)nodeByteSize);
+        for(size_t o=0; o<newBuffer.size(); o += 1<<30)
+            gzwrite(gzout, &newBuffer[o], (unsigned int)(newBuffer.size() - o < (1<<30) ? newBuffer.size() - o : (1<<30)));
+        gzclose(gzout);
+    } else {
+        fwrite(pHeaderArea, 1, nodeByteSize, fout);
+        fwrite(&newBuffer[0], 1, newBuffer.size(), fout);
+        fclose(fout);
+    }
+    printf("%s : %d meshes in %d VBO/EBO pairs (%lld bytes of vertex and index data, %lld bytes of other data)\n",
+        argv[2], pMeshes->n, (int)vbos.size(), payloadSz, (long long)(newBuffer.size() - payloadSz));
+    return 0;
+}